@@ -0,0 +1,1394 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "jpg.h"
+#include "jpgenc.c"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define BENCH_HAVE_PERF
+#endif
+
+
+/* The benchmark encodes its own corpus, so that it's the same everywhere
+ * and needs no image files: synthetic images of various sizes, qualities
+ * and layouts, with and without restart intervals. Each image is decoded
+ * from memory a number of times, and the pixels of the last decode are
+ * checked against the golden checksums for the kernels in use */
+
+typedef struct
+{
+    const char    * name;
+    uint16_t        width;
+    uint16_t        height;
+    uint8_t         nc;             // 1 = grayscale, 3 = colour (YCbCr), 4 = CMYK or YCCK
+    uint8_t         transform;      // Of 4 components, as the Adobe segment: 0 = CMYK, 2 = YCCK
+    uint8_t         hsf;            // Blocks of the first component (and the black of YCCK) across an MCU
+    uint8_t         vsf;            // and down
+    uint8_t         chroma;         // Blocks of the other components across and down, Hi << 4 | Vi
+    uint8_t         quality;
+    uint16_t        restart;        // MCUs per restart interval (0 = none)
+}
+benchImage;
+
+
+static const benchImage corpus[] =
+{
+    { "small-420-q75",      320,  240, 3, 0, 2, 2, 0x11, 75,   0 },
+    { "hd-444-q75",        1920, 1080, 3, 0, 1, 1, 0x11, 75,   0 },
+    { "hd-422-q75",        1920, 1080, 3, 0, 2, 1, 0x11, 75,   0 },
+    { "hd-420-q75",        1920, 1080, 3, 0, 2, 2, 0x11, 75,   0 },
+    { "hd-gray-q75",       1920, 1080, 1, 0, 1, 1, 0x11, 75,   0 },
+    { "hd-420-q50",        1920, 1080, 3, 0, 2, 2, 0x11, 50,   0 },
+    { "hd-420-q95",        1920, 1080, 3, 0, 2, 2, 0x11, 95,   0 },
+    { "hd-440-q75",        1920, 1080, 3, 0, 1, 2, 0x11, 75,   0 },
+    { "hd-411-q75",        1920, 1080, 3, 0, 4, 1, 0x11, 75,   0 },
+    { "hd-422-c1x2-q75",   1920, 1080, 3, 0, 2, 2, 0x12, 75,   0 },
+    { "hd-cmyk-q75",       1920, 1080, 4, 0, 1, 1, 0x11, 75,   0 },
+    { "hd-ycck-420-q75",   1920, 1080, 4, 2, 2, 2, 0x11, 75,   0 },
+    { "hd-444-q75-dri",    1920, 1080, 3, 0, 1, 1, 0x11, 75, 240 },
+    { "hd-422-q75-dri",    1920, 1080, 3, 0, 2, 1, 0x11, 75, 120 },
+    { "hd-420-q75-dri",    1920, 1080, 3, 0, 2, 2, 0x11, 75, 120 },
+    { "hd-411-q75-dri",    1920, 1080, 3, 0, 4, 1, 0x11, 75,  60 },
+    { "hd-gray-q75-dri",   1920, 1080, 1, 0, 1, 1, 0x11, 75, 240 },
+    { "12mp-420-q85",      4000, 3000, 3, 0, 2, 2, 0x11, 85,   0 },
+    { "12mp-420-q85-dri",  4000, 3000, 3, 0, 2, 2, 0x11, 85, 250 }
+};
+
+#define BENCH_IMAGES    (sizeof(corpus) / sizeof(corpus[0]))
+
+// Bytes per pixel of the image an entry is encoded from (colour for CMYK and YCCK too)
+#define BENCH_CHANNELS(image)   ( (image)->nc == 1 ? 1 : 3 )
+
+
+// Hardware counters, per decode (-1 if they can't be read)
+#define BENCH_CYCLES            0
+#define BENCH_INSTRUCTIONS      1
+#define BENCH_BRANCH_MISSES     2
+#define BENCH_CACHE_MISSES      3
+#define BENCH_COUNTERS          4
+
+static const char * counterNames[BENCH_COUNTERS] = { "cycles", "instructions", "branch_misses", "cache_misses" };
+
+
+/* Other ways of decoding an image, each of which must give the pixels of 
+ * the plain decode (single threaded, into an XRGB surface). The threads
+ * decode images with restart intervals in bands, and the others through 
+ * the pipeline of rows of MCUs */
+#define BENCH_REGION            0
+#define BENCH_ROWS              1
+#define BENCH_PLANES            2
+#define BENCH_THREADS           3
+#define BENCH_BATCH             4
+#define BENCH_CONTEXT           5
+#define BENCH_MEMORY            6
+#define BENCH_FORMATS           7
+#define BENCH_SCALED            8
+#define BENCH_PATHS             9
+
+static const char * pathNames[BENCH_PATHS] = { "region", "rows", "planes", "threads", "batch", "context", "memory",
+                                               "formats", "scaled" };
+
+// Bytes left between the rows of the surfaces of every format, and after the last one
+#define BENCH_ROW_GAP           8
+#define BENCH_GUARD             64
+#define BENCH_POISON            0xA5
+
+// Least PSNR the decoded corpus must have against the images it was encoded from
+#define BENCH_MIN_PSNR          30.0
+
+// Least PSNR of the 1/2, 1/4 and 1/8 size decodes against the plain decode, averaged down
+#define BENCH_MIN_SCALED_PSNR   32.0
+
+
+typedef struct
+{
+    size_t          bytes;          // Size of the encoded image
+    double          mpps;           // Megapixels decoded per second
+    double          latency[5];     // Milliseconds per decode: min, p50, p90, p99 and max
+    int64_t         counters[BENCH_COUNTERS];
+    uint64_t        checksum;       // Of the pixels of the last decode
+    const char    * golden;         // "ok", "mismatch", "missing" or "failed" (the image didn't decode)
+    double          psnr;           // Of the plain decode, against the image it was encoded from
+    double          fastPsnr;       // Of the decode with the fast IDCT
+    double          scaledPsnr;     // Least of the 1/2, 1/4 and 1/8 size decodes, against the plain decode averaged down
+    uint64_t        fastChecksum;
+    const char    * fastGolden;
+    const char    * paths[BENCH_PATHS];     // "ok", "differs", "overrun" (formats) or "failed" (the path didn't decode)
+}
+benchResult;
+
+
+typedef struct
+{
+    char            kernels[16];
+    char            name[64];
+    uint64_t        checksum;
+}
+goldenEntry;
+
+
+static double now(void)
+{
+struct timespec     ts;
+
+#if defined(__unix__) || defined(__APPLE__)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    timespec_get(&ts, TIME_UTC);
+#endif
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/* Encodes an image of the corpus: the first component (and the black of
+ * YCCK) is sampled hsf x vsf, the others as the chroma of the entry says */
+
+static size_t encodeImage(uint8_t ** data, const uint8_t * pixels, const benchImage * image)
+{
+JPGENC_LAYOUT   layout;
+uint8_t         c, luma;
+
+
+    layout.nc        = image->nc;
+    layout.transform = image->transform;
+
+    for( c = 0; c < 4; c++ )
+    {
+        luma        = c == 0 || (c == 3 && image->transform == 2);
+        layout.H[c] = luma ? image->hsf : image->chroma >> 4;
+        layout.V[c] = luma ? image->vsf : image->chroma & 15;
+    }
+
+    return jpgenc_encodeLayout(data, pixels, image->width, image->height, &layout, image->quality, image->restart);
+}
+
+
+/* Synthetic content: smooth gradients and waves, hard edged shapes and a
+ * little noise, so that images have both flat areas and detail, much like
+ * photographs do. Integer only, so that the corpus is the same everywhere */
+
+static uint8_t * makeImage(const benchImage * image)
+{
+uint8_t *   pixels;
+uint8_t *   p;
+uint32_t    x, y;
+uint32_t    noise = 2463534242u;
+int32_t     wave, value, dx, dy;
+uint8_t     c;
+
+
+    pixels = malloc( (size_t)image->width * image->height * BENCH_CHANNELS(image) );
+    if( !pixels )
+        return NULL;
+
+    p = pixels;
+    for( y = 0; y < image->height; y++ )
+    {
+        for( x = 0; x < image->width; x++ )
+        {
+         // A triangle wave across the image
+            wave = ( (x * 3 + y * 2) % 256 );
+            wave = wave < 128 ? wave : 255 - wave;
+            dx   = (int32_t)(x % 256) - 128;
+            dy   = (int32_t)(y % 256) - 128;
+
+            for( c = 0; c < BENCH_CHANNELS(image); c++ )
+            {
+                noise ^= noise << 13;
+                noise ^= noise >> 17;
+                noise ^= noise << 5;
+
+                switch( c )
+                {
+                    case 0:  value = x * 255 / image->width + wave / 2;  break;
+                    case 1:  value = y * 255 / image->height + wave / 4; break;
+                    default: value = 255 - x * 255 / image->width;       break;
+                }
+
+             // Rectangles and rings with hard edges
+                if( (x / 96 + y / 64) % 5 == 0 )
+                    value = 255 - value;
+                if( dx * dx + dy * dy < 48 * 48 )
+                    value = value / 2 + 64 * c;
+
+                value += (int32_t)(noise & 15) - 8;
+                *p++ = (uint8_t)(value < 0 ? 0 : value > 255 ? 255 : value);
+            }
+        }
+    }
+
+    return pixels;
+}
+
+
+// FNV-1a of the pixels, ignoring their unused byte
+static uint64_t checksum(const uint32_t * pixels, size_t n)
+{
+uint64_t    hash = 14695981039346656037ull;
+size_t      i;
+uint8_t     k;
+
+
+    for( i = 0; i < n; i++ )
+    {
+        for( k = 0; k < 24; k += 8 )
+        {
+            hash ^= (pixels[i] >> k) & 0xFF;
+            hash *= 1099511628211ull;
+        }
+    }
+
+    return hash;
+}
+
+
+#ifdef BENCH_HAVE_PERF
+
+/* The counters count the calling thread and, once they've exited, the
+ * threads it creates, which covers the threads decoding an image */
+
+static void openCounters(int * fds)
+{
+static const uint32_t configs[BENCH_COUNTERS] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                  PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES };
+struct perf_event_attr  attr;
+uint8_t                 i;
+
+
+    for( i = 0; i < BENCH_COUNTERS; i++ )
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.type           = PERF_TYPE_HARDWARE;
+        attr.size           = sizeof(attr);
+        attr.config         = configs[i];
+        attr.disabled       = 1;
+        attr.inherit        = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+
+        fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+
+static void startCounters(const int * fds)
+{
+uint8_t     i;
+
+    for( i = 0; i < BENCH_COUNTERS; i++ )
+    {
+        if( fds[i] >= 0 )
+        {
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+
+static void stopCounters(const int * fds, int64_t * counters, uint32_t iterations)
+{
+uint64_t    count;
+uint8_t     i;
+
+
+    for( i = 0; i < BENCH_COUNTERS; i++ )
+    {
+        counters[i] = -1;
+        if( fds[i] < 0 )
+            continue;
+
+        ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if( read(fds[i], &count, sizeof(count)) == sizeof(count) )
+            counters[i] = (int64_t)(count / iterations);
+    }
+}
+
+
+static void closeCounters(const int * fds)
+{
+uint8_t     i;
+
+    for( i = 0; i < BENCH_COUNTERS; i++ )
+        if( fds[i] >= 0 )
+            close(fds[i]);
+}
+
+#else
+
+static void openCounters(int * fds)                                                 { memset(fds, -1, BENCH_COUNTERS * sizeof(int)); }
+static void startCounters(const int * fds)                                          { (void)fds; }
+static void stopCounters(const int * fds, int64_t * counters, uint32_t iterations)  { (void)fds; (void)iterations; memset(counters, -1, BENCH_COUNTERS * sizeof(int64_t)); }
+static void closeCounters(const int * fds)                                          { (void)fds; }
+
+#endif
+
+
+static int compareTimes(const void * a, const void * b)
+{
+double      ta = *(const double *)a;
+double      tb = *(const double *)b;
+
+    return (ta > tb) - (ta < tb);
+}
+
+
+// Nearest rank percentile of n sorted times
+static double percentile(const double * times, uint32_t n, uint32_t p)
+{
+uint32_t    rank = (p * n + 99) / 100;
+
+    return times[rank ? rank - 1 : 0];
+}
+
+
+/* Decodes an image 'iterations' times after a warm up decode, each time
+ * opening it from memory, decoding it into a surface of its size and
+ * closing it. Returns 0 if it failed to decode */
+
+static int benchImageDecode(const uint8_t * data, size_t size, const benchImage * image, uint32_t iterations,
+                            uint16_t threads, const int * fds, benchResult * result)
+{
+jpg_options_t   options;
+jpg_surface_t   surface;
+jpg_t *         jpg;
+double *        times;
+double          start, total = 0;
+uint32_t        i;
+int             ok = 1;
+
+
+    memset(&options, 0, sizeof(options));
+    options.threads = threads;
+
+    surface.width  = image->width;
+    surface.height = image->height;
+    surface.pitch  = (size_t)image->width * 4;
+    surface.format = JPG_FORMAT_XRGB;
+    surface.pixels = malloc(surface.pitch * image->height);
+    times          = malloc( (iterations + 1) * sizeof(double) );
+    if( !surface.pixels || !times )
+    {
+        free(surface.pixels);
+        free(times);
+        return 0;
+    }
+
+    for( i = 0; i <= iterations && ok; i++ )
+    {
+     // The first decode warms up the caches and isn't counted
+        if( i == 1 )
+            startCounters(fds);
+
+        start = now();
+        jpg   = jpg_open_mem_ex(data, size, &options);
+        ok    = jpg && !jpg_read_surface(&surface, jpg);
+        if( jpg )
+            jpg_close(jpg);
+        times[i] = now() - start;
+
+        if( i )
+            total += times[i];
+    }
+
+    stopCounters(fds, result->counters, iterations);
+
+    if( ok )
+    {
+        qsort(times + 1, iterations, sizeof(double), compareTimes);
+
+        result->mpps       = (double)image->width * image->height * iterations / total * 1e-6;
+        result->latency[0] = times[1] * 1e3;
+        result->latency[1] = percentile(times + 1, iterations, 50) * 1e3;
+        result->latency[2] = percentile(times + 1, iterations, 90) * 1e3;
+        result->latency[3] = percentile(times + 1, iterations, 99) * 1e3;
+        result->latency[4] = times[iterations] * 1e3;
+        result->checksum   = checksum(surface.pixels, (size_t)image->width * image->height);
+    }
+
+    free(surface.pixels);
+    free(times);
+    return ok;
+}
+
+
+// Decodes an image from memory into an XRGB surface of its size, returns 0 if it failed
+static int decodeImage(const uint8_t * data, size_t size, const jpg_options_t * options, uint32_t * pixels,
+                       const benchImage * image)
+{
+jpg_t *     jpg;
+int         ok;
+
+
+    jpg = jpg_open_mem_ex(data, size, options);
+    ok  = jpg && !jpg_read(pixels, image->width, image->height, jpg);
+    if( jpg )
+        jpg_close(jpg);
+
+    return ok;
+}
+
+
+// Peak signal to noise ratio of the red, green and blue of XRGB pixels against the image they were encoded from
+static double psnr(const uint32_t * pixels, const uint8_t * source, const benchImage * image)
+{
+size_t      i, n = (size_t)image->width * image->height;
+double      squares = 0, error;
+uint8_t     c;
+
+
+    for( i = 0; i < n; i++ )
+    {
+        for( c = 0; c < 3; c++ )
+        {
+            error    = (double)( (pixels[i] >> (16 - 8 * c)) & 0xFF ) - source[i * BENCH_CHANNELS(image) + (image->nc == 1 ? 0 : c)];
+            squares += error * error;
+        }
+    }
+
+    return squares ? 10 * log10( 255.0 * 255.0 * 3 * n / squares ) : 99.0;
+}
+
+
+// Compares n pixels, ignoring their unused byte
+static int samePixels(const uint32_t * a, const uint32_t * b, size_t n)
+{
+size_t      i;
+
+    for( i = 0; i < n; i++ )
+        if( (a[i] ^ b[i]) & 0xFFFFFF )
+            return 0;
+
+    return 1;
+}
+
+
+static const char * pathRegion(const uint8_t * data, size_t size, const benchImage * image, const uint32_t * reference)
+{
+jpg_surface_t   surface;
+jpg_t *         jpg;
+uint16_t        x, y, w, h, row;
+int             ok;
+
+
+ // A crop that doesn't start or end on a block boundary
+    x = image->width / 3 + 1;
+    y = image->height / 5 + 3;
+    w = image->width / 2 + 5;
+    h = image->height / 3 + 7;
+
+    surface.width  = w;
+    surface.height = h;
+    surface.pitch  = (size_t)w * 4;
+    surface.format = JPG_FORMAT_XRGB;
+    surface.pixels = malloc(surface.pitch * h);
+    if( !surface.pixels )
+        return "failed";
+
+    jpg = jpg_open_mem(data, size);
+    ok  = jpg && !jpg_read_region(&surface, x, y, w, h, jpg);
+    if( jpg )
+        jpg_close(jpg);
+
+    for( row = 0; row < h && ok == 1; row++ )
+        if( !samePixels( (const uint32_t *)surface.pixels + (size_t)row * w, reference + (size_t)(y + row) * image->width + x, w ) )
+            ok = 2;
+
+    free(surface.pixels);
+    return ok == 1 ? "ok" : ok ? "differs" : "failed";
+}
+
+
+typedef struct
+{
+    uint32_t      * pixels;
+    uint16_t        width;
+    uint32_t        next;           // Row the next call should start at
+}
+rowsCopy;
+
+
+static int copyRows(void * user, const uint32_t * pixels, size_t pitch, uint16_t y, uint16_t n)
+{
+rowsCopy *  copy = (rowsCopy *)user;
+uint16_t    i;
+
+
+ // Rows come in order, once each
+    if( y != copy->next )
+        return 1;
+
+    for( i = 0; i < n; i++ )
+        memcpy( copy->pixels + (size_t)(y + i) * copy->width, (const uint8_t *)pixels + i * pitch, copy->width * 4 );
+
+    copy->next = y + n;
+    return 0;
+}
+
+
+static const char * pathRows(const uint8_t * data, size_t size, const benchImage * image, const uint32_t * reference)
+{
+rowsCopy    copy;
+jpg_t *     jpg;
+int         ok;
+
+
+    copy.width  = image->width;
+    copy.next   = 0;
+    copy.pixels = malloc( (size_t)image->width * image->height * 4 );
+    if( !copy.pixels )
+        return "failed";
+
+    jpg = jpg_open_mem(data, size);
+    ok  = jpg && !jpg_read_rows(jpg, copyRows, &copy) && copy.next == image->height;
+    if( jpg )
+        jpg_close(jpg);
+
+    if( ok && !samePixels(copy.pixels, reference, (size_t)image->width * image->height) )
+        ok = 2;
+
+    free(copy.pixels);
+    return ok == 1 ? "ok" : ok ? "differs" : "failed";
+}
+
+
+/* Decodes the planes of an image, each as large as the image so that it's
+ * large enough for any component. Returns the image, kept open for its
+ * sampling factors and colour space, or NULL if it didn't decode */
+
+static jpg_t * decodePlanes(const uint8_t * data, size_t size, const benchImage * image, jpg_planes_t * planes)
+{
+jpg_t *         jpg;
+uint8_t         c, nc;
+
+
+    memset(planes, 0, sizeof(*planes));
+
+    jpg = jpg_open_mem(data, size);
+    if( !jpg )
+        return NULL;
+
+    nc = jpg->nc > 3 ? jpg->nc : 3;
+    for( c = 0; c < nc; c++ )
+    {
+        planes->pitch[c]  = image->width;
+        planes->planes[c] = malloc( (size_t)image->width * image->height );
+        if( !planes->planes[c] )
+            break;
+    }
+
+    if( c < nc || jpg_read_planes(planes, jpg) )
+    {
+        jpg_close(jpg);
+        return NULL;
+    }
+
+    return jpg;
+}
+
+
+static void freePlanes(jpg_planes_t * planes)
+{
+uint8_t         c;
+
+
+    for( c = 0; c < JPG_MAX_COMPONENTS; c++ )
+        free(planes->planes[c]);
+}
+
+
+// Sample of a component at a pixel: the one the position of the pixel falls in
+static int planeSample(const jpg_planes_t * planes, const jpg_t * jpg, uint8_t c, uint32_t x, uint32_t y)
+{
+uint8_t         H = c < jpg->nc ? jpg->seg.comp[c].HSmplFctr : jpg->hsf;
+uint8_t         V = c < jpg->nc ? jpg->seg.comp[c].VSmplFctr : jpg->vsf;
+
+
+    return planes->planes[c][(y * V / jpg->vsf) * planes->pitch[c] + x * H / jpg->hsf];
+}
+
+
+/* The planes are converted to XRGB here, independently of the library: the
+ * chroma of a pixel is the sample its position falls in (no interpolation),
+ * converted with the same integer arithmetic as the decoder's, and so are
+ * the inverted inks of CMYK and YCCK */
+
+static const char * pathPlanes(const uint8_t * data, size_t size, const benchImage * image, const uint32_t * reference)
+{
+jpg_planes_t    planes;
+jpg_t *         jpg;
+uint32_t        pixel;
+uint32_t        x, y;
+int             Y, Cb, Cr, K, red, green, blue;
+int             ok;
+
+
+    jpg = decodePlanes(data, size, image, &planes);
+    ok  = jpg != NULL;
+
+    for( y = 0; y < image->height && ok == 1; y++ )
+    {
+        for( x = 0; x < image->width && ok == 1; x++ )
+        {
+            Y     = planeSample(&planes, jpg, 0, x, y);
+            Cb    = planeSample(&planes, jpg, 1, x, y);
+            Cr    = planeSample(&planes, jpg, 2, x, y);
+            K     = jpg->nc == 4 ? planeSample(&planes, jpg, 3, x, y) : 255;
+
+            if( jpg->colorspace == JPG_COLOR_RGB || jpg->colorspace == JPG_COLOR_CMYK )
+            {
+                red   = Y;
+                green = Cb;
+                blue  = Cr;
+            }
+
+            else
+            {
+                Cb   -= 128;
+                Cr   -= 128;
+                red   = Y + 45 * Cr / 32;
+                green = Y - (11 * Cb + 23 * Cr) / 32;
+                blue  = Y + 113 * Cb / 64;
+
+                red   = red   < 0 ? 0 : red   > 255 ? 255 : red;
+                green = green < 0 ? 0 : green > 255 ? 255 : green;
+                blue  = blue  < 0 ? 0 : blue  > 255 ? 255 : blue;
+            }
+
+            if( jpg->colorspace == JPG_COLOR_YCCK )
+            {
+                red   = 255 - red;
+                green = 255 - green;
+                blue  = 255 - blue;
+            }
+
+            if( jpg->nc == 4 )
+            {
+                red   = (red   * K + 127) / 255;
+                green = (green * K + 127) / 255;
+                blue  = (blue  * K + 127) / 255;
+            }
+
+            pixel = ( (uint32_t)red << 16 ) | ( (uint32_t)green << 8 ) | (uint32_t)blue;
+
+            if( !samePixels(&pixel, reference + (size_t)y * image->width + x, 1) )
+                ok = 2;
+        }
+    }
+
+    if( jpg )
+        jpg_close(jpg);
+    freePlanes(&planes);
+
+    return ok == 1 ? "ok" : ok ? "differs" : "failed";
+}
+
+
+static const char * pathThreads(const uint8_t * data, size_t size, const benchImage * image, const uint32_t * reference,
+                                uint32_t * pixels)
+{
+jpg_options_t   options;
+
+
+    memset(&options, 0, sizeof(options));
+    options.threads = 4;
+
+    if( !decodeImage(data, size, &options, pixels, image) )
+        return "failed";
+
+    return samePixels(pixels, reference, (size_t)image->width * image->height) ? "ok" : "differs";
+}
+
+
+// Several copies of the image, decoded by a batch on several threads into surfaces of their own
+static const char * pathBatch(const uint8_t * data, size_t size, const benchImage * image, const uint32_t * reference)
+{
+jpg_batch_item_t    items[4];
+size_t              i, n = sizeof(items) / sizeof(items[0]);
+size_t              pixels = (size_t)image->width * image->height;
+int                 ok = 1;
+
+
+    memset(items, 0, sizeof(items));
+
+    for( i = 0; i < n; i++ )
+    {
+        items[i].data           = data;
+        items[i].size           = size;
+        items[i].surface.width  = image->width;
+        items[i].surface.height = image->height;
+        items[i].surface.pitch  = (size_t)image->width * 4;
+        items[i].surface.format = JPG_FORMAT_XRGB;
+        items[i].surface.pixels = malloc(pixels * 4);
+        ok = ok && items[i].surface.pixels;
+    }
+
+    ok = ok && !jpg_read_batch(items, n, 4, NULL);
+
+    for( i = 0; i < n; i++ )
+    {
+        if( ok == 1 && !samePixels(items[i].surface.pixels, reference, pixels) )
+            ok = 2;
+        free(items[i].surface.pixels);
+    }
+
+    return ok == 1 ? "ok" : ok ? "differs" : "failed";
+}
+
+
+// Twice in the same context, the second time reusing the memory of the first
+static const char * pathContext(const uint8_t * data, size_t size, const benchImage * image, const uint32_t * reference,
+                                uint32_t * pixels)
+{
+jpg_options_t   options;
+uint8_t         i;
+int             ok = 1;
+
+
+    memset(&options, 0, sizeof(options));
+    options.context = jpg_context_create();
+    if( !options.context )
+        return "failed";
+
+    for( i = 0; i < 2 && ok == 1; i++ )
+    {
+        ok = decodeImage(data, size, &options, pixels, image);
+        if( ok && !samePixels(pixels, reference, (size_t)image->width * image->height) )
+            ok = 2;
+    }
+
+    jpg_context_destroy(options.context);
+    return ok == 1 ? "ok" : ok ? "differs" : "failed";
+}
+
+
+/* With a budget of the memory the decode needs, the decode is the same. A
+ * byte less, and it must fail for going over the budget */
+
+static const char * pathMemory(const uint8_t * data, size_t size, const benchImage * image, const uint32_t * reference,
+                               uint32_t * pixels)
+{
+jpg_options_t   options;
+jpg_t *         jpg;
+int             ok;
+
+
+    memset(&options, 0, sizeof(options));
+
+    jpg = jpg_open_mem(data, size);
+    ok  = jpg && !jpg_read(pixels, image->width, image->height, jpg);
+    if( jpg )
+    {
+        options.max_memory = jpg->peak_memory;
+        jpg_close(jpg);
+    }
+
+    if( !ok || !options.max_memory || !decodeImage(data, size, &options, pixels, image) )
+        return "failed";
+
+    if( !samePixels(pixels, reference, (size_t)image->width * image->height) )
+        return "differs";
+
+    options.max_memory--;
+    jpg = jpg_open_mem_ex(data, size, &options);
+    ok  = jpg && jpg_read(pixels, image->width, image->height, jpg) && jpg->error == JPG_ERR_MEMORY_LIMIT;
+    if( jpg )
+        jpg_close(jpg);
+
+    return ok ? "ok" : "differs";
+}
+
+
+/* Every format holds the pixels of the XRGB decode in its own byte order
+ * (Gray8 holds the Y plane, which is the red of a grayscale image, or the
+ * luma of the colour of CMYK and YCCK). The
+ * surfaces are poisoned, and there is a gap between their rows and a guard
+ * band after the last one: none of which may be written */
+
+static const char * pathFormats(const uint8_t * data, size_t size, const benchImage * image, const uint32_t * reference)
+{
+static const uint8_t sizes[JPG_FORMATS] = { 4, 4, 4, 3, 3, 1 };
+jpg_surface_t   surface;
+jpg_planes_t    planes;
+jpg_t *         planesJpg;
+jpg_t *         jpg;
+uint8_t *       pixel;
+uint8_t         expected[4];
+uint32_t        word;
+uint32_t        x, y;
+size_t          bytes, i;
+int             ok, overrun;
+uint8_t         format;
+
+
+    planesJpg = decodePlanes(data, size, image, &planes);
+    ok        = planesJpg != NULL;
+    overrun   = 0;
+
+    for( format = 0; format < JPG_FORMATS && ok == 1; format++ )
+    {
+        surface.pitch  = (size_t)image->width * sizes[format] + BENCH_ROW_GAP;
+        surface.width  = image->width;
+        surface.height = image->height;
+        surface.format = format;
+
+        bytes          = surface.pitch * image->height + BENCH_GUARD;
+        surface.pixels = malloc(bytes);
+        if( !surface.pixels )
+        {
+            ok = 0;
+            break;
+        }
+        memset(surface.pixels, BENCH_POISON, bytes);
+
+        jpg = jpg_open_mem(data, size);
+        ok  = jpg && !jpg_read_surface(&surface, jpg);
+        if( jpg )
+            jpg_close(jpg);
+
+        for( y = 0; y < image->height && ok == 1; y++ )
+        {
+            for( x = 0; x < image->width && ok == 1; x++ )
+            {
+                word  = reference[(size_t)y * image->width + x] & 0xFFFFFF;
+                pixel = (uint8_t *)surface.pixels + y * surface.pitch + (size_t)x * sizes[format];
+
+                switch( format )
+                {
+                    case JPG_FORMAT_XRGB:
+                        memcpy(expected, &word, 4);
+                        break;
+
+                    case JPG_FORMAT_BGRX:
+                    case JPG_FORMAT_RGBA:
+                        expected[0] = format == JPG_FORMAT_BGRX ? (uint8_t)word : (uint8_t)( word >> 16 );
+                        expected[1] = (uint8_t)( word >> 8 );
+                        expected[2] = format == JPG_FORMAT_BGRX ? (uint8_t)( word >> 16 ) : (uint8_t)word;
+                        expected[3] = format == JPG_FORMAT_BGRX ? 0 : 255;
+                        break;
+
+                    case JPG_FORMAT_RGB24:
+                    case JPG_FORMAT_BGR24:
+                        expected[0] = format == JPG_FORMAT_BGR24 ? (uint8_t)word : (uint8_t)( word >> 16 );
+                        expected[1] = (uint8_t)( word >> 8 );
+                        expected[2] = format == JPG_FORMAT_BGR24 ? (uint8_t)( word >> 16 ) : (uint8_t)word;
+                        break;
+
+                    default:
+                        if( planesJpg->colorspace == JPG_COLOR_GRAY || planesJpg->colorspace == JPG_COLOR_YCBCR )
+                            expected[0] = (uint8_t)planeSample(&planes, planesJpg, 0, x, y);
+                        else
+                            expected[0] = (uint8_t)( ( 77 * (word >> 16) + 150 * ((word >> 8) & 0xFF) + 29 * (word & 0xFF) + 128 ) >> 8 );
+                        break;
+                }
+
+                if( memcmp(pixel, expected, sizes[format]) )
+                    ok = 2;
+            }
+        }
+
+     // The gaps between the rows, and the guard band after the last one
+        for( y = 0; y < image->height && ok == 1; y++ )
+        {
+            pixel = (uint8_t *)surface.pixels + y * surface.pitch + (size_t)image->width * sizes[format];
+            for( i = 0; i < ( y + 1 < image->height ? BENCH_ROW_GAP : BENCH_ROW_GAP + BENCH_GUARD ); i++ )
+                overrun |= pixel[i] != BENCH_POISON;
+        }
+
+        free(surface.pixels);
+    }
+
+    if( planesJpg )
+        jpg_close(planesJpg);
+    freePlanes(&planes);
+
+    return overrun && ok == 1 ? "overrun" : ok == 1 ? "ok" : ok ? "differs" : "failed";
+}
+
+
+// Decodes a surface of an image (a region of it if w and h aren't 0), returns 0 if it doesn't decode
+static int decodeSurface(const uint8_t * data, size_t size, const jpg_options_t * options, const jpg_surface_t * surface,
+                         uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+jpg_t *     jpg;
+int         ok;
+
+
+    jpg = jpg_open_mem_ex(data, size, options);
+    ok  = jpg && !( w ? jpg_read_region(surface, x, y, w, h, jpg) : jpg_read_surface(surface, jpg) );
+    if( jpg )
+        jpg_close(jpg);
+
+    return ok;
+}
+
+
+/* PSNR of the red, green and blue of an image decoded at 1 / (1 << scale)
+ * of its size, against the plain decode averaged over the pixels each of
+ * its pixels covers */
+
+static double scaledPsnr(const uint32_t * pixels, const uint32_t * reference, const benchImage * image, uint8_t scale)
+{
+uint32_t    width  = (image->width  + (1 << scale) - 1) >> scale;
+uint32_t    height = (image->height + (1 << scale) - 1) >> scale;
+uint32_t    x, y, sx, sy, n;
+double      squares = 0, sum, error;
+uint8_t     c;
+
+
+    for( y = 0; y < height; y++ )
+    {
+        for( x = 0; x < width; x++ )
+        {
+            for( c = 0; c < 3; c++ )
+            {
+                for( sum = 0, n = 0, sy = y << scale; sy < ( (y + 1) << scale ) && sy < image->height; sy++ )
+                    for( sx = x << scale; sx < ( (x + 1) << scale ) && sx < image->width; sx++, n++ )
+                        sum += ( reference[(size_t)sy * image->width + sx] >> (16 - 8 * c) ) & 0xFF;
+
+                error    = (double)( ( pixels[(size_t)y * width + x] >> (16 - 8 * c) ) & 0xFF ) - sum / n;
+                squares += error * error;
+            }
+        }
+    }
+
+    return squares ? 10 * log10( 255.0 * 255.0 * 3 * width * height / squares ) : 99.0;
+}
+
+
+/* Thumbnails: the image is decoded at 1/2, 1/4 and 1/8 of its size by the
+ * reduced size IDCTs, which must be close to the plain decode averaged down
+ * (the least PSNR is kept). On 4 threads, and as a region (starting on a
+ * whole MCU at every scale), the thumbnail must be the same */
+
+static const char * pathScaled(const uint8_t * data, size_t size, const benchImage * image, const uint32_t * reference,
+                               double * least)
+{
+jpg_options_t   options;
+jpg_surface_t   surface, region;
+uint32_t *      plain;
+uint32_t *      threaded;
+uint16_t        x, y, w, h, row;
+double          value;
+int             ok = 1;
+uint8_t         scale;
+
+
+    memset(&options, 0, sizeof(options));
+    *least = 99.0;
+
+ // The region is a multiple of 64 pixels, as large as any MCU, so that it starts on a whole MCU at 1/8 too
+    x = image->width  / 4 & ~63u;
+    y = image->height / 4 & ~63u;
+    w = image->width  / 2 & ~63u;
+    h = image->height / 2 & ~63u;
+
+    for( scale = 1; scale <= 3 && ok == 1; scale++ )
+    {
+        surface.width  = (image->width  + (1 << scale) - 1) >> scale;
+        surface.height = (image->height + (1 << scale) - 1) >> scale;
+        surface.pitch  = (size_t)surface.width * 4;
+        surface.format = JPG_FORMAT_XRGB;
+
+        region.width   = w >> scale;
+        region.height  = h >> scale;
+        region.pitch   = (size_t)region.width * 4;
+        region.format  = JPG_FORMAT_XRGB;
+
+        plain          = malloc(surface.pitch * surface.height);
+        threaded       = malloc(surface.pitch * surface.height);
+        region.pixels  = w && h ? malloc(region.pitch * region.height) : NULL;
+
+        options.threads = 1;
+        surface.pixels  = plain;
+        ok = plain && threaded && (region.pixels || !w || !h) && decodeSurface(data, size, &options, &surface, 0, 0, 0, 0);
+
+        if( ok )
+        {
+            value  = scaledPsnr(plain, reference, image, scale);
+            *least = value < *least ? value : *least;
+            ok     = value < BENCH_MIN_SCALED_PSNR ? 2 : 1;
+        }
+
+        if( ok == 1 && w && h )
+        {
+            ok = decodeSurface(data, size, &options, &region, x, y, w, h);
+
+            for( row = 0; row < region.height && ok == 1; row++ )
+                if( !samePixels( (const uint32_t *)region.pixels + (size_t)row * region.width,
+                                 plain + (size_t)( (y >> scale) + row ) * surface.width + (x >> scale), region.width ) )
+                    ok = 2;
+        }
+
+        if( ok == 1 )
+        {
+            options.threads = 4;
+            surface.pixels  = threaded;
+            ok = decodeSurface(data, size, &options, &surface, 0, 0, 0, 0);
+
+            if( ok && !samePixels(threaded, plain, (size_t)surface.width * surface.height) )
+                ok = 2;
+        }
+
+        free(plain);
+        free(threaded);
+        free(region.pixels);
+    }
+
+    return ok == 1 ? "ok" : ok ? "differs" : "failed";
+}
+
+
+/* Checks the decoded pixels of an image: the plain decode against the image
+ * it was encoded from, the other paths against the plain decode, and the
+ * fast IDCT against the image too (its pixels are its own). Returns the
+ * number of checks that failed */
+
+static size_t checkImage(const uint8_t * data, size_t size, const benchImage * image, const uint8_t * source,
+                         benchResult * result)
+{
+jpg_options_t   options;
+uint32_t *      reference;
+uint32_t *      pixels;
+size_t          n = (size_t)image->width * image->height;
+size_t          failed = 0;
+uint8_t         k;
+
+
+    for( k = 0; k < BENCH_PATHS; k++ )
+        result->paths[k] = "failed";
+
+    memset(&options, 0, sizeof(options));
+    reference = malloc(n * 4);
+    pixels    = malloc(n * 4);
+
+    if( !reference || !pixels || !decodeImage(data, size, &options, reference, image) )
+    {
+        free(reference);
+        free(pixels);
+        return BENCH_PATHS + 2;
+    }
+
+    result->psnr = psnr(reference, source, image);
+
+    options.idct = JPG_IDCT_FAST;
+    if( decodeImage(data, size, &options, pixels, image) )
+    {
+        result->fastPsnr     = psnr(pixels, source, image);
+        result->fastChecksum = checksum(pixels, n);
+    }
+
+    result->paths[BENCH_REGION]  = pathRegion(data, size, image, reference);
+    result->paths[BENCH_ROWS]    = pathRows(data, size, image, reference);
+    result->paths[BENCH_PLANES]  = pathPlanes(data, size, image, reference);
+    result->paths[BENCH_THREADS] = pathThreads(data, size, image, reference, pixels);
+    result->paths[BENCH_BATCH]   = pathBatch(data, size, image, reference);
+    result->paths[BENCH_CONTEXT] = pathContext(data, size, image, reference, pixels);
+    result->paths[BENCH_MEMORY]  = pathMemory(data, size, image, reference, pixels);
+    result->paths[BENCH_FORMATS] = pathFormats(data, size, image, reference);
+    result->paths[BENCH_SCALED]  = pathScaled(data, size, image, reference, &result->scaledPsnr);
+
+    for( k = 0; k < BENCH_PATHS; k++ )
+        failed += strcmp(result->paths[k], "ok") != 0;
+
+ // The fast IDCT may lose a little, but no more
+    failed += result->psnr < BENCH_MIN_PSNR;
+    failed += result->fastPsnr < result->psnr - 1.0;
+
+    free(reference);
+    free(pixels);
+    return failed;
+}
+
+
+/* The golden file has a line per image and set of kernels, and another
+ * for the image decoded with the fast IDCT (<image>/fast):
+ *     <kernels> <image> <checksum>
+ * Returns the number of entries read (none if the file doesn't exist) */
+
+static size_t readGolden(const char * file, goldenEntry * entries, size_t max)
+{
+FILE *          fp;
+char            line[256];
+unsigned long long checksum;
+size_t          n = 0;
+
+
+    fp = fopen(file, "r");
+    if( !fp )
+        return 0;
+
+    while( n < max && fgets(line, sizeof(line), fp) )
+    {
+        if( line[0] == '#' )
+            continue;
+
+        if( sscanf(line, "%15s %63s %llx", entries[n].kernels, entries[n].name, &checksum) == 3 )
+        {
+            entries[n].checksum = checksum;
+            n++;
+        }
+    }
+
+    fclose(fp);
+    return n;
+}
+
+
+// Replaces the entries for the kernels in use with the checksums just computed
+static int writeGolden(const char * file, const goldenEntry * entries, size_t n, const char * kernels,
+                       const benchResult * results)
+{
+FILE *      fp;
+size_t      i;
+
+
+    fp = fopen(file, "w");
+    if( !fp )
+        return 0;
+
+    fprintf(fp, "# Checksums of the pixels the benchmark corpus decodes to: <kernels> <image> <FNV-1a>\n");
+
+    for( i = 0; i < n; i++ )
+        if( strcmp(entries[i].kernels, kernels) )
+            fprintf(fp, "%s %s %016llx\n", entries[i].kernels, entries[i].name, (unsigned long long)entries[i].checksum);
+
+    for( i = 0; i < BENCH_IMAGES; i++ )
+    {
+        if( strcmp(results[i].golden, "failed") )
+            fprintf(fp, "%s %s %016llx\n", kernels, corpus[i].name, (unsigned long long)results[i].checksum);
+        if( strcmp(results[i].fastGolden, "failed") )
+            fprintf(fp, "%s %s/fast %016llx\n", kernels, corpus[i].name, (unsigned long long)results[i].fastChecksum);
+    }
+
+    return !fclose(fp);
+}
+
+
+static const char * checkGolden(const goldenEntry * entries, size_t n, const char * kernels, const char * name,
+                                uint64_t checksum)
+{
+size_t      i;
+
+    for( i = 0; i < n; i++ )
+        if( !strcmp(entries[i].kernels, kernels) && !strcmp(entries[i].name, name) )
+            return entries[i].checksum == checksum ? "ok" : "mismatch";
+
+    return "missing";
+}
+
+
+static int writeJSON(const char * file, const char * kernels, uint16_t threads, uint32_t iterations,
+                     const benchResult * results, double mpps, size_t failed, size_t mismatched, size_t checksFailed)
+{
+FILE *      fp;
+size_t      i;
+uint8_t     k;
+
+
+    fp = fopen(file, "w");
+    if( !fp )
+        return 0;
+
+    fprintf(fp, "{\n  \"kernels\": \"%s\",\n  \"threads\": %u,\n  \"iterations\": %u,\n  \"images\": [\n",
+            kernels, threads, iterations);
+
+    for( i = 0; i < BENCH_IMAGES; i++ )
+    {
+        fprintf(fp, "    {\n      \"name\": \"%s\", \"width\": %u, \"height\": %u, \"components\": %u, "
+                    "\"transform\": %u, \"sampling\": \"%ux%u\", \"chroma\": \"%ux%u\", \"quality\": %u, "
+                    "\"restart\": %u, \"bytes\": %zu,\n",
+                corpus[i].name, corpus[i].width, corpus[i].height, corpus[i].nc, corpus[i].transform, corpus[i].hsf,
+                corpus[i].vsf, corpus[i].chroma >> 4, corpus[i].chroma & 15, corpus[i].quality, corpus[i].restart,
+                results[i].bytes);
+
+        fprintf(fp, "      \"mpps\": %.2f,\n      \"latency_ms\": { \"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+                    "\"p99\": %.3f, \"max\": %.3f },\n      \"counters\": {",
+                results[i].mpps, results[i].latency[0], results[i].latency[1], results[i].latency[2],
+                results[i].latency[3], results[i].latency[4]);
+
+        for( k = 0; k < BENCH_COUNTERS; k++ )
+        {
+            if( results[i].counters[k] < 0 )
+                fprintf(fp, "%s \"%s\": null", k ? "," : "", counterNames[k]);
+            else
+                fprintf(fp, "%s \"%s\": %lld", k ? "," : "", counterNames[k], (long long)results[i].counters[k]);
+        }
+
+        fprintf(fp, " },\n      \"checksum\": \"%016llx\", \"golden\": \"%s\", \"psnr\": %.2f, \"scaled_psnr\": %.2f,\n",
+                (unsigned long long)results[i].checksum, results[i].golden, results[i].psnr, results[i].scaledPsnr);
+        fprintf(fp, "      \"fast\": { \"checksum\": \"%016llx\", \"golden\": \"%s\", \"psnr\": %.2f },\n      \"paths\": {",
+                (unsigned long long)results[i].fastChecksum, results[i].fastGolden, results[i].fastPsnr);
+
+        for( k = 0; k < BENCH_PATHS; k++ )
+            fprintf(fp, "%s \"%s\": \"%s\"", k ? "," : "", pathNames[k], results[i].paths[k] ? results[i].paths[k] : "failed");
+
+        fprintf(fp, " }\n    }%s\n", i + 1 < BENCH_IMAGES ? "," : "");
+    }
+
+    fprintf(fp, "  ],\n  \"total\": { \"mpps\": %.2f, \"failed\": %zu, \"mismatched\": %zu, \"checks_failed\": %zu }\n}\n",
+            mpps, failed, mismatched, checksFailed);
+
+    return !fclose(fp);
+}
+
+
+static int usage(void)
+{
+    printf("Usage: bench [-n iterations] [-t threads] [-o results.json] [-g golden] [-u]\n\n");
+    printf("Encodes a corpus of synthetic images of various sizes, qualities and layouts,\n");
+    printf("decodes each of them a number of times and reports the throughput, latency\n");
+    printf("and hardware counters per image. The decoded pixels are checked against the\n");
+    printf("golden checksums (bench.golden) for the kernels in use, or replace them (-u),\n");
+    printf("and against the images they were encoded from (PSNR). Every other way of\n");
+    printf("decoding an image (regions, rows, planes, threads, batches, contexts and\n");
+    printf("memory budgets) must give the same pixels as the plain decode, and every\n");
+    printf("pixel format the same pixels in its own byte order, writing nothing past them.\n");
+    printf("Thumbnails at 1/2, 1/4 and 1/8 must be close to the plain decode averaged down\n");
+    printf("(PSNR), and the same on several threads and as a region\n");
+    return -1;
+}
+
+
+int main(int argc, char *argv[])
+{
+benchResult         results[BENCH_IMAGES];
+goldenEntry         golden[256];
+const char *        kernels;
+const char *        json = NULL;
+const char *        goldenFile = "bench.golden";
+uint8_t *           pixels;
+uint8_t *           data;
+size_t              nGolden, i;
+size_t              failed = 0, mismatched = 0, checksFailed = 0;
+char                name[64];
+double              pixelTotal = 0, timeTotal = 0;
+uint32_t            iterations = 10;
+uint16_t            threads = 1;
+int                 update = 0;
+int                 fds[BENCH_COUNTERS];
+int                 arg;
+uint8_t             k;
+
+
+    for( arg = 1; arg < argc; arg++ )
+    {
+        if( !strcmp(argv[arg], "-n") && arg + 1 < argc )
+            iterations = (uint32_t)atoi(argv[++arg]);
+        else if( !strcmp(argv[arg], "-t") && arg + 1 < argc )
+            threads = (uint16_t)atoi(argv[++arg]);
+        else if( !strcmp(argv[arg], "-o") && arg + 1 < argc )
+            json = argv[++arg];
+        else if( !strcmp(argv[arg], "-g") && arg + 1 < argc )
+            goldenFile = argv[++arg];
+        else if( !strcmp(argv[arg], "-u") )
+            update = 1;
+        else
+            return usage();
+    }
+
+    if( !iterations )
+        iterations = 1;
+
+    kernels = jpg_kernels();
+    nGolden = readGolden(goldenFile, golden, sizeof(golden) / sizeof(golden[0]));
+    openCounters(fds);
+
+    printf("Kernels %s, %u thread(s), %u iterations\n\n", kernels, threads, iterations);
+    printf("%-18s %9s %9s %9s %9s %9s %10s  %s\n", "image", "bytes", "MP/s", "p50 ms", "p99 ms", "IPC", "golden", "checksum");
+
+    for( i = 0; i < BENCH_IMAGES; i++ )
+    {
+        memset(&results[i], 0, sizeof(benchResult));
+        memset(results[i].counters, -1, sizeof(results[i].counters));
+        results[i].golden = "failed";
+
+        results[i].fastGolden = "failed";
+
+        pixels = makeImage(&corpus[i]);
+        results[i].bytes = pixels ? encodeImage(&data, pixels, &corpus[i]) : 0;
+
+        if( results[i].bytes &&
+            benchImageDecode(data, results[i].bytes, &corpus[i], iterations, threads, fds, &results[i]) )
+        {
+            results[i].golden = checkGolden(golden, nGolden, kernels, corpus[i].name, results[i].checksum);
+            pixelTotal += (double)corpus[i].width * corpus[i].height * iterations;
+            timeTotal  += (double)corpus[i].width * corpus[i].height * iterations / (results[i].mpps * 1e6);
+        }
+
+        if( results[i].bytes )
+        {
+            checksFailed += checkImage(data, results[i].bytes, &corpus[i], pixels, &results[i]);
+
+            snprintf(name, sizeof(name), "%s/fast", corpus[i].name);
+            if( results[i].fastPsnr > 0 )
+                results[i].fastGolden = checkGolden(golden, nGolden, kernels, name, results[i].fastChecksum);
+            if( !strcmp(results[i].fastGolden, "mismatch") )
+                mismatched++;
+
+            free(data);
+        }
+
+        free(pixels);
+
+        if( !strcmp(results[i].golden, "failed") )
+            failed++;
+        else if( !strcmp(results[i].golden, "mismatch") )
+            mismatched++;
+
+        printf("%-18s %9zu %9.1f %9.3f %9.3f ", corpus[i].name, results[i].bytes, results[i].mpps,
+               results[i].latency[1], results[i].latency[3]);
+        if( results[i].counters[BENCH_CYCLES] > 0 && results[i].counters[BENCH_INSTRUCTIONS] >= 0 )
+            printf("%9.2f ", (double)results[i].counters[BENCH_INSTRUCTIONS] / results[i].counters[BENCH_CYCLES]);
+        else
+            printf("%9s ", "-");
+        printf("%10s  %016llx\n", results[i].golden, (unsigned long long)results[i].checksum);
+    }
+
+    closeCounters(fds);
+
+    printf("\n%-18s %8s %8s %8s %10s", "image", "PSNR dB", "fast dB", "1/n dB", "fast");
+    for( k = 0; k < BENCH_PATHS; k++ )
+        printf(" %8s", pathNames[k]);
+    printf("\n");
+
+    for( i = 0; i < BENCH_IMAGES; i++ )
+    {
+        printf("%-18s %8.2f %8.2f %8.2f %10s", corpus[i].name, results[i].psnr, results[i].fastPsnr, results[i].scaledPsnr,
+               results[i].fastGolden);
+        for( k = 0; k < BENCH_PATHS; k++ )
+            printf(" %8s", results[i].paths[k] ? results[i].paths[k] : "failed");
+        printf("\n");
+    }
+
+    printf("\nTotal %.1f MP/s, %zu failed, %zu mismatched, %zu checks failed\n",
+           timeTotal > 0 ? pixelTotal / timeTotal * 1e-6 : 0.0, failed, mismatched, checksFailed);
+
+    if( json && !writeJSON(json, kernels, threads, iterations, results, timeTotal > 0 ? pixelTotal / timeTotal * 1e-6 : 0.0,
+                           failed, mismatched, checksFailed) )
+    {
+        printf("Error: can't write %s\n", json);
+        return 1;
+    }
+
+    if( update )
+    {
+        if( !writeGolden(goldenFile, golden, nGolden, kernels, results) )
+        {
+            printf("Error: can't write %s\n", goldenFile);
+            return 1;
+        }
+        printf("Updated the checksums for %s in %s\n", kernels, goldenFile);
+        return failed || checksFailed ? 1 : 0;
+    }
+
+    return failed || mismatched || checksFailed ? 1 : 0;
+}
@@ -44,6 +44,8 @@ FILE *                  fp;
     BMFH.Header[0]      =   'B';
     BMFH.Header[1]      =   'M';
     BMFH.FileSize       =   sizeof(BITMAP_FILE_HEADER) + sizeof(DIB_HEADER) + 4 * ImageWidth * ImageHeight;
+    BMFH.Reserved1      =   0;
+    BMFH.Reserved2      =   0;
     BMFH.DataOffset     =   sizeof(BITMAP_FILE_HEADER) + sizeof(DIB_HEADER);
     
     DIBH.HeaderSize     =   sizeof(DIB_HEADER);
@@ -1,1078 +1,3812 @@
-/* JPEG decoder for baseline-DCT based JPEG images. Copyright(C), Ch1ndra
- * This software is licensed under Creative Commons Attribution License.
- * For usage, modification and distribution permission, refer to the
- * accompanying License */
- 
-#include  "stddef.h"
-#include  "stdio.h"
-#include  "jpg.h"
-#include  "stdlib.h"
-#include  "memory.h"
-#include  "jpgCore.c"
-
-static    uint16_t readMarker(jpg_t * jpg);
-static    uint8_t  validateJPEG(jpg_t * jpg);
-static    void     readAPP0(jpg_t * jpg);
-static    void     readSOF(jpg_t * jpg);
-static    void     readDQT(jpg_t * jpg);
-static    void     HUFFTREE_create(jpg_t * jpg, struct NODE *root);
-static    void     HUFFTREE_insertLeaf( uint8_t symbol, 
-                                     uint16_t codeWord, 
-                                     uint8_t codeLength, 
-                                     struct NODE *root
-                                    );
-static    uint8_t  HUFFTREE_readSymbol(jpg_t * jpg, struct NODE *root);
-static    void     HUFFTREE_destroy(struct NODE *root);
-static    void     readDHT(jpg_t * jpg);
-static    void     readSOS(jpg_t * jpg);
-static    void     readDRI(jpg_t * jpg);
-static    FILE *   skipSegment(jpg_t * jpg);
-static    uint8_t  readBitStream(jpg_t * jpg);
-static    int      readCoefficient(jpg_t * jpg, uint8_t category);
-static    void     resetDecoder(jpg_t * jpg);
-static    void     decodeYDU(jpg_t * jpg, int *coeffTbl);
-static    void     decodeCbDU(jpg_t * jpg, int *coeffTbl);
-static    void     decodeCrDU(jpg_t * jpg, int *coeffTbl);
-static    uint32_t * decodeScanData(jpg_t * jpg);
-static    void     writeBlock( uint32_t * dest, 
-                               uint16_t x, 
-                               uint16_t y,
-                               uint32_t * RGB8x8Block, 
-                               uint16_t imageWidth
-                             );
-
-#define    __Y__       1
-#define    __Cb__      2
-#define    __Cr__      3
-
-
-// JPEG stores information in its header in big-endian format
-// Hence, it is necessary to accomodate conversion to comply with little-endian architecture
-
-uint16_t toSmallEndian(uint16_t big_endian)
-{    
-    return( ( (big_endian & 0xFF) << 8 ) + (big_endian >> 8) );
-}
-
-
-// All segments appearing in the JPEG file start with a marker identifying the segment
-
-static uint16_t readMarker(jpg_t * jpg)
-{
-uint16_t    marker;
-
-
-    fread( &marker, sizeof(marker), 1, jpg->fp);
-    fseek(jpg->fp, -sizeof(marker), SEEK_CUR);
-    
-    if( (marker & 0xFF) != 0xFF )
-        return NOM;
-        
-return toSmallEndian(marker);
-
-}
-
-
-static uint8_t validateJPEG(jpg_t * jpg)
-{
-uint16_t    firstMarker;
-
- // Make sure we're at the beginning of the file 
-    rewind(jpg->fp);
-    
-    firstMarker = readMarker(jpg);
-    if( firstMarker != SOI )
-        return 0;
-    
- // Skip SOI Marker and position the file pointer to the next segment
-    fseek(jpg->fp, 2, SEEK_CUR);                                             
-    
-return 1;
-
-}
-
-
-static void readAPP0(jpg_t * jpg)
-{
-    
-    fread(&jpg->seg.app0, 1, sizeof(jpg->seg.app0), jpg->fp);
-    jpg->seg.app0.length = toSmallEndian(jpg->seg.app0.length);
-    
- // Position the file pointer to the next segment
-    fseek(jpg->fp, jpg->seg.app0.length + sizeof(jpg->seg.app0.APP0_marker) - sizeof(jpg->seg.app0), SEEK_CUR);
-    
-}
-
-
-static void readSOF(jpg_t * jpg)
-{
-uint8_t  i;
-    
-    
-    fread(&jpg->seg.sof, 1, sizeof(jpg->seg.sof), jpg->fp);
-    
-    jpg->seg.sof.length         =   toSmallEndian(jpg->seg.sof.length);
-    jpg->seg.sof.frameWidth     =   toSmallEndian(jpg->seg.sof.frameWidth);
-    jpg->seg.sof.frameHeight    =   toSmallEndian(jpg->seg.sof.frameHeight);
-    
-    fprintf(stdout, "\nImage Width: %d", jpg->seg.sof.frameWidth);
-    fprintf(stdout, "\nImage Height: %d", jpg->seg.sof.frameHeight);
-    fprintf(stdout, "\nNumber of Image Components: %d", jpg->seg.sof.nComponents);
-                    
-    for( i = 0; i < jpg->seg.sof.nComponents; i++ )
-    {
-        switch( jpg->seg.sof.FCSFstruct[i].ID )
-        {
-            case __Y__:
-            {
-                jpg->seg.Y.ID           =  jpg->seg.sof.FCSFstruct[i].ID;
-                jpg->seg.Y.HSmplFctr    = (jpg->seg.sof.FCSFstruct[i].SmplFctr >> 4) & 0xF;
-                jpg->seg.Y.VSmplFctr    = (jpg->seg.sof.FCSFstruct[i].SmplFctr) & 0xF;
-                jpg->seg.Y.QntzTbl      = &jpg->seg.dqt[jpg->seg.sof.FCSFstruct[i].QntzTblN].QntzTbl[0][0];
-                
-                break;
-            }
-            
-            case __Cb__:
-            {
-                jpg->seg.Cb.ID          =  jpg->seg.sof.FCSFstruct[i].ID;
-                jpg->seg.Cb.HSmplFctr   = (jpg->seg.sof.FCSFstruct[i].SmplFctr >> 4) & 0xF;
-                jpg->seg.Cb.VSmplFctr   = (jpg->seg.sof.FCSFstruct[i].SmplFctr) & 0xF;
-                jpg->seg.Cb.QntzTbl     = &jpg->seg.dqt[jpg->seg.sof.FCSFstruct[i].QntzTblN].QntzTbl[0][0];
-                
-                break;
-            }
-            
-            case __Cr__:
-            {
-                jpg->seg.Cr.ID          =  jpg->seg.sof.FCSFstruct[i].ID;
-                jpg->seg.Cr.HSmplFctr   = (jpg->seg.sof.FCSFstruct[i].SmplFctr >> 4) & 0xF;
-                jpg->seg.Cr.VSmplFctr   = (jpg->seg.sof.FCSFstruct[i].SmplFctr) & 0xF;
-                jpg->seg.Cr.QntzTbl     = &jpg->seg.dqt[jpg->seg.sof.FCSFstruct[i].QntzTblN].QntzTbl[0][0];
-                
-                break;
-            }
-        }
-    }
-    
-    fprintf(stdout, "\nChroma subsampling: %dx%d", jpg->seg.Y.HSmplFctr, jpg->seg.Y.VSmplFctr);    
-    
- // Position the file pointer to the next segment 
-    fseek(jpg->fp, jpg->seg.sof.length + sizeof(jpg->seg.sof.SOF_marker) - sizeof(jpg->seg.sof), SEEK_CUR);
-    
-}
-
-
-static void readDQT(jpg_t * jpg)
-{
-DQTseg   dqt;
-uint8_t  QTcount;
-uint8_t  id;
-
- /* It is important to know that the Quantization Table Identifier
-  * doesnot necessarily identify the component to which this
-  * Quantization Table corresponds. The only way to tell which
-  * is which is after reading Quantization Table Number for Y, Cb
-  * and Cr components from the Frame Component Specification */
-     
-    fread(&dqt, 1, 4, jpg->fp);    
-    dqt.length = toSmallEndian(dqt.length);
-    
- // Determine number of Quantization Tables defined in this segment 
-    QTcount = dqt.length >> 6;
-
-    /* For now, we will assume that the QTID = 0 corresponds to the Luminance
-     * and QTID = 1 corresponds to the Chrominance, which is usually the case.
-     * We will make adjustments (if required) after we read the SOF segment */
-    
-    for( ; QTcount; QTcount-- )
-    {
-        fread(&id, 1, 1, jpg->fp );
-
-        switch(id)
-        {
-            case 0:
-                fread(jpg->seg.dqt[0].QntzTbl, 1, 64, jpg->fp);
-            break;
-
-            case 1:
-                fread(jpg->seg.dqt[1].QntzTbl, 1, 64, jpg->fp);
-            break;
-
-            default:
-                fprintf(stdout, "\nreadDQT(): Error! [Unknown identifier for the Quantization Table]");
-            break;
-        }
-    }
-    
- // At this point, the file pointer is right at the next segment
-    
-}
-
-
-static void HUFFTREE_create(jpg_t * jpg, struct NODE *root)
-{
-uint8_t     i, j;
-uint8_t     symbol;
-uint16_t    codeWord = 0;
-
-
-    memset( root, 0, sizeof(struct NODE) );
-    root->parent = root;
-    
-    for( i = 1; i <= 16; i++ )
-    {
-        for( j = 1; j <= jpg->seg.dht.huffCodefreq[i-1]; j++ )
-        {
-            fread( &symbol, 1, 1, jpg->fp);
-            HUFFTREE_insertLeaf( symbol, codeWord, i, root);
-            codeWord++;
-        }
-        codeWord = codeWord << 1;
-    }
-}
-
-
-static void HUFFTREE_insertLeaf(uint8_t symbol, uint16_t codeWord, uint8_t codeLength, struct NODE *root)
-{
-struct NODE * volatile node;
-struct NODE * volatile newNode;
-uint8_t       bit;
-
- 
- // Start tree traversal from the root node
-    node = root;
-    
-    while( codeLength )
-    {
-     // In each iteration, read a bit from the codeword and traverse the tree accordingly
-        bit = (codeWord >> --codeLength) & 1;
-        
-        if( bit == 0 )
-        {
-         // If no left node exists, create a new node
-            if( node->leftChild == 0 )
-            {
-                newNode = (struct NODE *)malloc( sizeof(struct NODE) );
-                memset( newNode, 0, sizeof(struct NODE) );
-                node->leftChild = newNode;
-                newNode->parent = node;
-            }
-            node = node->leftChild;
-        }
-        
-        else
-        {
-         // If no right node exists, create a new node
-            if( node->rightChild == 0 )
-            {
-                newNode = (struct NODE *)malloc( sizeof(struct NODE) );
-                memset( newNode, 0, sizeof(struct NODE) );
-                node->rightChild = newNode;
-                newNode->parent = node;
-            }
-            node = node->rightChild;
-        }
-    }
-    
- // At the end of the tree traversal, we're at the leaf, so mark this leaf with input symbol
-    node->isLeaf     = 1;
-    node->leafSymbol = symbol;
-    node->leftChild  = NULL;
-    node->rightChild = NULL;
-    
-}
-
-
-static uint8_t HUFFTREE_readSymbol(jpg_t * jpg, struct NODE *root)
-{
-struct NODE *  node;
-uint8_t        bit;
-
-
- // Start tree traversal from the root node
-    node = root;
-    
-    while( ! node->isLeaf )
-    {
-     // In each iteration, read a bit from the stream and traverse the tree accordingly
-        bit = readBitStream(jpg);
-        
-        if( bit == 0 )
-            node = node->leftChild;
-        
-        else
-            node = node->rightChild;    
-     }
-    
- // At the end of the tree traversal, we're at the leaf which has the symbol w're looking for
-    return(node->leafSymbol);
-    
-}
-
-
-void HUFFTREE_destroy(struct NODE *root)
-{
-struct NODE * node;
-struct NODE * parentNode;
-
-
-    if( !(node = root) )
-        return;
-    
-    while(root->rightChild||root->leftChild)
-    {
-        if(node->leftChild)
-        {
-            node = node->leftChild;
-        }
-            
-        else if(node->rightChild)
-        {
-            node = node->rightChild;
-        }               
-                
-        else
-        {
-            parentNode = node->parent;
-            
-            if( node == parentNode->leftChild )
-                parentNode->leftChild = 0;
-                
-            else
-                parentNode->rightChild = 0;
-                
-            free(node);
-            node = parentNode;
-        }
-    }
-}
-
-
-static void readDHT(jpg_t * jpg)
-{
-uint8_t     ncodeWords = 0;
-uint8_t     i;
-
-
-    fread(&jpg->seg.dht, 1, 4, jpg->fp);
-    jpg->seg.dht.length = toSmallEndian(jpg->seg.dht.length); 
-    
-    do
-    {  
-           
-        fread( &jpg->seg.dht.CLASS_ID, 1, 17, jpg->fp );
-        
-     // To determine total number of codewords, all we need to do is to sum-up frequencies for each codeword of length i    
-        for( i = 0; i < 16; i++ )
-            ncodeWords += jpg->seg.dht.huffCodefreq[i];
-        
-     /* Just like the Quantization Table Identifier, the Huffman Table 
-      * Identifier doesnot necessarily identify the component to which 
-      * this  Huffman table corresponds. The only way to tell which is
-      * whose is after reading SOS segment */
-      
-        switch( jpg->seg.dht.CLASS_ID )                
-        {
-        // The high nibble represents CLASS( 0 = DC and 1 = AC) and low nibble represents ID
-        
-            case 0x00:
-            {
-                fprintf(stdout, "\nReading Huffman Code Value for Luminance DC...");
-                            
-             // Start creating Huffman tree for this Component Class
-                HUFFTREE_create( jpg, &jpg->seg.Y.HuffTreeDC );
-                break;
-            }
-            
-            case 0x01:
-            {
-                fprintf(stdout, "\nReading Huffman Code Value for Chrominance DC...");
-                
-             // Start creating Huffman tree for this Component Class
-                HUFFTREE_create( jpg, &jpg->seg.Cb.HuffTreeDC );
-                jpg->seg.Cr.HuffTreeDC = jpg->seg.Cb.HuffTreeDC;
-                break;
-            }
-            
-            case 0x10:
-            {
-                fprintf(stdout, "\nReading Huffman Code Value for Luminance AC...");
-                
-             // Start creating Huffman tree for this Component Class
-                HUFFTREE_create( jpg, &jpg->seg.Y.HuffTreeAC );
-                break;
-            }
-            
-            case 0x11:
-            {
-                fprintf(stdout, "\nReading Huffman Code Value for Chrominance AC...");
-                
-             // Start creating Huffman tree for this Component Class
-                HUFFTREE_create( jpg, &jpg->seg.Cb.HuffTreeAC );
-                jpg->seg.Cr.HuffTreeAC = jpg->seg.Cb.HuffTreeAC;
-                break;
-            }
-        }
-        
-    } while( !readMarker(jpg) );
-
- // By now, file pointer is right at the next segment
-    
-}
-
-
-static void readSOS(jpg_t * jpg)
-{
-    
-    fread(&jpg->seg.sos, 1, sizeof(jpg->seg.sos), jpg->fp);    
-    jpg->seg.sos.length = toSmallEndian(jpg->seg.sos.length);
-        
- // Skip the Scan Header and position the file pointer to the Scan data 
-    fseek(jpg->fp, jpg->seg.sos.length + sizeof(jpg->seg.sos.SOS_marker) - sizeof(jpg->seg.sos), SEEK_CUR);
-    
-}
-
-
-static void readDRI(jpg_t * jpg)
-{
-    
-    fread(&jpg->seg.dri, 1, sizeof(jpg->seg.dri), jpg->fp);    
-    jpg->seg.dri.length = toSmallEndian(jpg->seg.dri.length);    
-    jpg->seg.dri.nMCUs  = toSmallEndian(jpg->seg.dri.nMCUs);
-    
-    fprintf(stdout, "\nNumber of MCUs in the Restart Interval: %d", jpg->seg.dri.nMCUs);
-    
- // By now, file pointer is right at the next segment
- 
-}
-
-
-static FILE * skipSegment(jpg_t * jpg)
-{
-uint16_t    segMarker;
-uint16_t    segLength;
-
-
-    fread(&segMarker, sizeof(segMarker), 1, jpg->fp);
-    fread(&segLength, sizeof(segLength), 1, jpg->fp);    
-    fseek(jpg->fp, toSmallEndian(segLength) - sizeof(segLength), SEEK_CUR);
-
-  return jpg->fp;
-}
-
-
-static uint8_t readBitStream(jpg_t * jpg)
-{
-uint8_t shift;
-
-    jpg->stream.index %= 8;     /* Wrap around */
-    
-    if(jpg->stream.index == 0)
-    {
-        /* Read the next byte from the stream */
-        fread(&jpg->stream._byte, 1, 1, jpg->fp);
-
-        /* JPEG standard specifies that the RST marker (0xFFD0 to 0xFFD7) 
-        * may be encoded within the Scan Data for synchronization. As such,
-        * if the encoder needs to write 0xff byte as a part of encoded MCU
-        * data, it needs to write an additional stuff byte(0x00) to ensure
-        * that this byte(0xff) is a part of MCU data and not a marker.
-        * Hence, it is necessary to skip stuffed byte(if any). As a part of
-        * generic implementation, it is also desirable to skip RST marker
-        * (if any) */
-      
-        while( jpg->stream._byte == 0xFF )
-        {
-         // Read next byte from the stream 
-            fread( &jpg->stream._byte, 1, 1, jpg->fp);
-            
-         // Check whether the byte that follows defines a RST marker 
-            if( (jpg->stream._byte >> 4) == 0x0D )
-            {
-             // In this case, simply read another byte from the stream
-                fread( &jpg->stream._byte, 1, 1, jpg->fp);
-            }
-          
-            else
-            {
-             // Ignore the stuffed byte and restore the preceeding byte
-                jpg->stream._byte = 0xFF;
-                
-             // The last fread() sets the file pointer right past the stuffed byte so, we're done
-                break;
-            }
-        }    
-    }
-
-    shift = 7 - jpg->stream.index;
-    jpg->stream.index++;
-    
-    return( (jpg->stream._byte >> shift) & 1 );
-}
-
-
-static int readCoefficient(jpg_t * jpg, uint8_t category)
-{
-int  coeff = 0;
-
-    if( !category)
-    {
-        return 0;
-    }
-    
-    coeff = readBitStream(jpg);
-    
- /* If the bit-string for the coefficient starts with 1, it suggests
-  * that the coefficient is positive and stored as an unsigned 
-  * representation. Otherwise, the coefficient is negative and stored
-  * with its bits complemented */
-    
-    if( !coeff )
-    {
-     // Complement the first bit in the bit-string
-        coeff = 1;
-        
-        while( --category )
-        {
-            coeff = coeff << 1;
-            coeff |= !readBitStream(jpg);
-        }
-        return -coeff;
-    }
-    
-    else
-    {        
-        while( --category )
-        {
-            coeff = coeff << 1;
-            coeff |= readBitStream(jpg);
-        }
-        return coeff;
-    }        
-
-}
-
-
-static void resetDecoder(jpg_t * jpg)
-{
-    jpg->seg.Y.DCcoeff = 0;
-    jpg->seg.Cb.DCcoeff = 0;
-    jpg->seg.Cr.DCcoeff = 0;
-    jpg->stream.index = 0;
-}
-    
-
-static void decodeYDU(jpg_t * jpg, int * coeffTbl)
-{
-uint8_t         encodedByte;
-int             CoeffAC;
-uint8_t         ZeroRunLength;
-uint8_t         category;
-uint8_t         i;
-
-
-/*  For DC coefficient, the scan data starts with a huffman encoded
- *  'category' byte. The 'category' is the minimum no. of bits required 
- *  to represent a coefficient */
- 
-    category     = HUFFTREE_readSymbol( jpg, &jpg->seg.Y.HuffTreeDC );
-    
-/*  DC Coefficient is stored as a difference from the previous block.
- *  Hence, to determine absolute DC coefficient, we add DC Coefficient
- *  of the previous block */
- 
-    jpg->seg.Y.DCcoeff    += readCoefficient(jpg, category);  
-    
- // To improve performance, deZigZag and deQuantize Coefficients as they are retrieved
-    coeffTbl[0]  = jpg->seg.Y.DCcoeff * jpg->seg.Y.QntzTbl[0];
-    
-/*  For AC coefficients, the scan data starts with a huffman encoded 
- *  'RLE+category' byte. The higher nibble represents the run length of
- *  preceeding zeroes whereas the lower nibble represents the 'category' */
-    
-        for(i = 1; i < 64; i++ )
-        {
-            encodedByte  = HUFFTREE_readSymbol( jpg, &jpg->seg.Y.HuffTreeAC );
-            
-         // Check for END_OF_BLOCK Marker(0x00)
-            if( encodedByte == EOB )
-            {                                                       
-                for( ; i < 64; i++)
-                {
-                    coeffTbl[ deZigZagVector[i] ] = 0;
-                }
-            }
-                    
-            else
-            {
-                category        =   encodedByte & 0xf;                    
-                ZeroRunLength   =   (encodedByte >> 4) & 0xf;                        
-                CoeffAC         =   readCoefficient(jpg, category);        
-                        
-                for( ; ZeroRunLength; i++, ZeroRunLength-- )
-                {
-                    coeffTbl[ deZigZagVector[i] ] = 0;
-                }
-                coeffTbl[ deZigZagVector[i] ] = CoeffAC * jpg->seg.Y.QntzTbl[i];
-            }
-        }
-            
-}
-
-
-static void decodeCbDU(jpg_t * jpg, int *coeffTbl)
-{
-uint8_t         encodedByte;
-int             CoeffAC;
-uint8_t         ZeroRunLength;
-uint8_t         category;
-uint8_t         i;
-
-
-    category     = HUFFTREE_readSymbol( jpg, &jpg->seg.Cb.HuffTreeDC );
-    jpg->seg.Cb.DCcoeff   += readCoefficient(jpg, category);  
-    coeffTbl[0]  = jpg->seg.Cb.DCcoeff * jpg->seg.Cb.QntzTbl[0];
-    
-        for(i = 1; i < 64; i++ )
-        {
-            encodedByte  = HUFFTREE_readSymbol( jpg, &jpg->seg.Cb.HuffTreeAC );
-                
-            if( encodedByte == EOB )
-            {                                                       
-                for( ; i < 64; i++)
-                {
-                    coeffTbl[ deZigZagVector[i] ] = 0;
-                }
-            }
-                    
-            else
-            {
-                category        =   encodedByte & 0xf;                        
-                ZeroRunLength   =   (encodedByte >> 4) & 0xf;                        
-                CoeffAC         =   readCoefficient(jpg, category);        
-                        
-                for( ; ZeroRunLength; i++, ZeroRunLength-- )
-                {
-                    coeffTbl[ deZigZagVector[i] ] = 0;
-                }                 
-                coeffTbl[ deZigZagVector[i] ] = CoeffAC * jpg->seg.Cb.QntzTbl[i];
-            }
-        }
-    
-}
-
-
-static void decodeCrDU(jpg_t * jpg, int *coeffTbl)
-{
-uint8_t         encodedByte;
-int             CoeffAC;
-uint8_t         ZeroRunLength;
-uint8_t         category;
-uint8_t         i;
-
-
-    category     = HUFFTREE_readSymbol( jpg, &jpg->seg.Cr.HuffTreeDC );
-    jpg->seg.Cr.DCcoeff   += readCoefficient(jpg, category);  
-    coeffTbl[0]  = jpg->seg.Cr.DCcoeff * jpg->seg.Cr.QntzTbl[0];
-              
-        for(i = 1; i < 64; i++ )
-        {
-            encodedByte  = HUFFTREE_readSymbol( jpg, &jpg->seg.Cr.HuffTreeAC );
-                
-            if( encodedByte == EOB )
-            {                                                       
-                for( ; i < 64; i++)
-                {
-                    coeffTbl[ deZigZagVector[i] ] = 0;
-                }
-            }
-                    
-            else
-            {
-                category        =   encodedByte & 0xf;                        
-                ZeroRunLength   =   (encodedByte >> 4) & 0xf;                        
-                CoeffAC         =   readCoefficient(jpg, category);        
-                        
-                for( ; ZeroRunLength; i++, ZeroRunLength-- )
-                {
-                    coeffTbl[ deZigZagVector[i] ] = 0;
-                }                    
-                coeffTbl[ deZigZagVector[i] ] = CoeffAC * jpg->seg.Cr.QntzTbl[i];
-            }
-        }
-    
-}
-
-
-static uint32_t * decodeScanData(jpg_t * jpg)
-{
-uint8_t     DUindx;
-uint8_t     nYDU;
-uint16_t    i, j;
-uint16_t    nHorizBlocks, nVertBlocks;
-uint16_t    RstCount;
-int      *  YDU[4], * CbDU, * CrDU;
-uint32_t *  raw_image;
-uint32_t *  XRGB8x8Block;
-
-
-/*  The order, in which the Data Units appear in the Scan Data
- *  corresponds to the order in which the components appear in the Scan-
- *  Segment. Besides, the number of blocks of each component that adds up
- *  to create a MCU is defined by the sampling factor of each component.
- *  Next, we've to take into account that the first coefficient of each
- *  block is the DC value and has a separate Huffman Table. Rest of the
- *  AC coefficients have a separate Huffman Table. Also, the Huffman
- *  encoded byte for DC coefficient consists of sole category value
- *  whereas that for AC coefficient consists of Zero-Run-Length nibble
- *  and a category nibble */ 
- 
- // Allocate appropriate amount of memory for holding a decoded 8x8 block    
-    XRGB8x8Block =  (uint32_t *)malloc( 8 * 8 * sizeof(uint32_t) );
-    
- /* Extend the frame-width and frame-height of the image to the nearest 
-  * 16-byte boundary to account for the appended blocks */
-    jpg->seg.sof.frameWidth   = ( (jpg->seg.sof.frameWidth-1)  | ( (jpg->seg.Y.HSmplFctr << 3)-1 ) ) + 1 ;
-    jpg->seg.sof.frameHeight  = ( (jpg->seg.sof.frameHeight-1) | ( (jpg->seg.Y.VSmplFctr << 3)-1 ) ) + 1 ;
-    
- // Allocate enough memory to store the decoded image
-    raw_image =  (uint32_t *)malloc( jpg->seg.sof.frameWidth * jpg->seg.sof.frameHeight * sizeof(uint32_t) );
- 
- // Find out the number of Data Units of Y component present in a MCU 
-    nYDU =  jpg->seg.Y.HSmplFctr  * jpg->seg.Y.VSmplFctr;
-    
- // Allocate memory for each Data Units present in the MCU 
-    for( DUindx = 0; DUindx < nYDU; DUindx++ )
-    { 
-        YDU[DUindx] = (int *)malloc( 64 * sizeof(int) );
-    }
- 
-    CbDU = (int *)malloc( 64 * sizeof(int) );
-    setBlock( CbDU, 128 );
-    
-    CrDU = (int *)malloc( 64 * sizeof(int) );
-    setBlock( CrDU, 128 );
-        
-    nVertBlocks     =   (jpg->seg.sof.frameHeight)/(jpg->seg.Y.VSmplFctr << 3);
-    nHorizBlocks    =   (jpg->seg.sof.frameWidth)/(jpg->seg.Y.HSmplFctr << 3);
-    RstCount        =    jpg->seg.dri.nMCUs;
-    
-    fprintf(stdout, "\nWriting Blocks...");
-        
-    resetDecoder(jpg);    
-    
-    for( j = 0; j < nVertBlocks; j++)
-    {
-        for( i = 0; i < nHorizBlocks; i++)
-        {
-        /*  Decode n Data Units of Y Component present in the MCU and 
-         *  perform Inverse Discrete Cosine Transform on each decoded block */
-         
-            for( DUindx = 0; DUindx < nYDU; DUindx++ )
-            { 
-                decodeYDU( jpg, YDU[DUindx] );            
-                performIDCT( YDU[DUindx] );
-            }
-           
-        /*  Then, decode the data units of Chroma components present in the MCU and
-         *  perform Inverse Discrete Cosine Transform on the decoded block */
-            
-            if( jpg->seg.sof.nComponents > 1 )
-            { 
-                decodeCbDU( jpg, CbDU );            
-                performIDCT( CbDU );                
-                decodeCrDU( jpg, CrDU );            
-                performIDCT( CrDU );
-            }
-            
-            
-         // Check whether Restart Interval is enabled
-            if( jpg->seg.dri.nMCUs )
-            {
-             // Make sure to reset at the end of each Restart Interval
-                if( --RstCount == 0)
-                {
-                    RstCount  = jpg->seg.dri.nMCUs;                    
-                    resetDecoder(jpg);
-                }
-            }
-                        
-                        
-            switch( (jpg->seg.Y.HSmplFctr) << 4 | jpg->seg.Y.VSmplFctr )
-            {
-                case 0x22:
-                {
-                 // 16x16 Y Block corresponds to 8x8 Cb and 8x8 Cr Block
-                 // Hence, each 8x8 Y Block corresponds to a 4x4 Cb and a 4x4 Cr Block
-                    Y4Cb1Cr1toXRGB(XRGB8x8Block, YDU[0], CbDU,    CrDU);
-                    writeBlock(raw_image, i << 4, j << 4, XRGB8x8Block, jpg->seg.sof.frameWidth);
-                    
-                    Y4Cb1Cr1toXRGB(XRGB8x8Block, YDU[1], CbDU+4,  CrDU+4 );
-                    writeBlock(raw_image, (i << 4) + 8, j << 4, XRGB8x8Block, jpg->seg.sof.frameWidth);
-                    
-                    Y4Cb1Cr1toXRGB(XRGB8x8Block, YDU[2], CbDU+32, CrDU+32 );
-                    writeBlock(raw_image, i << 4, (j << 4) + 8, XRGB8x8Block, jpg->seg.sof.frameWidth);
-                    
-                    Y4Cb1Cr1toXRGB(XRGB8x8Block, YDU[3], CbDU+36, CrDU+36 );
-                    writeBlock(raw_image, (i << 4) + 8, (j << 4) + 8, XRGB8x8Block, jpg->seg.sof.frameWidth);
-                    break;
-                }
-                
-                case 0x21:
-                {
-                 // Two Horizontal 8x8 Y Blocks correspond to a 8x8 Cb and a 8x8 Cr Block
-                    Y2Cb1Cr1toXRGB(XRGB8x8Block, YDU[0], CbDU,    CrDU);
-                    writeBlock(raw_image, 16*i, 8*j, XRGB8x8Block, jpg->seg.sof.frameWidth);
-                    
-                    Y2Cb1Cr1toXRGB(XRGB8x8Block, YDU[1], CbDU+4, CrDU+4);
-                    writeBlock(raw_image, 16*i+8, 8*j, XRGB8x8Block, jpg->seg.sof.frameWidth);
-                    break;
-                }
-                
-                case 0x11:
-                {
-                 // Each 8x8 Y Block corresponds to a 8x8 Cb and a 8x8 Cr Block
-                    Y1Cb1Cr1toXRGB(XRGB8x8Block, YDU[0], CbDU,    CrDU);
-                    writeBlock(raw_image, i << 3, j << 3, XRGB8x8Block, jpg->seg.sof.frameWidth);
-                    break;
-                }
-                
-                default:
-                {
-                    fprintf(stdout, "\nUnsupported sampling factor!");                    
-                    raw_image = (uint32_t *)NULL;
-                    break;
-                }
-            }            
-        }
-    }
-    
-    fprintf(stdout, "\nComplete!");
-    
-    for( DUindx = 0; DUindx < nYDU; free(YDU[DUindx++]) );
-    free(CbDU);
-    free(CrDU);
-    free(XRGB8x8Block);
-    
-    return raw_image;  
-}
-
-
-static void writeBlock( uint32_t * dest, uint16_t x, uint16_t y, uint32_t *XRGB8x8Block, uint16_t imageWidth)
-{
-uint32_t *  src;
-uint32_t    offset;
-uint8_t     i;
-
-
- // For the sake of efficiency over a short loop, I'm using unrolled loop
- 
-    for( src = XRGB8x8Block, i = 8; i; i-- )
-    {
-        offset = (y++)*imageWidth + x;
-        
-        dest[offset++] = *src++;
-        dest[offset++] = *src++;
-        dest[offset++] = *src++;
-        dest[offset++] = *src++;
-        dest[offset++] = *src++;
-        dest[offset++] = *src++;
-        dest[offset++] = *src++;
-        dest[offset]   = *src++;
-    }
-    
-}
-
-    
-int8_t jpg_read( uint32_t * surface, uint16_t surface_width, uint16_t surface_height, jpg_t * jpg)
-{
-uint16_t   x, y;
-float      dx, dy;
-uint32_t * raw_image;
-double     sample_i;
-uint32_t   offset;
-
-    /* jpg_open() positions the file pointer at the SOS marker which contains the image data */
-    
-    if(readMarker(jpg) != SOS)
-      return -1;
-    
-    fprintf(stdout, "\nReading SOS segment...");
-    readSOS(jpg);
-                
-    raw_image = decodeScanData(jpg);
-    if(!raw_image)
-        return -2;
-    
-    if( (jpg->width == surface_width) && (jpg->height == surface_height) ) 
-    {
-        for(y = 0, offset = 0; y < surface_height; y++, offset += (jpg->extended_width - jpg->width))
-        {
-            for(x = 0; x < surface_width; x++, offset++, surface++ )
-                *surface = raw_image[offset];
-        }
-    }
-    
-    else
-    {
-    /* Scale the image */
-        dx = (float)jpg->extended_width / surface_width;
-        dy = (float)jpg->extended_height / surface_height;
-        
-        for(y = 0, offset = 0; y < surface_height; y++ )
-        {
-            for(x = 0, sample_i = (int)(y * dy) * jpg->extended_width; x < surface_width; x++, sample_i += dx )
-                surface[offset++] = raw_image[(uint32_t)sample_i];
-        }
-    }
-
-    /* Ignore all other markers that follow the SOS marker */
-    
-    free(raw_image);
-    return 0;
-
-}
-
-
-jpg_t * jpg_open(const char * JPGfile)
-{
-jpg_t   * jpg;
-uint16_t  marker;
-int8_t    error = 0;
-
-
-    jpg = calloc(1, sizeof(jpg_t));
-    if(!jpg)
-      return NULL;
-      
-    jpg->fp = fopen(JPGfile,"rb");
-    if(!jpg->fp)
-    {
-      //fprintf(stdout, "\nJPEG image file '%s' does not exist!", JPGfile);
-      free(jpg);
-      return NULL;
-    }
-    
-    if(!validateJPEG(jpg))
-    {
-        fprintf(stdout, "\n'%s' is not a valid JPEG image file!", JPGfile);
-        fclose(jpg->fp);
-        free(jpg);
-        return NULL;
-    }
-    
-    while(!error)
-    {
-        marker = readMarker(jpg);
-        
-        switch(marker)
-        {
-            case APP0:
-            {
-                fprintf(stdout, "\nReading APP0 segment...");
-                readAPP0(jpg);
-                break;
-            }
-                
-            case SOF0:
-            { 
-                fprintf(stdout, "\nReading SOF segment...");                
-                readSOF(jpg);     
-                jpg->width = jpg->seg.sof.frameWidth;
-                jpg->height = jpg->seg.sof.frameHeight;
-                jpg->nc = jpg->seg.sof.nComponents;
-                jpg->hsf = jpg->seg.Y.HSmplFctr;
-                jpg->vsf = jpg->seg.Y.VSmplFctr;
-                /* The frame-width and frame-height of the image is extended to the nearest 16-byte boundary (see decodeScanData) */ 
-                jpg->extended_width = ( (jpg->width-1)  | ( (jpg->hsf << 3)-1 ) ) + 1 ;
-                jpg->extended_height = ( (jpg->height-1) | ( (jpg->vsf << 3)-1 ) ) + 1 ;     
-                break;
-            }
-            
-            case SOF1:
-            {
-                fprintf(stdout, "\nDecoding Error: Extended Sequential JPEG is not supported\n");                
-                error = 1;
-                break;
-            }
-            
-            case SOF2:
-            {
-                fprintf(stdout, "\nDecoding Error: Progressive JPEG is not supported\n");                
-                error = 1;
-                break;
-            }
-            
-            case SOF3:
-            {
-                fprintf(stdout, "\nDecoding Error: Lossless JPEG is not supported\n");                
-                error = 1;
-                break;
-            }
-            
-            case DHT:
-            {
-                fprintf(stdout, "\nReading DHT segment...");                
-                readDHT(jpg);                
-                break;
-            }
-            
-            case DQT:
-            {
-                fprintf(stdout, "\nReading DQT segment...");                
-                readDQT(jpg);                
-                break;
-            }
-            
-            case DRI:
-            {
-                fprintf(stdout, "\nReading DRI segment...");                
-                readDRI(jpg);                
-                break;
-            }
-            
-            case SOS:
-            {
-                return jpg;
-            }
-            
-            case EOI:
-            {
-                /* EOI marker must come after SOS marker */
-                error = 1;
-                break;
-            }
-            
-            case NOM:
-            {
-                fprintf(stdout, "\nInvalid JPEG: No marker found!");        
-                error = 1;
-                break;
-            }
-            
-            default:
-            {
-                fprintf(stdout, "\nSkipping trivial segment (Marker: 0x%x)...", marker & 0xffff);                
-                skipSegment(jpg);
-            }
-        }
-    }
-
-    
-    fclose(jpg->fp);
-    free(jpg);
-    return NULL;
-}
-
-
-void jpg_close(jpg_t * jpg)
-{
-    HUFFTREE_destroy( &jpg->seg.Y.HuffTreeDC );
-    HUFFTREE_destroy( &jpg->seg.Cb.HuffTreeDC );
-    HUFFTREE_destroy( &jpg->seg.Y.HuffTreeAC );
-    HUFFTREE_destroy( &jpg->seg.Cb.HuffTreeAC );
-    
-    fclose(jpg->fp);
-    free(jpg);
-}
+/* JPEG decoder for baseline-DCT based JPEG images. Copyright(C), Ch1ndra
+ * This software is licensed under Creative Commons Attribution License.
+ * For usage, modification and distribution permission, refer to the
+ * accompanying License */
+ 
+#include  "stddef.h"
+#include  "stdio.h"
+#include  "jpg.h"
+#include  "stdlib.h"
+#include  "stdarg.h"
+#include  "memory.h"
+#include  "jpgCore.c"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include  <fcntl.h>
+#include  <unistd.h>
+#include  <sys/stat.h>
+#include  <sys/mman.h>
+#include  <pthread.h>
+#define   JPG_HAVE_MMAP
+#define   JPG_HAVE_PTHREADS
+#endif
+
+#define   JPG_MAX_THREADS 64            /* Most threads that decode an image (or a batch) in parallel */
+
+#ifdef    JPG_HAVE_PTHREADS
+static    pthread_once_t  coreOnce = PTHREAD_ONCE_INIT;     /* Images can be decoded by several threads at once */
+#endif
+
+#define   JPG_SRC_MEM     0             /* Caller's memory buffer, left untouched */
+#define   JPG_SRC_MMAP    1             /* Memory mapped file, unmapped on jpg_close() */
+#define   JPG_SRC_HEAP    2             /* File loaded into a malloc'd buffer, freed on jpg_close() */
+
+static    __thread uint8_t lastError;   /* Why the last image the thread opened or decoded failed (jpg_error_t) */
+
+/* Messages are only formatted when the image has a log callback that wants 
+ * them, and are compiled out with JPG_NO_LOG */
+#ifdef    JPG_NO_LOG
+#define   JPG_LOG(jpg, level, ...)    ((void)0)
+#else
+#define   JPG_LOG(jpg, level, ...)    do { if( (jpg)->log && (level) <= (jpg)->log_level ) logMessage( (jpg), (level), __VA_ARGS__ ); } while(0)
+#endif
+
+
+#define   JPG_BAND_FAILED   0           /* The band couldn't be decoded */
+#define   JPG_BAND_DONE     1           /* The band was decoded */
+#define   JPG_BAND_STOPPED  2           /* Decoding was stopped by the caller's rows() callback */
+
+
+/* How a row of samples of each component is converted to pixels */
+
+#define   JPG_CONVERT_GRAY  0           /* Grayscale: the luma of each pixel is stored as is */
+#define   JPG_CONVERT_11    1           /* Every component has a sample per pixel */
+#define   JPG_CONVERT_21    2           /* Cb and Cr have a sample per two pixels across, Y one per pixel */
+#define   JPG_CONVERT_ANY   3           /* Any other sampling or colour space: components are upsampled to a row of their own first */
+
+
+/* How the blocks of an MCU are laid out: the blocks of each component in
+ * turn, H[c] across and V[c] down, left to right and top to bottom. Only 
+ * the first components may be reconstructed (the luma of a YCbCr image 
+ * decoded to gray), the blocks of the others are just entropy decoded */
+
+typedef struct
+{
+    uint8_t                 nc;                         /* Components of the scan */
+    uint8_t                 nReconstructed;             /* Components reconstructed, the first of the scan */
+    uint8_t                 nBlocks;                    /* Blocks of an MCU that are reconstructed */
+    uint8_t                 H[JPG_MAX_COMPONENTS];      /* Blocks of each component across an MCU */
+    uint8_t                 V[JPG_MAX_COMPONENTS];      /* Blocks of each component down an MCU */
+}
+MCUlayout;
+
+
+/* Decoding of an MCU: entropy decoding its blocks into a buffer of
+ * coefficients (or skipping them) and reconstructing them into a row of
+ * MCUs. A set is compiled for each of the common layouts, with the loops
+ * over components and blocks unrolled, and one for any other layout */
+
+typedef struct
+{
+    void (* decode)(jpg_t * jpg, const MCUlayout * layout, int16_t * coeffs, uint8_t * last);
+    void (* skip)(jpg_t * jpg, const MCUlayout * layout);
+    void (* reconstruct)(const MCUlayout * layout, const IDCTkernels * const * kernels, const MCUrow * row, uint16_t col, int16_t * coeffs, const uint8_t * last);
+}
+MCUkernels;
+
+
+/* A band of rows of MCUs of the region being decoded. Each band has a copy
+ * of the image, for a bit reader and DC predictions of its own, so that 
+ * bands starting at a restart interval can be decoded in parallel */
+
+typedef struct
+{
+    jpg_t                   jpg;        /* Copy of the image the band is decoded with */
+    const jpg_surface_t *   surface;    /* Surface the region is decoded into (a row of MCUs high when streamed) */
+    jpg_rows_cb             rows;       /* Callback the rows are streamed to instead (jpg_read_rows), or NULL */
+    void                *   user;       /* Caller's data, for rows() */
+    const jpg_planes_t  *   planes;     /* Planes the components are copied into instead (jpg_read_planes), or NULL */
+    MCUlayout               layout;     /* Blocks of an MCU */
+    const MCUkernels    *   mcu;        /* Decoding of the MCUs, specialized for the layout */
+    const IDCTkernels   *   kernels[JPG_MAX_COMPONENTS];    /* IDCT of the blocks of each component (to its size of block) */
+    MCUrow                  row;        /* Geometry of the rows of MCUs (the planes are allocated by the band) */
+    uint16_t                firstCol;   /* First column of MCUs that covers the region */
+    uint16_t                endCol;     /* Column of MCUs past the last that covers the region */
+    uint16_t                firstRow;   /* First row of MCUs of the band */
+    uint16_t                endRow;     /* Row of MCUs past the last of the band */
+    uint32_t                start;      /* MCU the band starts entropy decoding at */
+    uint8_t                 status;     /* Whether the band was decoded (JPG_BAND_*) */
+}
+MCUband;
+
+
+#define   JPG_PROBE_CHUNK   4096        /* Bytes read at a time when probing a file, enough for the headers of most images */
+
+/* Bytes of an image being probed. A file is read a chunk at a time, at the
+ * offsets the markers are found at, so that large segments (such as EXIF
+ * thumbnails) are skipped rather than read */
+
+typedef struct
+{
+    const uint8_t * data;               /* Image in memory, or the chunk last read from the file */
+    size_t          size;               /* Bytes in 'data' */
+    uint64_t        offset;             /* Offset of 'data' in the image */
+#ifdef JPG_HAVE_MMAP
+    int             fd;                 /* File being probed, or -1 for an image in memory */
+#else
+    FILE          * fp;                 /* File being probed, or NULL for an image in memory */
+#endif
+    uint8_t         chunk[JPG_PROBE_CHUNK];
+}
+probeSource;
+
+
+#define   JPG_HUFF_CACHE    64          /* Huffman Tables held by the table cache (a power of 2), about 2.5 KB each */
+
+/* A Huffman Table of the table cache, along with the bytes it's built from */
+
+typedef struct cachedHuffTbl
+{
+    struct cachedHuffTbl * next;        /* Next table built for the same image, when the cache is full */
+    uint64_t        hash;               /* Hash of the key */
+    uint16_t        keySize;            /* Bytes in 'key' */
+    uint8_t         key[1 + 16 + 256];  /* Class of the table (0 = DC, 1 = AC), the number of codewords of each length and the symbols */
+    HUFFTBL         tbl;
+}
+cachedHuffTbl;
+
+static    cachedHuffTbl * huffCache[JPG_HUFF_CACHE];
+static    const HUFFTBL   emptyHuffTbl;                     /* Tables an image uses without defining them */
+#ifdef    JPG_HAVE_PTHREADS
+static    pthread_mutex_t huffCacheLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+#define   JPG_ARENA_CHUNK   65536       /* Least size of a chunk of the arena of a context */
+#define   JPG_ARENA_ALIGN   64          /* Allocations from an arena start on a cache line, so that threads don't share them */
+
+/* The arena of a context is a stack of chunks allocated from in turn. When
+ * the context is reset for the next image, the chunks are consolidated into
+ * one as large as the most an image has needed, which is then reused */
+
+typedef struct arenaChunk
+{
+    struct arenaChunk * next;           /* Chunk allocated before this one */
+    uint8_t       * data;               /* First byte of the chunk, on a cache line */
+    size_t          size;               /* Bytes of the chunk */
+    size_t          used;               /* Bytes allocated from the chunk */
+}
+arenaChunk;
+
+
+struct jpg_context
+{
+    arenaChunk    * chunks;             /* Chunk allocated from, followed by those allocated before */
+    size_t          inUse;              /* Bytes allocated since the context was last reset */
+    size_t          highWater;          /* Most bytes allocated at once */
+#ifdef JPG_HAVE_PTHREADS
+    pthread_mutex_t lock;               /* Bands and workers allocate their rows from their own threads */
+#endif
+    uint8_t         busy;               /* An image is open in the context */
+};
+
+
+/* Where the arena of a context stood, so that what a decode allocates can
+ * be released once it's done */
+
+typedef struct
+{
+    arenaChunk    * chunk;
+    size_t          used;
+    size_t          inUse;
+}
+arenaMark;
+
+
+/* What a decode allocates, from all the threads decoding it, counted against
+ * its budget. Frees aren't counted, as a decode holds on to its memory until
+ * it's done */
+
+typedef struct
+{
+    size_t          used;               /* Bytes allocated so far */
+    size_t          limit;              /* Most bytes that may be allocated (0 = no limit) */
+    uint8_t         exceeded;           /* An allocation was refused for going over the limit */
+}
+memoryUsage;
+
+
+// All memory is allocated and freed through the allocator, which is malloc() and free() unless set otherwise
+static void * defaultMalloc(void * user, size_t size)
+{
+    (void)user;
+    return malloc(size);
+}
+
+
+static void defaultFree(void * user, void * ptr)
+{
+    (void)user;
+    free(ptr);
+}
+
+static    jpg_allocator_t allocator = { defaultMalloc, defaultFree, NULL };
+
+
+#ifdef JPG_HAVE_PTHREADS
+
+#define   JPG_SLOT_FREE   0             /* The slot can be filled by the entropy decoder */
+#define   JPG_SLOT_FULL   1             /* The slot holds a row of MCUs waiting to be reconstructed */
+#define   JPG_SLOT_BUSY   2             /* The row of MCUs of the slot is being reconstructed */
+
+/* Without restart intervals, only entropy decoding has to be done in order.
+ * A single thread entropy decodes a band into a ring of slots, each holding
+ * the coefficients of a row of MCUs, which are reconstructed (IDCT, colour
+ * conversion and writing to the surface) by a pool of workers. The size of
+ * the ring bounds the memory used when the workers fall behind */
+
+typedef struct
+{
+    int16_t       * coeffs;             /* 64 coefficients per block, zero but for those decoded */
+    uint8_t       * last;               /* Zig-zag index of the last non-zero coefficient of each block */
+    uint16_t        mcuRow;             /* Row of MCUs the coefficients belong to */
+    uint8_t         state;              /* JPG_SLOT_FREE, JPG_SLOT_FULL or JPG_SLOT_BUSY */
+}
+MCUslot;
+
+
+typedef struct
+{
+    MCUband       * band;               /* Band being decoded */
+    MCUslot       * slots;              /* Ring of rows of MCUs */
+    uint16_t        nSlots;             /* Number of slots of the ring */
+    uint16_t        head;               /* Next slot to be filled by the entropy decoder */
+    uint16_t        tail;               /* Next slot to be reconstructed */
+    uint8_t         done;               /* Set once the entropy decoder has filled its last slot */
+    pthread_mutex_t lock;
+    pthread_cond_t  filled;             /* Signalled when a slot is filled, or the entropy decoder is done */
+    pthread_cond_t  freed;              /* Signalled when a slot has been reconstructed */
+}
+MCUpipeline;
+
+
+typedef struct
+{
+    MCUpipeline   * pipeline;           /* Pipeline the worker takes rows of MCUs from */
+    MCUrow          row;                /* Planes the worker reconstructs rows of MCUs into */
+    uint8_t       * scaledRow;          /* Row of pixels the worker scales from (NULL if the region isn't scaled) */
+}
+MCUworker;
+
+
+#define   JPG_BATCH_BLOCK_COST  8       /* Bytes of entropy coded data that take about as long to decode as a block takes to reconstruct */
+
+/* The items of a batch are shared out among the threads as queues, the most
+ * costly items first. A thread takes items from the front of its queue, and
+ * once it's empty, steals them from the back of the queues of the others */
+
+typedef struct
+{
+    size_t        * order;              /* Items of the queue, most costly first */
+    size_t          first;              /* Next item to be taken by the thread the queue belongs to */
+    size_t          end;                /* Past the last item left, where items are stolen from */
+    pthread_mutex_t lock;
+}
+batchQueue;
+
+
+typedef struct
+{
+    jpg_batch_item_t      * items;      /* Items of the batch */
+    const char * const    * files;      /* Files of a batch being probed instead */
+    jpg_info_t            * infos;      /* What was found out from the files probed */
+    size_t                  n;          /* Number of items (or files) */
+    const jpg_options_t   * options;    /* Options the items are opened with */
+    uint64_t              * costs;      /* Estimated cost of each item */
+    batchQueue            * queues;     /* A queue per thread */
+    uint16_t                nThreads;   /* Number of threads of the pool */
+}
+batchPool;
+
+
+typedef struct
+{
+    batchPool     * pool;
+    uint16_t        id;                 /* Thread (and queue) number */
+}
+batchWorker;
+
+#endif
+
+#ifndef   JPG_NO_LOG
+static    void     logMessage(const jpg_t * jpg, uint8_t level, const char * format, ...);
+#endif
+static    void     setError(jpg_t * jpg, uint8_t error);
+static    uint8_t  loadFile(jpg_t * jpg, const char * JPGfile);
+#ifdef    JPG_HAVE_MMAP
+static    uint8_t  loadFD(jpg_t * jpg, int fd);
+#endif
+static    void *   allocMemory(size_t size);
+static    void     freeMemory(void * ptr);
+static    void *   arenaAlloc(jpg_context_t * context, size_t size);
+static    void     arenaReset(jpg_context_t * context);
+static    arenaMark scratchMark(const jpg_t * jpg);
+static    void     scratchRelease(const jpg_t * jpg, arenaMark mark);
+static    void *   scratchAlloc(const jpg_t * jpg, size_t size);
+static    void     scratchFree(const jpg_t * jpg, void * ptr);
+static    uint8_t  memoryError(const jpg_t * jpg);
+static    jpg_t *  createHandle(const jpg_options_t * options);
+static    void     releaseSource(jpg_t * jpg);
+static    jpg_t *  readHeaders(jpg_t * jpg);
+static    size_t   readBytes(jpg_t * jpg, void * dest, size_t n);
+static    uint16_t readMarker(jpg_t * jpg);
+static    uint8_t  validateJPEG(jpg_t * jpg);
+static    void     readAPP0(jpg_t * jpg);
+static    void     readAPP14(jpg_t * jpg);
+static    void     setColorspace(jpg_t * jpg);
+static    void     readSOF(jpg_t * jpg);
+static    void     readDQT(jpg_t * jpg);
+static    void     setupDequantTbl(Component * component, uint8_t idct);
+static    void     HUFFTBL_create(HUFFTBL * tbl, const uint8_t * counts, const uint8_t * symbols, uint16_t nSymbols, uint8_t isAC);
+static    const HUFFTBL * HUFFTBL_cached(jpg_t * jpg, const uint8_t * key, uint16_t keySize);
+static    uint8_t  HUFFTBL_readSymbol(jpg_t * jpg, const HUFFTBL * tbl);
+static    uint8_t  readDHT(jpg_t * jpg);
+static    void     readSOS(jpg_t * jpg);
+static    void     readDRI(jpg_t * jpg);
+static    uint8_t  skipSegment(jpg_t * jpg);
+static    uint8_t  readScanByte(jpg_t * jpg, uint8_t * _byte);
+static    void     fillBitStream(jpg_t * jpg);
+static    uint32_t peekBits(jpg_t * jpg, uint8_t n);
+static    void     skipBits(jpg_t * jpg, uint8_t n);
+static    int      readCoefficient(jpg_t * jpg, uint8_t category);
+static    void     resetDecoder(jpg_t * jpg);
+static    void     restartDecoder(jpg_t * jpg);
+static    uint8_t  decodeDU(jpg_t * jpg, Component * component, int16_t * coeffTbl);
+static    void     skipDU(jpg_t * jpg, Component * component);
+static    uint8_t  findRestarts(const jpg_t * jpg, MCUband * bands, uint16_t nBands);
+static    uint8_t  allocMCURow(const jpg_t * jpg, MCUrow * row, const jpg_surface_t * surface, uint8_t ** scaledRow);
+static    uint16_t firstSurfaceRow(const MCUrow * row, const jpg_surface_t * surface, uint32_t y);
+static    uint8_t  decodeBand(MCUband * band);
+#ifdef    JPG_HAVE_PTHREADS
+static    uint8_t  pipelineBand(MCUband * band, uint16_t nWorkers);
+static    uint64_t estimateCost(const jpg_batch_item_t * item);
+#endif
+static    void     decodeItem(jpg_batch_item_t * item, const jpg_options_t * options);
+static    void     batchOptions(const jpg_options_t * options, jpg_options_t * threadOptions);
+static    const uint8_t * probeBytes(probeSource * src, uint64_t pos, size_t n);
+static    int8_t   probeHeaders(probeSource * src, uint64_t size, jpg_info_t * info);
+static    uint8_t  decodeScanData(jpg_t * jpg, const jpg_surface_t * surface, const jpg_planes_t * planes, uint16_t x, uint16_t y, uint16_t w, uint16_t h, jpg_rows_cb rows, void * user);
+static    int8_t   readScan(jpg_t * jpg, const jpg_surface_t * surface, const jpg_planes_t * planes, uint16_t x, uint16_t y, uint16_t w, uint16_t h, jpg_rows_cb rows, void * user);
+static    void     convertRow(jpg_t * jpg, const MCUrow * row, uint16_t y, uint8_t format, void * pixels);
+static    void     componentSize(const jpg_t * jpg, uint8_t c, uint16_t * width, uint16_t * height);
+static    void     copyMCURow(const jpg_t * jpg, const jpg_planes_t * planes, const MCUrow * row, uint16_t mcuRow);
+static    void     writeMCURow(jpg_t * jpg, const jpg_surface_t * surface, const MCUrow * row, uint16_t mcuRow, uint16_t * nextRow, uint8_t * scaledRow);
+static    uint8_t  streamMCURow(MCUband * band, const MCUrow * row, uint16_t mcuRow);
+
+
+// JPEG stores information in its header in big-endian format
+// Hence, it is necessary to accomodate conversion to comply with little-endian architecture
+
+uint16_t toSmallEndian(uint16_t big_endian)
+{    
+    return( ( (big_endian & 0xFF) << 8 ) + (big_endian >> 8) );
+}
+
+
+#ifndef JPG_NO_LOG
+
+static void logMessage(const jpg_t * jpg, uint8_t level, const char * format, ...)
+{
+char        message[256];
+va_list     args;
+
+
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    
+    jpg->log( jpg->log_user, level, message );
+}
+
+#endif
+
+
+/* Records why an image failed, for the image and for jpg_last_error() on 
+ * the calling thread, and logs it */
+
+static void setError(jpg_t * jpg, uint8_t error)
+{
+    lastError = error;
+    
+    if( jpg )
+    {
+        jpg->error = error;
+        JPG_LOG( jpg, JPG_LOG_ERROR, "%s", jpg_strerror(error) );
+    }
+}
+
+
+/* The entire JPEG image is accessed as an array of bytes, regardless of
+ * where it comes from (a memory buffer, a memory mapped file or a file 
+ * loaded into memory). So, parsing simply moves an offset into the array */
+
+static size_t readBytes(jpg_t * jpg, void * dest, size_t n)
+{
+size_t  avail;
+
+
+    avail = (jpg->pos < jpg->size) ? jpg->size - jpg->pos : 0;
+    
+ // Anything past the end of a truncated image reads as 0s
+    if( n > avail )
+    {
+        memset( (uint8_t *)dest + avail, 0, n - avail );
+        n = avail;
+    }
+    
+    memcpy( dest, jpg->data + jpg->pos, n );
+    jpg->pos += n;
+    
+    return n;
+}
+
+
+// All segments appearing in the JPEG file start with a marker identifying the segment
+
+static uint16_t readMarker(jpg_t * jpg)
+{
+ 
+    if( jpg->pos + 2 > jpg->size || jpg->data[jpg->pos] != 0xFF )
+        return NOM;
+        
+return (jpg->data[jpg->pos] << 8) | jpg->data[jpg->pos + 1];
+
+}
+
+
+static uint8_t validateJPEG(jpg_t * jpg)
+{
+uint16_t    firstMarker;
+
+ // Make sure we're at the beginning of the file 
+    jpg->pos = 0;
+    
+    firstMarker = readMarker(jpg);
+    if( firstMarker != SOI )
+        return 0;
+    
+ // Skip SOI Marker and position the file pointer to the next segment
+    jpg->pos += 2;
+    
+return 1;
+
+}
+
+
+static void readAPP0(jpg_t * jpg)
+{
+size_t  start = jpg->pos;
+
+    
+    readBytes(jpg, &jpg->seg.app0, sizeof(jpg->seg.app0));
+    jpg->seg.app0.length = toSmallEndian(jpg->seg.app0.length);
+    
+ // Position the file pointer to the next segment
+    jpg->pos = start + sizeof(jpg->seg.app0.APP0_marker) + jpg->seg.app0.length;
+    
+}
+
+
+/* The Adobe segment tells how the components were transformed: 0 = not at
+ * all (RGB or CMYK), 1 = YCbCr, 2 = YCCK. Only its transform byte is kept */
+
+static void readAPP14(jpg_t * jpg)
+{
+size_t   start = jpg->pos;
+uint8_t  app14[16];
+uint16_t length;
+
+
+ // Marker, length, "Adobe", version, two flags words and the transform
+    readBytes(jpg, app14, sizeof(app14));
+    length = (app14[2] << 8) | app14[3];
+    
+    if( length >= sizeof(app14) - 2 && !memcmp(app14 + 4, "Adobe", 5) )
+    {
+        jpg->adobe = app14[15] + 1;
+        JPG_LOG( jpg, JPG_LOG_INFO, "Adobe colour transform: %d", app14[15] );
+    }
+    
+ // Position the file pointer to the next segment
+    jpg->pos = start + 2 + length;
+    
+}
+
+
+/* The colour space of the components follows from their number, the Adobe
+ * segment, or else their IDs (JFIF images are always YCbCr) */
+
+static void setColorspace(jpg_t * jpg)
+{
+const Component * comp = jpg->seg.comp;
+
+
+    switch( jpg->nc )
+    {
+        case 3:
+            jpg->colorspace = ( jpg->adobe == 1 || (comp[0].ID == 'R' && comp[1].ID == 'G' && comp[2].ID == 'B') ) ? JPG_COLOR_RGB : JPG_COLOR_YCBCR;
+            break;
+        
+        case 4:
+            jpg->colorspace = ( jpg->adobe == 3 ) ? JPG_COLOR_YCCK : JPG_COLOR_CMYK;
+            break;
+        
+        default:
+            jpg->colorspace = JPG_COLOR_GRAY;
+    }
+}
+
+
+static void readSOF(jpg_t * jpg)
+{
+size_t   start = jpg->pos;
+uint8_t  i;
+    
+    
+    readBytes(jpg, &jpg->seg.sof, sizeof(jpg->seg.sof));
+    
+    jpg->seg.sof.length         =   toSmallEndian(jpg->seg.sof.length);
+    jpg->seg.sof.frameWidth     =   toSmallEndian(jpg->seg.sof.frameWidth);
+    jpg->seg.sof.frameHeight    =   toSmallEndian(jpg->seg.sof.frameHeight);
+    
+    JPG_LOG( jpg, JPG_LOG_INFO, "Image size: %dx%d, %d components", 
+             jpg->seg.sof.frameWidth, jpg->seg.sof.frameHeight, jpg->seg.sof.nComponents );
+                    
+/*  Components are kept in the order of the frame header, which the MCUs
+ *  follow, whatever their IDs (usually 1, 2 and 3 for Y, Cb and Cr) */
+    
+    for( i = 0; i < jpg->seg.sof.nComponents && i < JPG_MAX_COMPONENTS; i++ )
+    {
+        jpg->seg.comp[i].ID         =  jpg->seg.sof.FCSFstruct[i].ID;
+        jpg->seg.comp[i].HSmplFctr  = (jpg->seg.sof.FCSFstruct[i].SmplFctr >> 4) & 0xF;
+        jpg->seg.comp[i].VSmplFctr  = (jpg->seg.sof.FCSFstruct[i].SmplFctr) & 0xF;
+        jpg->seg.comp[i].QntzTbl    = &jpg->seg.dqt[jpg->seg.sof.FCSFstruct[i].QntzTblN & 3].QntzTbl[0][0];
+        
+        setupDequantTbl(&jpg->seg.comp[i], jpg->idct);
+    }
+    
+ // The MCU of a lone component is a single block, whatever its sampling factors
+    if( jpg->seg.sof.nComponents == 1 )
+    {
+        jpg->seg.comp[0].HSmplFctr = 1;
+        jpg->seg.comp[0].VSmplFctr = 1;
+    }
+    
+    JPG_LOG( jpg, JPG_LOG_INFO, "Sampling factors: %dx%d", jpg->seg.comp[0].HSmplFctr, jpg->seg.comp[0].VSmplFctr );
+    
+ // Position the file pointer to the next segment 
+    jpg->pos = start + sizeof(jpg->seg.sof.SOF_marker) + jpg->seg.sof.length;
+    
+}
+
+
+static void readDQT(jpg_t * jpg)
+{
+DQTseg   dqt;
+uint8_t  QTcount;
+uint8_t  id;
+
+ /* It is important to know that the Quantization Table Identifier
+  * doesnot necessarily identify the component to which this
+  * Quantization Table corresponds. The only way to tell which
+  * is which is after reading Quantization Table Number for Y, Cb
+  * and Cr components from the Frame Component Specification */
+     
+    readBytes(jpg, &dqt, 4);
+    dqt.length = toSmallEndian(dqt.length);
+    
+ // Determine number of Quantization Tables defined in this segment 
+    QTcount = dqt.length >> 6;
+
+    /* For now, we will assume that the QTID = 0 corresponds to the Luminance
+     * and QTID = 1 corresponds to the Chrominance, which is usually the case.
+     * We will make adjustments (if required) after we read the SOF segment */
+    
+    for( ; QTcount; QTcount-- )
+    {
+        readBytes(jpg, &id, 1);
+
+        if( id < 4 )
+        {
+            readBytes(jpg, jpg->seg.dqt[id].QntzTbl, 64);
+        }
+        
+        else
+        {
+            JPG_LOG( jpg, JPG_LOG_WARNING, "Unknown identifier %d for the Quantization Table", id );
+        }
+    }
+    
+ // Quantization Tables may also be (re)defined after the SOF segment
+    for( id = 0; id < JPG_MAX_COMPONENTS; id++ )
+        setupDequantTbl(&jpg->seg.comp[id], jpg->idct);
+    
+ // At this point, the file pointer is right at the next segment
+    
+}
+
+
+static void setupDequantTbl(Component * component, uint8_t idct)
+{
+uint8_t  i;
+
+
+    if( !component->QntzTbl )
+        return;
+    
+ /* Every coefficient is multiplied by the corresponding entry of the 
+  * Quantization Table as it's decoded. For the fast IDCT, the entries
+  * are prescaled so that the same multiplication also applies the AAN 
+  * scale factors (see performFastIDCT) */
+    
+    for( i = 0; i < 64; i++ )
+    {
+        if( idct == JPG_IDCT_FAST )
+        {
+            component->DequantTbl[i] = ( component->QntzTbl[i] * AANscale[ deZigZagVector[i] ] 
+                                         + (1 << (13 - AAN_SCALE_BITS)) ) >> (14 - AAN_SCALE_BITS);
+        }
+        
+        else
+        {
+            component->DequantTbl[i] = component->QntzTbl[i];
+        }
+    }
+    
+}
+
+
+static void HUFFTBL_create(HUFFTBL * tbl, const uint8_t * counts, const uint8_t * symbols, uint16_t nSymbols, uint8_t isAC)
+{
+uint8_t     codeLength;
+uint8_t     category;
+uint8_t     symbol;
+uint16_t    i, j, k;
+uint16_t    first, last;
+uint16_t    codeWord = 0;
+int32_t     coeff;
+
+
+    memset( tbl, 0, sizeof(HUFFTBL) );
+    memcpy( tbl->symbols, symbols, nSymbols );
+
+ /* Codewords of the same length are consecutive integers and the first
+  * codeword of length i+1 is obtained by appending a 0 to the codeword
+  * following the last codeword of length i */
+
+    for( codeLength = 1, k = 0; codeLength <= 16; codeLength++ )
+    {
+        tbl->valOffset[codeLength] = k - codeWord;
+        tbl->maxCode[codeLength]   = -1;
+
+        for( j = counts[codeLength-1]; j && k < 256; j--, k++, codeWord++ )
+        {
+            tbl->maxCode[codeLength] = codeWord;
+
+         // Every HUFF_LOOKAHEAD bit sequence starting with a short codeword resolves to that codeword
+            if( codeLength <= HUFF_LOOKAHEAD )
+            {
+                first = codeWord << (HUFF_LOOKAHEAD - codeLength);
+                last  = (codeWord + 1) << (HUFF_LOOKAHEAD - codeLength);
+
+                for( i = first; i < last && i < (1 << HUFF_LOOKAHEAD); i++ )
+                {
+                    tbl->lookup[i] = (codeLength << 8) | tbl->symbols[k];
+                }
+            }
+        }
+        codeWord = codeWord << 1;
+    }
+
+ /* Most coefficients are small enough for the codeword and the bit-string
+  * of the coefficient to fit together in HUFF_LOOKAHEAD bits. For those, the
+  * coefficient is decoded in advance so that a single lookup returns the
+  * zero-run-length, the coefficient and the number of bits to consume */
+
+    for( i = 0; i < (1 << HUFF_LOOKAHEAD); i++ )
+    {
+        if( !tbl->lookup[i] )
+            continue;
+
+        codeLength  =  tbl->lookup[i] >> 8;
+        symbol      =  tbl->lookup[i] & 0xFF;
+        category    =  symbol & 0xF;
+
+     // For AC coefficients, category 0 is either END_OF_BLOCK or a run of 16 zeroes
+        if( (isAC && !category) || codeLength + category > HUFF_LOOKAHEAD )
+            continue;
+
+        coeff = 0;
+
+        if( category )
+        {
+            coeff = ( i >> (HUFF_LOOKAHEAD - codeLength - category) ) & ( (1 << category) - 1 );
+
+         // A bit-string starting with 0 represents a negative coefficient with its bits complemented
+            if( coeff < (1 << (category - 1)) )
+                coeff -= (1 << category) - 1;
+        }
+
+        if( coeff >= -128 && coeff <= 127 )
+        {
+            tbl->fastCoeff[i] = (int16_t)( coeff * 256 + (symbol & 0xF0) + codeLength + category );
+        }
+    }
+}
+
+
+static uint8_t HUFFTBL_readSymbol(jpg_t * jpg, const HUFFTBL * tbl)
+{
+uint16_t    entry;
+uint16_t    code;
+uint8_t     codeLength;
+
+
+    if( jpg->stream.nbits < 16 )
+        fillBitStream(jpg);
+
+ // Most codewords are resolved by looking up the next HUFF_LOOKAHEAD bits of the stream
+    entry = tbl->lookup[ peekBits(jpg, HUFF_LOOKAHEAD) ];
+
+    if( entry )
+    {
+        codeLength = entry >> 8;
+    }
+
+    else
+    {
+     // Otherwise, find the length at which the next bits form a valid codeword
+        code = peekBits(jpg, 16);
+
+        for( codeLength = HUFF_LOOKAHEAD + 1; codeLength <= 16; codeLength++ )
+        {
+            if( (int32_t)(code >> (16 - codeLength)) <= tbl->maxCode[codeLength] )
+                break;
+        }
+
+     // Corrupt data, there is no such codeword
+        if( codeLength > 16 )
+            return EOB;
+
+        entry = tbl->symbols[ ( (code >> (16 - codeLength)) + tbl->valOffset[codeLength] ) & 0xFF ];
+    }
+
+    skipBits(jpg, codeLength);
+
+    return (uint8_t)entry;
+
+}
+
+
+/* Most images use the Huffman Tables of Annex K, or one of a few tables of
+ * their encoder, so the tables are built once and shared by all the images
+ * that define them, through a process wide cache keyed by the bytes of the
+ * table (its class, the number of codewords of each length and the symbols).
+ * Cached tables are never modified nor freed, so images can use them without
+ * holding a lock. Once the cache is full, images build their own tables */
+
+static const HUFFTBL * HUFFTBL_cached(jpg_t * jpg, const uint8_t * key, uint16_t keySize)
+{
+cachedHuffTbl * entry;
+uint64_t        hash = 14695981039346656037ull;
+uint16_t        i, slot;
+
+
+ // FNV-1a of the key
+    for( i = 0; i < keySize; i++ )
+    {
+        hash ^= key[i];
+        hash *= 1099511628211ull;
+    }
+
+#ifdef JPG_HAVE_PTHREADS
+    pthread_mutex_lock( &huffCacheLock );
+#endif
+
+ // Open addressing, an entry is looked for in the slots following its hash until an empty slot
+    for( i = 0; i < JPG_HUFF_CACHE; i++ )
+    {
+        slot  = (hash + i) & (JPG_HUFF_CACHE - 1);
+        entry = huffCache[slot];
+
+        if( !entry || ( entry->hash == hash && entry->keySize == keySize && !memcmp(entry->key, key, keySize) ) )
+            break;
+    }
+
+ // The cache is full and doesn't hold the table
+    if( i == JPG_HUFF_CACHE )
+        entry = NULL;
+
+    if( !entry )
+    {
+        entry = allocMemory( sizeof(cachedHuffTbl) );
+        if( entry )
+        {
+            entry->hash    = hash;
+            entry->keySize = keySize;
+            memcpy( entry->key, key, keySize );
+            HUFFTBL_create( &entry->tbl, key + 1, key + 17, keySize - 17, key[0] );
+
+         // A table that doesn't fit in the cache belongs to the image
+            if( i < JPG_HUFF_CACHE )
+            {
+                huffCache[slot] = entry;
+                entry->next     = NULL;
+            }
+            else
+            {
+                entry->next = (cachedHuffTbl *)jpg->tables;
+                jpg->tables = entry;
+            }
+        }
+    }
+
+#ifdef JPG_HAVE_PTHREADS
+    pthread_mutex_unlock( &huffCacheLock );
+#endif
+
+    return entry ? &entry->tbl : NULL;
+}
+
+
+static uint8_t readDHT(jpg_t * jpg)
+{
+const HUFFTBL * tbl;
+uint8_t         key[1 + 16 + 256];
+uint16_t        nSymbols;
+uint8_t         i;
+
+
+    readBytes(jpg, &jpg->seg.dht, 4);
+    jpg->seg.dht.length = toSmallEndian(jpg->seg.dht.length); 
+    
+    do
+    {  
+           
+        readBytes( jpg, &jpg->seg.dht.CLASS_ID, 17 );
+        
+     /* Just like the Quantization Table Identifier, the Huffman Table 
+      * Identifier doesnot necessarily identify the component to which 
+      * this  Huffman table corresponds. The only way to tell which is
+      * whose is after reading SOS segment */
+      
+     // The high nibble represents CLASS( 0 = DC and 1 = AC) and low nibble represents ID
+        JPG_LOG( jpg, JPG_LOG_DEBUG, "Reading Huffman Code Value for %s table %d...", 
+                 (jpg->seg.dht.CLASS_ID >> 4) ? "AC" : "DC", jpg->seg.dht.CLASS_ID & 0xF );
+        
+     // The symbols follow the codeword frequencies, sorted by increasing codeword length
+        for( i = 0, nSymbols = 0; i < 16; i++ )
+            nSymbols += jpg->seg.dht.huffCodefreq[i];
+        nSymbols = nSymbols > 256 ? 256 : nSymbols;
+        
+        key[0] = (jpg->seg.dht.CLASS_ID >> 4) & 1;
+        memcpy( key + 1, jpg->seg.dht.huffCodefreq, 16 );
+        readBytes( jpg, key + 17, nSymbols );
+        
+        tbl = HUFFTBL_cached( jpg, key, 17 + nSymbols );
+        if( !tbl )
+            return 0;
+        
+        jpg->seg.huffTbl[(jpg->seg.dht.CLASS_ID >> 4) & 1][jpg->seg.dht.CLASS_ID & 3] = tbl;
+        
+    } while( !readMarker(jpg) && jpg->pos < jpg->size );
+
+ // By now, file pointer is right at the next segment
+    return 1;
+}
+
+
+static void readSOS(jpg_t * jpg)
+{
+Component * component;
+size_t      start = jpg->pos;
+uint8_t     i, c;
+
+    
+    readBytes(jpg, &jpg->seg.sos, sizeof(jpg->seg.sos));
+    jpg->seg.sos.length = toSmallEndian(jpg->seg.sos.length);
+    
+ // Now that the Scan Segment is known, assign the Huffman Tables to each component
+    for( i = 0; i < jpg->seg.sos.nComponents && i < JPG_MAX_COMPONENTS; i++ )
+    {
+        for( c = 0; c < jpg->nc && c < JPG_MAX_COMPONENTS && jpg->seg.comp[c].ID != jpg->seg.sos.SCSFstruct[i].ID; c++ );
+        
+        if( c == jpg->nc || c == JPG_MAX_COMPONENTS )
+            continue;
+        
+        component = &jpg->seg.comp[c];
+        component->HuffTblDC = jpg->seg.huffTbl[0][(jpg->seg.sos.SCSFstruct[i].HuffTblN >> 4) & 3];
+        component->HuffTblAC = jpg->seg.huffTbl[1][jpg->seg.sos.SCSFstruct[i].HuffTblN & 3];
+    }
+        
+ // Skip the Scan Header and position the file pointer to the Scan data 
+    jpg->pos = start + sizeof(jpg->seg.sos.SOS_marker) + jpg->seg.sos.length;
+    
+}
+
+
+static void readDRI(jpg_t * jpg)
+{
+    
+    readBytes(jpg, &jpg->seg.dri, sizeof(jpg->seg.dri));
+    jpg->seg.dri.length = toSmallEndian(jpg->seg.dri.length);    
+    jpg->seg.dri.nMCUs  = toSmallEndian(jpg->seg.dri.nMCUs);
+    
+    JPG_LOG( jpg, JPG_LOG_INFO, "Number of MCUs in the Restart Interval: %d", jpg->seg.dri.nMCUs );
+    
+ // By now, file pointer is right at the next segment
+ 
+}
+
+
+static uint8_t skipSegment(jpg_t * jpg)
+{
+uint16_t    segMarker;
+uint16_t    segLength;
+
+
+    readBytes(jpg, &segMarker, sizeof(segMarker));
+    readBytes(jpg, &segLength, sizeof(segLength));
+    
+ // The length includes its own 2 bytes, anything shorter would go backwards
+    if( toSmallEndian(segLength) < sizeof(segLength) )
+        return 0;
+    
+    jpg->pos += toSmallEndian(segLength) - sizeof(segLength);
+    
+    return 1;
+}
+
+
+static uint8_t readScanByte(jpg_t * jpg, uint8_t * _byte)
+{
+    
+    if( jpg->stream.ptr >= jpg->stream.end )
+        return 0;
+    
+    *_byte = *jpg->stream.ptr++;
+    return 1;
+    
+}
+
+
+static void fillBitStream(jpg_t * jpg)
+{
+uint8_t     _byte;
+
+
+ /* Top the accumulator up to at least 57 bits in one go, so that the 
+  * decoder can peek and consume several codewords before refilling */
+  
+    while( jpg->stream.nbits <= 56 )
+    {
+        _byte = 0;
+        
+     /* Once a marker has been encountered, there is no more entropy coded
+      * data to read, so we keep feeding 0s until the decoder is reset */
+        
+        if( !jpg->stream.marker )
+        {
+            if( !readScanByte(jpg, &_byte) )
+            {
+             // Truncated stream: pretend we've found an End of Image Marker
+                jpg->stream.marker = EOI & 0xFF;
+            }
+            
+            else if( _byte == 0xFF )
+            {
+            /*  JPEG standard specifies that the RST marker (0xFFD0 to 0xFFD7) 
+             *  may be encoded within the Scan Data for synchronization. As such,
+             *  if the encoder needs to write 0xff byte as a part of encoded MCU
+             *  data, it needs to write an additional stuff byte(0x00) to ensure
+             *  that this byte(0xff) is a part of MCU data and not a marker.
+             *  Hence, it is necessary to skip stuffed byte(if any). Any other
+             *  byte that follows (other than 0xFF fill bytes) defines a marker */
+             
+                do
+                {
+                    if( !readScanByte(jpg, &jpg->stream.marker) )
+                        jpg->stream.marker = EOI & 0xFF;
+                } while( jpg->stream.marker == 0xFF );
+                
+                if( jpg->stream.marker != 0x00 )
+                    _byte = 0;
+            }
+        }
+        
+        jpg->stream.bits  |= (uint64_t)_byte << (56 - jpg->stream.nbits);
+        jpg->stream.nbits += 8;
+    }
+    
+}
+
+
+static inline uint32_t peekBits(jpg_t * jpg, uint8_t n)
+{
+    return (uint32_t)( jpg->stream.bits >> (64 - n) );
+}
+
+
+static inline void skipBits(jpg_t * jpg, uint8_t n)
+{
+    jpg->stream.bits  <<= n;
+    jpg->stream.nbits  -= n;
+}
+
+
+static int readCoefficient(jpg_t * jpg, uint8_t category)
+{
+int  coeff;
+
+    
+ // Baseline coefficients never exceed 11 bits, so guard against corrupt data
+    category &= 0xF;
+    
+    if( !category )
+    {
+        return 0;
+    }
+    
+    if( jpg->stream.nbits < category )
+        fillBitStream(jpg);
+    
+    coeff = peekBits(jpg, category);
+    skipBits(jpg, category);
+    
+ /* If the bit-string for the coefficient starts with 1, it suggests
+  * that the coefficient is positive and stored as an unsigned 
+  * representation. Otherwise, the coefficient is negative and stored
+  * with its bits complemented */
+    
+    if( coeff < (1 << (category - 1)) )
+    {
+        coeff -= (1 << category) - 1;
+    }
+    
+    return coeff;
+
+}
+
+
+static void resetDecoder(jpg_t * jpg)
+{
+uint8_t     c;
+
+
+    for( c = 0; c < JPG_MAX_COMPONENTS; c++ )
+        jpg->seg.comp[c].DCcoeff = 0;
+    
+    jpg->stream.bits = 0;
+    jpg->stream.nbits = 0;
+}
+
+
+static void restartDecoder(jpg_t * jpg)
+{
+ /* At the end of a Restart Interval, the encoder pads the entropy coded 
+  * data to a byte boundary and writes a RST marker. So, drop the bits that 
+  * were read ahead and skip past the RST marker (if we haven't already) */
+  
+    while( !jpg->stream.marker )
+    {
+        jpg->stream.nbits = 0;
+        fillBitStream(jpg);
+    }
+    
+    if( (jpg->stream.marker & 0xF8) == 0xD0 )
+    {
+        jpg->stream.marker = 0;
+    }
+    
+    resetDecoder(jpg);
+}
+    
+
+/* Decodes a block (Data Unit) of a component, dequantized and de-zigzagged
+ * into the coefficient table, and returns the zigzag index of its last
+ * non-zero coefficient */
+
+static uint8_t decodeDU(jpg_t * jpg, Component * component, int16_t * coeffTbl)
+{
+uint8_t         encodedByte;
+int             CoeffAC;
+uint8_t         ZeroRunLength;
+uint8_t         category;
+uint8_t         i;
+uint8_t         last = 0;
+int16_t         fast;
+
+
+/*  For DC coefficient, the scan data starts with a huffman encoded
+ *  'category' byte. The 'category' is the minimum no. of bits required 
+ *  to represent a coefficient. Mostly, the lookup table resolves both
+ *  the 'category' and the coefficient at once */
+ 
+    if( jpg->stream.nbits < 32 )
+        fillBitStream(jpg);
+    
+    fast = component->HuffTblDC->fastCoeff[ peekBits(jpg, HUFF_LOOKAHEAD) ];
+    
+/*  DC Coefficient is stored as a difference from the previous block.
+ *  Hence, to determine absolute DC coefficient, we add DC Coefficient
+ *  of the previous block */
+ 
+    if( fast )
+    {
+        component->DCcoeff    += fast >> 8;
+        skipBits(jpg, fast & 0xF);
+    }
+    
+    else
+    {
+        category               = HUFFTBL_readSymbol( jpg, component->HuffTblDC );
+        component->DCcoeff    += readCoefficient(jpg, category);  
+    }
+    
+ // To improve performance, deZigZag and deQuantize Coefficients as they are retrieved
+    coeffTbl[0]  = component->DCcoeff * component->DequantTbl[0];
+    
+/*  For AC coefficients, the scan data starts with a huffman encoded 
+ *  'RLE+category' byte. The higher nibble represents the run length of
+ *  preceeding zeroes whereas the lower nibble represents the 'category' */
+    
+        for(i = 1; i < 64; i++ )
+        {
+         // A refill leaves enough bits for a codeword and the bit-string of its coefficient
+            if( jpg->stream.nbits < 32 )
+                fillBitStream(jpg);
+            
+            fast = component->HuffTblAC->fastCoeff[ peekBits(jpg, HUFF_LOOKAHEAD) ];
+            
+            if( fast )
+            {
+             // The codeword as well as the bit-string of the coefficient are resolved by the lookup
+                ZeroRunLength   =   (fast >> 4) & 0xf;
+                CoeffAC         =   fast >> 8;
+                
+                skipBits(jpg, fast & 0xF);
+            }
+            
+            else
+            {
+                encodedByte  = HUFFTBL_readSymbol( jpg, component->HuffTblAC );
+                
+             // Check for END_OF_BLOCK Marker(0x00), the rest of the coefficients are zero
+                if( encodedByte == EOB )
+                {                                                       
+                    break;
+                }
+                
+                category        =   encodedByte & 0xf;                    
+                ZeroRunLength   =   (encodedByte >> 4) & 0xf;                        
+                CoeffAC         =   readCoefficient(jpg, category);        
+            }
+                        
+         // The table is zero but for the coefficients written, so the run of zeroes is just skipped
+            i += ZeroRunLength;
+            i  = i > 63 ? 63 : i;
+            
+            if( CoeffAC )
+            {
+                coeffTbl[ deZigZagVector[i] ] = CoeffAC * component->DequantTbl[i];
+                last = i;
+            }
+        }
+        
+    return last;
+}
+
+
+static void skipDU(jpg_t * jpg, Component * component)
+{
+uint8_t         encodedByte;
+uint8_t         category;
+uint8_t         i;
+int16_t         fast;
+
+
+    if( jpg->stream.nbits < 32 )
+        fillBitStream(jpg);
+    
+    fast = component->HuffTblDC->fastCoeff[ peekBits(jpg, HUFF_LOOKAHEAD) ];
+    
+    if( fast )
+    {
+        component->DCcoeff    += fast >> 8;
+        skipBits(jpg, fast & 0xF);
+    }
+    
+    else
+    {
+        category               = HUFFTBL_readSymbol( jpg, component->HuffTblDC );
+        component->DCcoeff    += readCoefficient(jpg, category);  
+    }
+    
+        for(i = 1; i < 64; i++ )
+        {
+            if( jpg->stream.nbits < 32 )
+                fillBitStream(jpg);
+            
+            fast = component->HuffTblAC->fastCoeff[ peekBits(jpg, HUFF_LOOKAHEAD) ];
+            
+            if( fast )
+            {
+                i += (fast >> 4) & 0xf;
+                skipBits(jpg, fast & 0xF);
+            }
+            
+            else
+            {
+                encodedByte  = HUFFTBL_readSymbol( jpg, component->HuffTblAC );
+                
+                if( encodedByte == EOB )
+                {                                                       
+                    break;
+                }
+                
+             // The bit-string of the coefficient is read, but not needed
+                i += (encodedByte >> 4) & 0xf;
+                readCoefficient(jpg, encodedByte & 0xf);
+            }
+        }
+}
+
+
+/*  The order, in which the Data Units appear in the Scan Data
+ *  corresponds to the order in which the components appear in the Scan-
+ *  Segment. Besides, the number of blocks of each component that adds up
+ *  to create a MCU is defined by the sampling factor of each component:
+ *  H blocks across and V blocks down, ordered left to right, top to bottom.
+ *  These are written once for any layout, and stamped out for the common
+ *  layouts (the layout being a constant, the compiler unrolls the loops
+ *  over the components and blocks), and for any other layout */
+
+static inline __attribute__((always_inline)) void decodeMCUas(jpg_t * jpg, const MCUlayout * layout, int16_t * coeffs, uint8_t * last)
+{
+uint8_t     c, k, n = 0;
+
+
+    for( c = 0; c < layout->nReconstructed; c++ )
+        for( k = 0; k < layout->H[c] * layout->V[c]; k++, n++ )
+            last[n] = decodeDU( jpg, &jpg->seg.comp[c], coeffs + (n << 6) );
+    
+ // The blocks of the other components are only decoded to keep in step with the bit stream
+    for( ; c < layout->nc; c++ )
+        for( k = 0; k < layout->H[c] * layout->V[c]; k++ )
+            skipDU( jpg, &jpg->seg.comp[c] );
+}
+
+
+static inline __attribute__((always_inline)) void skipMCUas(jpg_t * jpg, const MCUlayout * layout)
+{
+uint8_t     c, k;
+
+
+    for( c = 0; c < layout->nc; c++ )
+        for( k = 0; k < layout->H[c] * layout->V[c]; k++ )
+            skipDU( jpg, &jpg->seg.comp[c] );
+}
+
+
+// Reconstructs the blocks of the MCU in column 'col' of the row (of the region)
+static inline __attribute__((always_inline)) void reconstructMCUas(const MCUlayout * layout, const IDCTkernels * const * kernels, const MCUrow * row, uint16_t col, int16_t * coeffs, const uint8_t * last)
+{
+uint8_t     c, k, n = 0;
+uint8_t   * samples;
+
+
+    for( c = 0; c < layout->nReconstructed; c++ )
+    {
+        samples = row->planes[c] + (size_t)col * layout->H[c] * row->size[c];
+        
+        for( k = 0; k < layout->H[c] * layout->V[c]; k++, n++ )
+        {
+            reconstructBlock( kernels[c], coeffs + (n << 6), last[n], 
+                              samples + ( (k / layout->H[c]) * row->stride[c] + (k % layout->H[c]) ) * row->size[c],
+                              row->stride[c] );
+        }
+    }
+}
+
+
+static const MCUlayout LAYOUT_GRAY    = { 1, 1, 1, { 1 },       { 1 }       };
+static const MCUlayout LAYOUT_444     = { 3, 3, 3, { 1, 1, 1 }, { 1, 1, 1 } };
+static const MCUlayout LAYOUT_422     = { 3, 3, 4, { 2, 1, 1 }, { 1, 1, 1 } };
+static const MCUlayout LAYOUT_440     = { 3, 3, 4, { 1, 1, 1 }, { 2, 1, 1 } };
+static const MCUlayout LAYOUT_420     = { 3, 3, 6, { 2, 1, 1 }, { 2, 1, 1 } };
+static const MCUlayout LAYOUT_444_Y   = { 3, 1, 1, { 1, 1, 1 }, { 1, 1, 1 } };
+static const MCUlayout LAYOUT_422_Y   = { 3, 1, 2, { 2, 1, 1 }, { 1, 1, 1 } };
+static const MCUlayout LAYOUT_440_Y   = { 3, 1, 2, { 1, 1, 1 }, { 2, 1, 1 } };
+static const MCUlayout LAYOUT_420_Y   = { 3, 1, 4, { 2, 1, 1 }, { 2, 1, 1 } };
+
+
+#define     MCU_KERNELS(name, layoutOf)                                                                                     \
+static void decodeMCU##name(jpg_t * jpg, const MCUlayout * layout, int16_t * coeffs, uint8_t * last)                        \
+{                                                                                                                           \
+    (void)layout;                                                                                                           \
+    decodeMCUas( jpg, layoutOf, coeffs, last );                                                                             \
+}                                                                                                                           \
+static void skipMCU##name(jpg_t * jpg, const MCUlayout * layout)                                                            \
+{                                                                                                                           \
+    (void)layout;                                                                                                           \
+    skipMCUas( jpg, layoutOf );                                                                                             \
+}                                                                                                                           \
+static void reconstructMCU##name(const MCUlayout * layout, const IDCTkernels * const * kernels, const MCUrow * row, uint16_t col, int16_t * coeffs, const uint8_t * last) \
+{                                                                                                                           \
+    (void)layout;                                                                                                           \
+    reconstructMCUas( layoutOf, kernels, row, col, coeffs, last );                                                          \
+}
+
+MCU_KERNELS(Gray, &LAYOUT_GRAY)
+MCU_KERNELS(444,  &LAYOUT_444)
+MCU_KERNELS(422,  &LAYOUT_422)
+MCU_KERNELS(440,  &LAYOUT_440)
+MCU_KERNELS(420,  &LAYOUT_420)
+MCU_KERNELS(444Y, &LAYOUT_444_Y)
+MCU_KERNELS(422Y, &LAYOUT_422_Y)
+MCU_KERNELS(440Y, &LAYOUT_440_Y)
+MCU_KERNELS(420Y, &LAYOUT_420_Y)
+MCU_KERNELS(Any,  layout)
+
+
+/* The specialized layouts, in the order they're looked for, followed by 
+ * the kernels of any other layout */
+
+static const MCUlayout * const MCU_LAYOUTS[] = 
+{ 
+    &LAYOUT_GRAY, &LAYOUT_444, &LAYOUT_422, &LAYOUT_440, &LAYOUT_420, &LAYOUT_444_Y, &LAYOUT_422_Y, &LAYOUT_440_Y, &LAYOUT_420_Y 
+};
+
+static const MCUkernels MCU_DECODERS[] =
+{
+    { decodeMCUGray, skipMCUGray, reconstructMCUGray },
+    { decodeMCU444,  skipMCU444,  reconstructMCU444  },
+    { decodeMCU422,  skipMCU422,  reconstructMCU422  },
+    { decodeMCU440,  skipMCU440,  reconstructMCU440  },
+    { decodeMCU420,  skipMCU420,  reconstructMCU420  },
+    { decodeMCU444Y, skipMCU444Y, reconstructMCU444Y },
+    { decodeMCU422Y, skipMCU422Y, reconstructMCU422Y },
+    { decodeMCU440Y, skipMCU440Y, reconstructMCU440Y },
+    { decodeMCU420Y, skipMCU420Y, reconstructMCU420Y },
+    { decodeMCUAny,  skipMCUAny,  reconstructMCUAny  }
+};
+
+
+/* Finds where each band starts decoding, i.e. the start of the restart 
+ * interval it begins in, by counting the RST markers in the entropy coded
+ * data. The bands are in order. Returns 0 if the scan ends too soon */
+
+static uint8_t findRestarts(const jpg_t * jpg, MCUband * bands, uint16_t nBands)
+{
+const uint8_t * ptr = jpg->stream.ptr;
+const uint8_t * end = jpg->stream.end;
+uint32_t        interval = 0;
+uint16_t        b = 0;
+
+
+    for( ;; )
+    {
+        while( b < nBands && bands[b].start / jpg->seg.dri.nMCUs == interval )
+        {
+            bands[b++].jpg.stream.ptr = ptr;
+        }
+        
+        if( b == nBands )
+            return 1;
+        
+     // Skip to the next RST marker, past any stuffed 0xFF bytes of the entropy coded data
+        for( ;; )
+        {
+            ptr = memchr( ptr, 0xFF, end - ptr );
+            if( !ptr )
+                return 0;
+            
+            while( ++ptr < end && *ptr == 0xFF );
+            
+            if( ptr >= end )
+                return 0;
+            
+            if( *ptr++ == 0x00 )
+                continue;
+            
+         // Any other marker ends the scan
+            if( (ptr[-1] & 0xF8) != 0xD0 )
+                return 0;
+            
+            break;
+        }
+        
+        interval++;
+    }
+}
+
+
+/* Allocates the planes of a row of MCUs, and the row of pixels a scaled 
+ * region is sampled from (if it is scaled, and not streamed) */
+
+static uint8_t allocMCURow(const jpg_t * jpg, MCUrow * row, const jpg_surface_t * surface, uint8_t ** scaledRow)
+{
+size_t      size = 0;
+uint8_t     c;
+uint8_t   * samples;
+
+
+    *scaledRow = NULL;
+    
+ /* The planes of the components that are reconstructed, followed by a row
+  * for each component that is upsampled before conversion */
+    for( c = 0; c < jpg->nc; c++ )
+    {
+        size += row->stride[c] * jpg->seg.comp[c].VSmplFctr * row->size[c];
+        
+        if( row->conversion == JPG_CONVERT_ANY && jpg->seg.comp[c].HSmplFctr * row->size[c] != jpg->hsf * row->blockSize )
+            size += row->width;
+    }
+    
+    samples = (uint8_t *)scratchAlloc( jpg, size );
+    if( !samples )
+        return 0;
+    
+    for( c = 0; c < JPG_MAX_COMPONENTS; c++ )
+    {
+        row->planes[c]    = NULL;
+        row->upsampled[c] = NULL;
+    }
+    
+    for( c = 0; c < jpg->nc && row->stride[c]; c++ )
+    {
+        row->planes[c] = samples;
+        samples       += row->stride[c] * jpg->seg.comp[c].VSmplFctr * row->size[c];
+    }
+    
+    for( c = 0; c < jpg->nc; c++ )
+    {
+        if( row->conversion == JPG_CONVERT_ANY && jpg->seg.comp[c].HSmplFctr * row->size[c] != jpg->hsf * row->blockSize )
+        {
+            row->upsampled[c] = samples;
+            samples          += row->width;
+        }
+    }
+    
+ // A scaled image is sampled from rows of pixels converted at the decoded size
+    if( surface && (surface->width != row->width || surface->height != row->height) )
+    {
+        *scaledRow = (uint8_t *)scratchAlloc( jpg, (size_t)row->width * FORMATS[surface->format].size );
+        if( !*scaledRow )
+        {
+            scratchFree(jpg, row->planes[0]);
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+
+/* Returns the first row of a scaled surface that is sampled from row y of
+ * the image (at the decoded size) or below. Rows above are written by the
+ * bands (or workers) that decode them */
+
+static uint16_t firstSurfaceRow(const MCUrow * row, const jpg_surface_t * surface, uint32_t y)
+{
+uint32_t    n;
+
+
+    if( y <= row->y )
+        return 0;
+    
+ // The smallest n for which row->y + n * row->height / surface->height reaches y
+    n = ( (y - row->y) * surface->height + row->height - 1 ) / row->height;
+    
+    return n < surface->height ? n : surface->height;
+}
+
+
+/* Decodes a band of rows of MCUs, which starts entropy decoding at its own
+ * point of the scan with a bit reader and DC predictions of its own. MCUs
+ * up to the first row of the band, and those outside the region, are only
+ * entropy decoded */
+
+static uint8_t decodeBand(MCUband * band)
+{
+jpg_t     * jpg = &band->jpg;
+const jpg_surface_t * surface = band->surface;
+uint16_t    i, j;
+uint16_t    nHorizBlocks;
+uint16_t    MCUheight;
+uint16_t    RstCount = 0;
+uint16_t    nextRow;
+int16_t     coeffs[JPG_MAX_BLOCKS * 64] = { 0 };
+uint8_t     last[JPG_MAX_BLOCKS];
+uint8_t  *  scaledRow;
+MCUrow      row = band->row;
+
+
+    nHorizBlocks = jpg->extended_width / (jpg->hsf << 3);
+    MCUheight    = jpg->vsf * row.blockSize;
+    
+ /* Only one row of MCUs is held in memory. Each component is reconstructed
+  * into a plane of samples as wide as the MCUs of the region, and once the
+  * row is complete, it's converted to pixels straight into the surface */
+    if( !allocMCURow(jpg, &row, band->rows ? NULL : surface, &scaledRow) )
+        return JPG_BAND_FAILED;
+    
+    nextRow = surface ? firstSurfaceRow( &row, surface, (uint32_t)band->firstRow * MCUheight ) : 0;
+    
+    resetDecoder(jpg);
+    
+    if( jpg->seg.dri.nMCUs )
+        RstCount = jpg->seg.dri.nMCUs - band->start % jpg->seg.dri.nMCUs;
+    
+    i = band->start % nHorizBlocks;
+    
+    for( j = band->start / nHorizBlocks; j < band->endRow; j++)
+    {
+        for( ; i < nHorizBlocks; i++)
+        {
+         // MCUs outside the region only need to keep the DC predictions going
+            if( j < band->firstRow || i < band->firstCol || i >= band->endCol )
+                band->mcu->skip( jpg, &band->layout );
+            
+            else
+            {
+             // Decode the Data Units of the MCU, then perform Inverse Discrete Cosine Transform on each decoded block
+                band->mcu->decode( jpg, &band->layout, coeffs, last );
+                band->mcu->reconstruct( &band->layout, band->kernels, &row, i - band->firstCol, coeffs, last );
+            }
+            
+            
+         // Check whether Restart Interval is enabled
+            if( jpg->seg.dri.nMCUs )
+            {
+             // Make sure to reset at the end of each Restart Interval
+                if( --RstCount == 0)
+                {
+                    RstCount  = jpg->seg.dri.nMCUs;                    
+                    restartDecoder(jpg);
+                }
+            }
+        }
+        
+        i = 0;
+        
+        if( j < band->firstRow )
+            continue;
+        
+        if( band->planes )
+            copyMCURow( jpg, band->planes, &row, j );
+        
+        else if( !band->rows )
+            writeMCURow( jpg, surface, &row, j, &nextRow, scaledRow );
+        
+        else if( !streamMCURow( band, &row, j ) )
+            break;
+    }
+    
+    scratchFree(jpg, row.planes[0]);
+    scratchFree(jpg, scaledRow);
+    
+    return (j < band->endRow) ? JPG_BAND_STOPPED : JPG_BAND_DONE;  
+}
+
+
+#ifdef JPG_HAVE_PTHREADS
+
+static void * decodeBandThread(void * band)
+{
+    ((MCUband *)band)->status = decodeBand( (MCUband *)band );
+    return NULL;
+}
+
+
+/* A worker of the pipeline takes the next row of MCUs that has been entropy
+ * decoded, and reconstructs it into the surface. Reconstructing the blocks
+ * zeroes their coefficients again, so the slot is ready to be refilled */
+
+static void * reconstructThread(void * arg)
+{
+MCUworker   * worker   = (MCUworker *)arg;
+MCUpipeline * pipeline = worker->pipeline;
+MCUband     * band     = pipeline->band;
+jpg_t       * jpg      = &band->jpg;
+MCUslot     * slot;
+uint8_t       nBlocks = band->layout.nBlocks;
+uint16_t      i;
+uint16_t      nextRow;
+
+
+    for( ;; )
+    {
+        pthread_mutex_lock( &pipeline->lock );
+        
+        while( pipeline->slots[pipeline->tail].state != JPG_SLOT_FULL && !pipeline->done )
+            pthread_cond_wait( &pipeline->filled, &pipeline->lock );
+        
+        slot = &pipeline->slots[pipeline->tail];
+        
+     // Once the entropy decoder is done, and every row has been taken, there's nothing left to do
+        if( slot->state != JPG_SLOT_FULL )
+        {
+            pthread_mutex_unlock( &pipeline->lock );
+            break;
+        }
+        
+        slot->state    = JPG_SLOT_BUSY;
+        pipeline->tail = (pipeline->tail + 1) % pipeline->nSlots;
+        
+        pthread_mutex_unlock( &pipeline->lock );
+        
+        for( i = 0; i < band->endCol - band->firstCol; i++ )
+        {
+            band->mcu->reconstruct( &band->layout, band->kernels, &worker->row, i, 
+                                    slot->coeffs + ((size_t)i * nBlocks << 6), slot->last + i * nBlocks );
+        }
+        
+        if( band->planes )
+        {
+            copyMCURow( jpg, band->planes, &worker->row, slot->mcuRow );
+        }
+        
+        else
+        {
+            nextRow = firstSurfaceRow( &worker->row, band->surface, (uint32_t)slot->mcuRow * jpg->vsf * worker->row.blockSize );
+            writeMCURow( jpg, band->surface, &worker->row, slot->mcuRow, &nextRow, worker->scaledRow );
+        }
+        
+        pthread_mutex_lock( &pipeline->lock );
+        slot->state = JPG_SLOT_FREE;
+        pthread_cond_signal( &pipeline->freed );
+        pthread_mutex_unlock( &pipeline->lock );
+    }
+    
+    return NULL;
+}
+
+
+/* Decodes a band through the pipeline: the calling thread entropy decodes
+ * the rows of MCUs into the ring, which nWorkers threads reconstruct. If 
+ * the pipeline can't be set up, the band is decoded by decodeBand() */
+
+static uint8_t pipelineBand(MCUband * band, uint16_t nWorkers)
+{
+jpg_t       * jpg = &band->jpg;
+MCUpipeline   pipeline;
+MCUworker     workers[JPG_MAX_THREADS];
+pthread_t     threads[JPG_MAX_THREADS];
+MCUslot     * slot;
+uint8_t       nBlocks = band->layout.nBlocks;
+uint16_t      nMCUs;
+uint16_t      nHorizBlocks;
+uint16_t      i, j, k, w;
+uint16_t      nStarted = 0;
+uint16_t      RstCount = 0;
+uint8_t       status = JPG_BAND_DONE;
+
+
+    nMCUs        = band->endCol - band->firstCol;
+    nHorizBlocks = jpg->extended_width / (jpg->hsf << 3);
+    
+    nWorkers = nWorkers < JPG_MAX_THREADS ? nWorkers : JPG_MAX_THREADS;
+    
+    memset( &pipeline, 0, sizeof(pipeline) );
+    pipeline.band   = band;
+    pipeline.nSlots = 2 * nWorkers;
+    pipeline.slots  = (MCUslot *)scratchAlloc( jpg, pipeline.nSlots * sizeof(MCUslot) );
+    
+    if( pipeline.slots )
+        memset( pipeline.slots, 0, pipeline.nSlots * sizeof(MCUslot) );
+    
+    for( k = 0; pipeline.slots && k < pipeline.nSlots; k++ )
+    {
+        pipeline.slots[k].coeffs = (int16_t *)scratchAlloc( jpg, (size_t)nMCUs * nBlocks * 64 * sizeof(int16_t) );
+        pipeline.slots[k].last   = (uint8_t *)scratchAlloc( jpg, (size_t)nMCUs * nBlocks );
+        
+        if( !pipeline.slots[k].coeffs || !pipeline.slots[k].last )
+            break;
+        
+        memset( pipeline.slots[k].coeffs, 0, (size_t)nMCUs * nBlocks * 64 * sizeof(int16_t) );
+    }
+    
+    for( w = 0; pipeline.slots && k == pipeline.nSlots && w < nWorkers; w++ )
+    {
+        workers[w].pipeline = &pipeline;
+        workers[w].row      = band->row;
+        
+        if( !allocMCURow(jpg, &workers[w].row, band->surface, &workers[w].scaledRow) )
+            break;
+    }
+    
+    pthread_mutex_init( &pipeline.lock, NULL );
+    pthread_cond_init( &pipeline.filled, NULL );
+    pthread_cond_init( &pipeline.freed, NULL );
+    
+    if( pipeline.slots && k == pipeline.nSlots && w == nWorkers )
+    {
+        for( nStarted = 0; nStarted < nWorkers; nStarted++ )
+        {
+            if( pthread_create( &threads[nStarted], NULL, reconstructThread, &workers[nStarted] ) )
+                break;
+        }
+    }
+    
+ // Without a single worker (or the memory for the pipeline), the band is decoded the usual way
+    if( !nStarted )
+    {
+        status = decodeBand(band);
+        goto cleanup;
+    }
+    
+    resetDecoder(jpg);
+    
+    if( jpg->seg.dri.nMCUs )
+        RstCount = jpg->seg.dri.nMCUs - band->start % jpg->seg.dri.nMCUs;
+    
+    i = band->start % nHorizBlocks;
+    
+    for( j = band->start / nHorizBlocks; j < band->endRow; j++ )
+    {
+        slot = NULL;
+        
+     // Wait for the row of MCUs previously decoded into the slot to be reconstructed
+        if( j >= band->firstRow )
+        {
+            pthread_mutex_lock( &pipeline.lock );
+            
+            while( pipeline.slots[pipeline.head].state != JPG_SLOT_FREE )
+                pthread_cond_wait( &pipeline.freed, &pipeline.lock );
+            
+            pthread_mutex_unlock( &pipeline.lock );
+            
+            slot = &pipeline.slots[pipeline.head];
+        }
+        
+        for( ; i < nHorizBlocks; i++ )
+        {
+         // MCUs outside the region only need to keep the DC predictions going
+            if( !slot || i < band->firstCol || i >= band->endCol )
+                band->mcu->skip( jpg, &band->layout );
+            
+            else
+            {
+                band->mcu->decode( jpg, &band->layout, slot->coeffs + ((size_t)(i - band->firstCol) * nBlocks << 6), 
+                                   slot->last + (size_t)(i - band->firstCol) * nBlocks );
+            }
+            
+            if( jpg->seg.dri.nMCUs )
+            {
+                if( --RstCount == 0)
+                {
+                    RstCount  = jpg->seg.dri.nMCUs;                    
+                    restartDecoder(jpg);
+                }
+            }
+        }
+        
+        i = 0;
+        
+        if( slot )
+        {
+            pthread_mutex_lock( &pipeline.lock );
+            
+            slot->mcuRow   = j;
+            slot->state    = JPG_SLOT_FULL;
+            pipeline.head  = (pipeline.head + 1) % pipeline.nSlots;
+            
+            pthread_cond_signal( &pipeline.filled );
+            pthread_mutex_unlock( &pipeline.lock );
+        }
+    }
+    
+    pthread_mutex_lock( &pipeline.lock );
+    pipeline.done = 1;
+    pthread_cond_broadcast( &pipeline.filled );
+    pthread_mutex_unlock( &pipeline.lock );
+    
+    for( k = 0; k < nStarted; k++ )
+        pthread_join( threads[k], NULL );
+    
+cleanup:
+    
+    pthread_cond_destroy( &pipeline.freed );
+    pthread_cond_destroy( &pipeline.filled );
+    pthread_mutex_destroy( &pipeline.lock );
+    
+    while( w-- )
+    {
+        scratchFree( jpg, workers[w].row.planes[0] );
+        scratchFree( jpg, workers[w].scaledRow );
+    }
+    
+    for( k = 0; pipeline.slots && k < pipeline.nSlots; k++ )
+    {
+        scratchFree( jpg, pipeline.slots[k].coeffs );
+        scratchFree( jpg, pipeline.slots[k].last );
+    }
+    
+    scratchFree( jpg, pipeline.slots );
+    
+    return status;
+}
+
+#endif
+
+
+static uint8_t decodeScanData(jpg_t * jpg, const jpg_surface_t * surface, const jpg_planes_t * planes, uint16_t x, uint16_t y, uint16_t w, uint16_t h, jpg_rows_cb rows, void * user)
+{
+uint16_t    b, nBands = 1;
+uint16_t    nHorizBlocks;
+uint16_t    firstRow, endRow;
+uint16_t    MCUwidth, MCUheight;
+uint8_t     scale;
+uint8_t     c, ratio;
+uint8_t     status = JPG_BAND_DONE;
+MCUband     setup;
+MCUband  *  bands;
+#ifdef JPG_HAVE_PTHREADS
+pthread_t   threads[JPG_MAX_THREADS];
+uint8_t     started[JPG_MAX_THREADS] = { 0 };
+#endif
+
+
+    memset( &setup, 0, sizeof(setup) );
+    
+ /* Any sampling of 1 (grayscale), 3 or 4 components is decoded, with each
+  * component 1 to 4 blocks across and down an MCU of at most 10 blocks, as
+  * long as all the components are in the one scan */
+    setup.layout.nc = (jpg->nc == 1 || jpg->nc == 3 || jpg->nc == 4) && jpg->seg.sos.nComponents == jpg->nc ? jpg->nc : 0;
+    
+    for( c = 0; c < setup.layout.nc; c++ )
+    {
+        setup.layout.H[c]     = jpg->seg.comp[c].HSmplFctr;
+        setup.layout.V[c]     = jpg->seg.comp[c].VSmplFctr;
+        setup.layout.nBlocks += setup.layout.H[c] * setup.layout.V[c];
+        
+        if( setup.layout.H[c] < 1 || setup.layout.H[c] > 4 || setup.layout.V[c] < 1 || setup.layout.V[c] > 4 )
+            break;
+    }
+    
+    if( !setup.layout.nc || c < setup.layout.nc || setup.layout.nBlocks > JPG_MAX_BLOCKS )
+    {
+        JPG_LOG( jpg, JPG_LOG_ERROR, "Unsupported sampling of %d components", jpg->nc );
+        setError(jpg, JPG_ERR_UNSUPPORTED_SAMPLING);
+        return JPG_BAND_FAILED;
+    }
+    
+    setup.layout.nReconstructed = setup.layout.nc;
+    
+ /* A gray surface of a YCbCr image is its luma alone. When luma has a sample
+  * per pixel, the blocks of chroma are only entropy decoded, to keep in step
+  * with the bit stream, and are neither dequantized, transformed nor converted */
+    if( surface && surface->format == JPG_FORMAT_GRAY8 && jpg->colorspace == JPG_COLOR_YCBCR &&
+        setup.layout.H[0] == jpg->hsf && setup.layout.V[0] == jpg->vsf )
+    {
+        JPG_LOG( jpg, JPG_LOG_DEBUG, "Decoding luma only" );
+        setup.layout.nReconstructed = 1;
+        setup.layout.nBlocks        = setup.layout.H[0] * setup.layout.V[0];
+    }
+    
+ // The common layouts have kernels of their own
+    for( c = 0; c < sizeof(MCU_LAYOUTS) / sizeof(MCU_LAYOUTS[0]); c++ )
+    {
+        if( !memcmp( &setup.layout, MCU_LAYOUTS[c], sizeof(MCUlayout) ) )
+            break;
+    }
+    
+    setup.mcu = &MCU_DECODERS[c];
+    
+ /* The frame-width and frame-height of the image are extended to a whole
+  * number of MCUs to account for the appended blocks */
+    nHorizBlocks    =   jpg->extended_width  / (jpg->hsf << 3);
+    
+ /* For a smaller surface (e.g. a thumbnail), the region is decoded at the
+  * smallest of 1/8, 1/4, 1/2 (or full) size that still covers the surface,
+  * by the reduced size IDCTs. Streamed rows and planes are always at full size */
+    for( scale = rows || planes ? 0 : 3; scale; scale-- )
+    {
+        if( ( (w + (1 << scale) - 1) >> scale ) >= surface->width &&
+            ( (h + (1 << scale) - 1) >> scale ) >= surface->height )
+            break;
+    }
+    
+    setup.row.blockSize = 8 >> scale;
+    setup.row.width     = (w + (1 << scale) - 1) >> scale;
+    setup.row.height    = (h + (1 << scale) - 1) >> scale;
+    setup.row.y         = y >> scale;
+    
+ /* When reducing an image, a subsampled component is reconstructed at up to
+  * as many times the size of the blocks of luma as it is subsampled by (the
+  * more subsampled way, rounded up to a power of 2), and at most the full
+  * size of its blocks. That's as much as the reduced image can show in that
+  * direction: in the other, the rows or columns of samples are picked from
+  * as they are for any sampling (see convertRow) */
+    for( c = 0; c < JPG_MAX_COMPONENTS; c++ )
+    {
+        setup.row.size[c] = setup.row.blockSize;
+
+        if( c >= jpg->nc )
+            continue;
+
+        ratio = (jpg->hsf + setup.layout.H[c] - 1) / setup.layout.H[c];
+        if( ratio < (jpg->vsf + setup.layout.V[c] - 1) / setup.layout.V[c] )
+            ratio = (jpg->vsf + setup.layout.V[c] - 1) / setup.layout.V[c];
+
+        while( setup.row.size[c] < setup.row.blockSize * ratio && setup.row.size[c] < setup.row.blockSize << scale )
+            setup.row.size[c] <<= 1;
+    }
+    
+ /* Only the MCUs that cover the region are reconstructed, the rest are just
+  * entropy decoded. Decoding stops after the last row of MCUs of the region */
+    MCUwidth  = jpg->hsf * setup.row.blockSize;
+    MCUheight = jpg->vsf * setup.row.blockSize;
+    
+    setup.firstCol  = (x >> scale) / MCUwidth;
+    setup.endCol    = ( (x >> scale) + setup.row.width + MCUwidth - 1 ) / MCUwidth;
+    setup.row.x     = (x >> scale) - setup.firstCol * MCUwidth;
+    
+    for( c = 0; c < setup.layout.nReconstructed; c++ )
+        setup.row.stride[c] = (size_t)(setup.endCol - setup.firstCol) * setup.layout.H[c] * setup.row.size[c];
+    
+ /* YCbCr rows whose chroma has a sample per pixel, or per two pixels across,
+  * are converted straight from the planes, as are grayscale rows (and luma
+  * alone), which have no colour to convert. Anything else is upsampled first */
+    if( jpg->colorspace == JPG_COLOR_GRAY || setup.layout.nReconstructed == 1 )
+        setup.row.conversion = JPG_CONVERT_GRAY;
+    
+    else if( jpg->colorspace == JPG_COLOR_YCBCR && setup.layout.H[0] * setup.row.size[0] == MCUwidth &&
+             setup.layout.H[1] * setup.row.size[1] == MCUwidth && setup.layout.H[2] * setup.row.size[2] == MCUwidth )
+        setup.row.conversion = JPG_CONVERT_11;
+    
+    else if( jpg->colorspace == JPG_COLOR_YCBCR && setup.layout.H[0] * setup.row.size[0] == MCUwidth &&
+             2 * setup.layout.H[1] * setup.row.size[1] == MCUwidth && 2 * setup.layout.H[2] * setup.row.size[2] == MCUwidth )
+        setup.row.conversion = JPG_CONVERT_21;
+    
+    else
+        setup.row.conversion = JPG_CONVERT_ANY;
+    
+    firstRow  = setup.row.y / MCUheight;
+    endRow    = ( setup.row.y + setup.row.height + MCUheight - 1 ) / MCUheight;
+    
+ // Pick the fastest IDCT (and other kernels) for this CPU
+#ifdef JPG_HAVE_PTHREADS
+    pthread_once( &coreOnce, initCore );
+#else
+    initCore();
+#endif
+
+    
+ // Each component is reconstructed by the IDCT of its size of block
+    for( c = 0; c < jpg->nc; c++ )
+    {
+        switch( setup.row.size[c] )
+        {
+            case 8:  setup.kernels[c] = (jpg->idct == JPG_IDCT_FAST) ? &IDCT_FAST : &IDCT;  break;
+            case 4:  setup.kernels[c] = &IDCT_REDUCED[0];  break;
+            case 2:  setup.kernels[c] = &IDCT_REDUCED[1];  break;
+            default: setup.kernels[c] = &IDCT_REDUCED[2];
+        }
+    }
+    
+ /* The DC predictions are reset at each restart interval, so an image with
+  * restart intervals is split into bands of rows of MCUs, which are decoded
+  * in parallel from the restart interval they begin in. Otherwise, the rows
+  * of MCUs are reconstructed in parallel as they're entropy decoded */
+#ifdef JPG_HAVE_PTHREADS
+    if( jpg->seg.dri.nMCUs && jpg->threads > 1 && !rows )
+    {
+        nBands = jpg->threads < JPG_MAX_THREADS ? jpg->threads : JPG_MAX_THREADS;
+        nBands = nBands < endRow - firstRow ? nBands : endRow - firstRow;
+    }
+#endif
+    
+    bands = (MCUband *)scratchAlloc( jpg, nBands * sizeof(MCUband) );
+    if( !bands )
+    {
+        setError(jpg, memoryError(jpg));
+        return JPG_BAND_FAILED;
+    }
+    
+    setup.jpg           = *jpg;
+    setup.jpg.stream.marker = 0;
+    
+ /* The reduced size IDCTs need coefficients without the AAN scale factors.
+  * This decode's copy of the components gets them, the image keeps the 
+  * tables of the IDCT it was opened with */
+    for( c = 0; c < jpg->nc; c++ )
+    {
+        if( setup.kernels[c]->size != 8 && jpg->idct == JPG_IDCT_FAST )
+            setupDequantTbl( &setup.jpg.seg.comp[c], JPG_IDCT_ACCURATE );
+    }
+    setup.surface       = surface;
+    setup.rows          = rows;
+    setup.user          = user;
+    setup.planes        = planes;
+    
+    for( b = 0; b < nBands; b++ )
+    {
+        bands[b] = setup;
+        bands[b].firstRow = firstRow + (uint32_t)(endRow - firstRow) * b / nBands;
+        bands[b].endRow   = firstRow + (uint32_t)(endRow - firstRow) * (b + 1) / nBands;
+        
+     // Without restart intervals, the scan can only be decoded from its start
+        bands[b].start = 0;
+        
+        if( jpg->seg.dri.nMCUs )
+        {
+            bands[b].start  = (uint32_t)bands[b].firstRow * nHorizBlocks;
+            bands[b].start -= bands[b].start % jpg->seg.dri.nMCUs;
+        }
+    }
+    
+ // When the RST markers can't be found, decode from the start of the scan
+    if( jpg->seg.dri.nMCUs && !findRestarts(jpg, bands, nBands) )
+    {
+        nBands = 1;
+        bands[0].start  = 0;
+        bands[0].endRow = endRow;
+        bands[0].jpg.stream.ptr = jpg->stream.ptr;
+    }
+    
+    JPG_LOG( jpg, JPG_LOG_DEBUG, "Writing Blocks..." );
+    
+#ifdef JPG_HAVE_PTHREADS
+    for( b = 1; b < nBands; b++ )
+    {
+        started[b] = !pthread_create( &threads[b], NULL, decodeBandThread, &bands[b] );
+    }
+#endif
+    
+ // The first band is decoded by the calling thread, as are those that couldn't be handed to a thread
+    for( b = 0; b < nBands; b++ )
+    {
+#ifdef JPG_HAVE_PTHREADS
+        if( started[b] )
+            continue;
+        
+     // Streamed rows are handed to the caller in order, by the calling thread
+        if( nBands == 1 && jpg->threads > 1 && !rows )
+        {
+            bands[b].status = pipelineBand( &bands[b], jpg->threads - 1 );
+            continue;
+        }
+#endif
+        bands[b].status = decodeBand( &bands[b] );
+    }
+    
+    for( b = 0; b < nBands; b++ )
+    {
+#ifdef JPG_HAVE_PTHREADS
+        if( started[b] )
+            pthread_join( threads[b], NULL );
+#endif
+        if( bands[b].status != JPG_BAND_DONE )
+            status = bands[b].status;
+    }
+    
+    JPG_LOG( jpg, JPG_LOG_DEBUG, "Complete!" );
+    
+    scratchFree(jpg, bands);
+    
+ // Bands only fail for lack of memory
+    if( status == JPG_BAND_FAILED )
+        setError(jpg, memoryError(jpg));
+    
+    if( status == JPG_BAND_STOPPED )
+        setError(jpg, JPG_ERR_STOPPED);
+    
+    return status;  
+}
+
+
+/* Converts the pixels of the region in row y of a row of MCUs to pixels of
+ * the format. The samples of each component are taken from the row and 
+ * column they are sampled at, which are those of the pixel for components
+ * reconstructed at the size of the image */
+
+static void convertRow(jpg_t * jpg, const MCUrow * row, uint16_t y, uint8_t format, void * pixels)
+{
+const PixelFormat * kernels = &FORMATS[format];
+const uint8_t * rows[JPG_MAX_COMPONENTS];
+uint16_t        MCUwidth  = jpg->hsf * row->blockSize;
+uint16_t        MCUheight = jpg->vsf * row->blockSize;
+uint16_t        x = row->x;
+uint16_t        n = row->width;
+uint16_t        i;
+uint8_t         c;
+
+
+    for( c = 0; c < JPG_MAX_COMPONENTS; c++ )
+    {
+        rows[c] = row->planes[c] ? row->planes[c] + ( (uint32_t)y * jpg->seg.comp[c].VSmplFctr * row->size[c] / MCUheight ) * row->stride[c] : NULL;
+    }
+    
+    switch( row->conversion )
+    {
+        case JPG_CONVERT_GRAY:
+        {
+            kernels->gray( pixels, rows[0] + x, n );
+            break;
+        }
+        
+        case JPG_CONVERT_21:
+        {
+         // A region starting at an odd column begins with the second pixel of a pair
+            if( x & 1 )
+            {
+                kernels->row11( pixels, rows[0] + x, rows[1] + (x >> 1), rows[2] + (x >> 1), 1 );
+                pixels = (uint8_t *)pixels + kernels->size;
+                x++;
+                n--;
+            }
+            
+            kernels->row21( pixels, rows[0] + x, rows[1] + (x >> 1), rows[2] + (x >> 1), n );
+            break;
+        }
+        
+        case JPG_CONVERT_11:
+        {
+            kernels->row11( pixels, rows[0] + x, rows[1] + x, rows[2] + x, n );
+            break;
+        }
+        
+        default:
+        {
+         // Components with fewer samples than pixels are upsampled to the nearest sample of each pixel
+            for( c = 0; c < jpg->nc; c++ )
+            {
+                if( row->upsampled[c] )
+                {
+                    for( i = 0; i < n; i++ )
+                        row->upsampled[c][i] = rows[c][ (uint32_t)(x + i) * jpg->seg.comp[c].HSmplFctr * row->size[c] / MCUwidth ];
+                    
+                    rows[c] = row->upsampled[c];
+                }
+                
+                else
+                {
+                    rows[c] += x;
+                }
+            }
+            
+            if( jpg->colorspace == JPG_COLOR_YCBCR )
+                kernels->row11( pixels, rows[0], rows[1], rows[2], n );
+            else
+                convertOtherRow( pixels, rows, n, jpg->colorspace, format );
+        }
+    }
+}
+
+
+/* Samples a row of the surface from the nearest columns of a row of pixels,
+ * 'step' being the distance between the columns sampled (16.16 fixed point).
+ * Pixels are copied whole, with a copy of constant size for each size */
+
+static inline __attribute__((always_inline)) void sampleRow(uint8_t * dest, const uint8_t * src, uint16_t width, uint32_t step, uint8_t size)
+{
+uint32_t    x, sx;
+
+
+    for( x = 0, sx = 0; x < width; x++, sx += step )
+    {
+        memcpy( dest + x * size, src + (sx >> 16) * size, size );
+    }
+}
+
+
+/* Writes the rows of pixels of a row of MCUs that lie in the region into
+ * the surface, which drops the appended blocks past the edges of the image
+ * too. When the region is scaled, each row of the surface is sampled from
+ * the nearest row and column of the region, 'nextRow' keeps track of the 
+ * next row of the surface to be written */
+
+static void writeMCURow(jpg_t * jpg, const jpg_surface_t * surface, const MCUrow * row, uint16_t mcuRow, uint16_t * nextRow, uint8_t * scaledRow)
+{
+uint32_t    first, end;
+uint32_t    y;
+uint32_t    step;
+uint32_t    converted = UINT32_MAX;
+uint8_t  *  dest;
+
+
+    first = (uint32_t)mcuRow * jpg->vsf * row->blockSize;
+    end   = first + jpg->vsf * row->blockSize;
+    
+    if( !scaledRow )
+    {
+        for( y = first > row->y ? first : row->y; y < end && y < (uint32_t)row->y + row->height; y++ )
+        {
+            convertRow( jpg, row, y - first, surface->format, (uint8_t *)surface->pixels + (y - row->y) * surface->pitch );
+        }
+        return;
+    }
+    
+    step = ( (uint32_t)row->width << 16 ) / surface->width;
+    
+    for( ; *nextRow < surface->height; (*nextRow)++ )
+    {
+        y = row->y + ( (uint32_t)*nextRow * row->height ) / surface->height;
+        
+        if( y >= end )
+            break;
+        
+     // Rows of the image are converted once, however many rows of the surface sample them
+        if( y != converted )
+        {
+            convertRow( jpg, row, y - first, surface->format, scaledRow );
+            converted = y;
+        }
+        
+        dest = (uint8_t *)surface->pixels + *nextRow * surface->pitch;
+        
+        switch( FORMATS[surface->format].size )
+        {
+            case 4:
+                sampleRow( dest, scaledRow, surface->width, step, 4 );
+                break;
+            
+            case 3:
+                sampleRow( dest, scaledRow, surface->width, step, 3 );
+                break;
+            
+            default:
+                sampleRow( dest, scaledRow, surface->width, step, 1 );
+        }
+    }
+}
+
+
+/* Size of the plane of a component: the size of the image divided by the
+ * ratio of the largest sampling factors to those of the component. The 
+ * neutral chroma of a grayscale image is as large as the image */
+
+static void componentSize(const jpg_t * jpg, uint8_t c, uint16_t * width, uint16_t * height)
+{
+uint8_t     H = c < jpg->nc ? jpg->seg.comp[c].HSmplFctr : 1;
+uint8_t     V = c < jpg->nc ? jpg->seg.comp[c].VSmplFctr : 1;
+
+
+    *width  = ( (uint32_t)jpg->width  * H + jpg->hsf - 1 ) / jpg->hsf;
+    *height = ( (uint32_t)jpg->height * V + jpg->vsf - 1 ) / jpg->vsf;
+}
+
+
+/* Copies the samples of a row of MCUs into the planes of the components,
+ * which drops the appended blocks past the edges of the image. Each row of
+ * MCUs holds V rows of blocks of a component sampled H x V. The chroma 
+ * planes of a grayscale image are neutral */
+
+static void copyMCURow(const jpg_t * jpg, const jpg_planes_t * planes, const MCUrow * row, uint16_t mcuRow)
+{
+uint32_t    first, end;
+uint32_t    y;
+uint16_t    width, height;
+uint8_t     c, V;
+
+
+    for( c = 0; c < JPG_MAX_COMPONENTS; c++ )
+    {
+        if( !planes->planes[c] || (c >= jpg->nc && c > 2) )
+            continue;
+        
+        componentSize( jpg, c, &width, &height );
+        
+        V     = c < jpg->nc ? jpg->seg.comp[c].VSmplFctr : 1;
+        first = (uint32_t)mcuRow * V * 8;
+        end   = first + V * 8 < height ? first + V * 8 : height;
+        
+        for( y = first; y < end; y++ )
+        {
+            if( c < jpg->nc )
+                memcpy( planes->planes[c] + y * planes->pitch[c], row->planes[c] + (y - first) * row->stride[c], width );
+            else
+                memset( planes->planes[c] + y * planes->pitch[c], 128, width );
+        }
+    }
+}
+
+
+/* Converts the rows of pixels of a row of MCUs that lie in the region into
+ * the band's surface, which holds a row of MCUs, and hands them to the
+ * caller's rows() callback. Returns 0 if rows() stopped decoding */
+
+static uint8_t streamMCURow(MCUband * band, const MCUrow * row, uint16_t mcuRow)
+{
+const jpg_surface_t * surface = band->surface;
+uint32_t    first, start, end;
+uint32_t    y;
+
+
+    first = (uint32_t)mcuRow * band->jpg.vsf * row->blockSize;
+    start = first > row->y ? first : row->y;
+    end   = first + band->jpg.vsf * row->blockSize;
+    end   = end < (uint32_t)row->y + row->height ? end : (uint32_t)row->y + row->height;
+    
+    for( y = start; y < end; y++ )
+    {
+        convertRow( &band->jpg, row, y - first, surface->format, (uint8_t *)surface->pixels + (y - first) * surface->pitch );
+    }
+    
+    return !band->rows( band->user, (const uint32_t *)( (const uint8_t *)surface->pixels + (start - first) * surface->pitch ),
+                        surface->pitch, start - row->y, end - start );
+}
+
+    
+/* Reads the scan and decodes the region of the image into the surface, the
+ * planes or streams it to rows() */
+
+static int8_t readScan(jpg_t * jpg, const jpg_surface_t * surface, const jpg_planes_t * planes, uint16_t x, uint16_t y, uint16_t w, uint16_t h, jpg_rows_cb rows, void * user)
+{
+memoryUsage     usage = { 0, jpg->max_memory, 0 };
+jpg_surface_t   stripe;
+arenaMark       mark;
+uint8_t         status = JPG_BAND_FAILED;
+uint8_t         c;
+
+
+    /* jpg_open() positions the file pointer at the SOS marker which contains the image data */
+    
+    if(readMarker(jpg) != SOS)
+    {
+      setError(jpg, JPG_ERR_NO_SCAN);
+      return -1;
+    }
+    
+    JPG_LOG( jpg, JPG_LOG_DEBUG, "Reading SOS segment..." );
+    readSOS(jpg);
+    
+    if( jpg->pos > jpg->size )
+    {
+      setError(jpg, JPG_ERR_TRUNCATED);
+      return -2;
+    }
+    
+ // Each component of the scan needs the Huffman tables it was given (scans of some of the components aren't supported anyway)
+    for( c = 0; c < jpg->nc && c < JPG_MAX_COMPONENTS; c++ )
+    {
+        if( !jpg->seg.comp[c].HuffTblDC && jpg->seg.sos.nComponents == jpg->nc )
+        {
+          setError(jpg, JPG_ERR_BAD_SCAN);
+          return -2;
+        }
+    }
+    
+ // The entropy coded data is read straight from the image bytes
+    jpg->stream.ptr = jpg->data + jpg->pos;
+    jpg->stream.end = jpg->data + jpg->size;
+                
+    mark       = scratchMark(jpg);
+    jpg->usage = &usage;
+    
+ // Streamed rows of a row of MCUs are converted into a stripe as wide as the image
+    if( rows )
+    {
+        stripe.width  = jpg->width;
+        stripe.height = jpg->vsf << 3;
+        stripe.pitch  = (size_t)jpg->width * sizeof(uint32_t);
+        stripe.format = JPG_FORMAT_XRGB;
+        stripe.pixels = scratchAlloc( jpg, stripe.pitch * stripe.height );
+        surface       = &stripe;
+    }
+    
+    if( planes || surface->pixels )
+        status = decodeScanData(jpg, surface, planes, x, y, w, h, rows, user);
+    else
+        setError(jpg, memoryError(jpg));
+    
+    if( rows )
+        scratchFree(jpg, stripe.pixels);
+    
+    jpg->peak_memory = usage.used;
+    jpg->usage       = NULL;
+    scratchRelease(jpg, mark);
+    
+    switch( status )
+    {
+        case JPG_BAND_FAILED:
+            return -2;
+        
+        case JPG_BAND_STOPPED:
+            return -5;
+    }
+
+    /* Ignore all other markers that follow the SOS marker */
+    
+    return 0;
+
+}
+
+
+int8_t jpg_read_region(const jpg_surface_t * surface, uint16_t x, uint16_t y, uint16_t w, uint16_t h, jpg_t * jpg)
+{
+
+    if( !surface || !surface->pixels || !surface->width || !surface->height || surface->format >= JPG_FORMATS ||
+        !w || !h || (uint32_t)x + w > jpg->width || (uint32_t)y + h > jpg->height )
+    {
+      setError(jpg, JPG_ERR_BAD_SURFACE);
+      return -3;
+    }
+    
+ // Rows can't overlap, and XRGB rows are written (and handed to rows()) as 32-bit words
+    if( surface->pitch < (size_t)surface->width * FORMATS[surface->format].size ||
+        ( surface->format == JPG_FORMAT_XRGB && surface->pitch % sizeof(uint32_t) ) )
+    {
+      setError(jpg, JPG_ERR_BAD_SURFACE);
+      return -3;
+    }
+    
+    return readScan(jpg, surface, NULL, x, y, w, h, NULL, NULL);
+}
+
+
+int8_t jpg_read_rows(jpg_t * jpg, jpg_rows_cb rows, void * user)
+{
+
+    if( !rows )
+    {
+      setError(jpg, JPG_ERR_BAD_SURFACE);
+      return -3;
+    }
+    
+    return readScan(jpg, NULL, NULL, 0, 0, jpg->width, jpg->height, rows, user);
+}
+
+
+int8_t jpg_read_planes(const jpg_planes_t * planes, jpg_t * jpg)
+{
+uint16_t    width, height;
+uint8_t     c;
+
+
+    if( !planes )
+    {
+      setError(jpg, JPG_ERR_BAD_SURFACE);
+      return -3;
+    }
+    
+ // Chroma planes are optional for grayscale images, but come in pairs
+    for( c = 0; c < JPG_MAX_COMPONENTS; c++ )
+    {
+        componentSize( jpg, c, &width, &height );
+        
+        if( ( c < jpg->nc && !planes->planes[c] ) || ( planes->planes[c] && planes->pitch[c] < width ) ||
+            ( c == 1 && !planes->planes[1] != !planes->planes[2] ) )
+        {
+          setError(jpg, JPG_ERR_BAD_SURFACE);
+          return -3;
+        }
+    }
+    
+    return readScan(jpg, NULL, planes, 0, 0, jpg->width, jpg->height, NULL, NULL);
+}
+
+
+int8_t jpg_read_surface(const jpg_surface_t * surface, jpg_t * jpg)
+{
+    return jpg_read_region(surface, 0, 0, jpg->width, jpg->height, jpg);
+}
+
+
+int8_t jpg_read( uint32_t * surface, uint16_t surface_width, uint16_t surface_height, jpg_t * jpg)
+{
+    return jpg_read_format(surface, surface_width, surface_height, JPG_FORMAT_XRGB, jpg);
+}
+
+
+int8_t jpg_read_format(void * surface, uint16_t surface_width, uint16_t surface_height, uint8_t format, jpg_t * jpg)
+{
+jpg_surface_t   desc;
+
+
+    if( format >= JPG_FORMATS )
+    {
+      setError(jpg, JPG_ERR_BAD_SURFACE);
+      return -3;
+    }
+    
+ // The rows of the surface are contiguous
+    desc.pixels = surface;
+    desc.pitch  = (size_t)surface_width * FORMATS[format].size;
+    desc.width  = surface_width;
+    desc.height = surface_height;
+    desc.format = format;
+    
+    return jpg_read_surface(&desc, jpg);
+}
+
+
+#ifdef JPG_HAVE_MMAP
+
+static uint8_t loadFD(jpg_t * jpg, int fd)
+{
+struct stat   st;
+void        * map;
+uint8_t     * buf;
+uint8_t     * grown;
+size_t        capacity;
+ssize_t       n;
+
+
+ // Regular files are mapped into memory, so the decoder reads the page cache directly
+    if( fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 )
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        
+        if( map != MAP_FAILED )
+        {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            
+            jpg->data = (const uint8_t *)map;
+            jpg->size = st.st_size;
+            jpg->src  = JPG_SRC_MMAP;
+            return 1;
+        }
+    }
+    
+ // Pipes, sockets and the like can't be mapped, so read them into memory
+    for( buf = NULL, capacity = 0, jpg->size = 0; ; jpg->size += n )
+    {
+        if( jpg->size == capacity )
+        {
+            capacity = capacity ? capacity << 1 : 65536;
+            grown    = (uint8_t *)allocMemory(capacity);
+            
+            if( !grown )
+            {
+                freeMemory(buf);
+                jpg->data = NULL;
+                return 0;
+            }
+            
+            if( buf )
+                memcpy( grown, buf, jpg->size );
+            
+            freeMemory(buf);
+            buf       = grown;
+            jpg->data = buf;
+        }
+        
+        n = read(fd, buf + jpg->size, capacity - jpg->size);
+        
+        if( n <= 0 )
+            break;
+    }
+    
+    jpg->src = JPG_SRC_HEAP;
+    return (n == 0);
+}
+
+#endif
+
+
+static uint8_t loadFile(jpg_t * jpg, const char * JPGfile)
+{
+#ifdef JPG_HAVE_MMAP
+int       fd;
+uint8_t   loaded;
+
+
+    fd = open(JPGfile, O_RDONLY);
+    if( fd < 0 )
+        return 0;
+    
+    loaded = loadFD(jpg, fd);
+    close(fd);
+    
+    return loaded;
+    
+#else
+FILE    * fp;
+long      size;
+
+
+ // Without memory mapped files, the whole file is read into memory in one go
+    fp = fopen(JPGfile, "rb");
+    if( !fp )
+        return 0;
+    
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    
+    jpg->data = (size > 0) ? allocMemory(size) : NULL;
+    jpg->size = jpg->data ? fread((uint8_t *)jpg->data, 1, size, fp) : 0;
+    jpg->src  = JPG_SRC_HEAP;
+    
+    fclose(fp);
+    
+    return (jpg->data != NULL);
+#endif
+}
+
+
+/* Allocates from the arena of a context, from any thread. Returns NULL if
+ * the arena needs a new chunk and there's no memory for it */
+
+static void * arenaAlloc(jpg_context_t * context, size_t size)
+{
+arenaChunk  * chunk;
+size_t        grow;
+void        * ptr = NULL;
+
+
+    size = (size + JPG_ARENA_ALIGN - 1) & ~(size_t)(JPG_ARENA_ALIGN - 1);
+    
+#ifdef JPG_HAVE_PTHREADS
+    pthread_mutex_lock( &context->lock );
+#endif
+    
+    chunk = context->chunks;
+    
+    if( !chunk || chunk->used + size > chunk->size )
+    {
+     // Enough for the rest of what an image has needed so far, so that it's a single chunk next time
+        grow  = (context->highWater > context->inUse) ? context->highWater - context->inUse : 0;
+        grow  = (grow > size) ? grow : size;
+        grow  = (grow > JPG_ARENA_CHUNK) ? grow : JPG_ARENA_CHUNK;
+        
+        chunk = (arenaChunk *)allocMemory( sizeof(arenaChunk) + JPG_ARENA_ALIGN + grow );
+        if( chunk )
+        {
+            chunk->data = (uint8_t *)( ( (uintptr_t)(chunk + 1) + JPG_ARENA_ALIGN - 1 ) & ~(uintptr_t)(JPG_ARENA_ALIGN - 1) );
+            chunk->size = grow;
+            chunk->used = 0;
+            chunk->next = context->chunks;
+            context->chunks = chunk;
+        }
+    }
+    
+    if( chunk )
+    {
+        ptr              = chunk->data + chunk->used;
+        chunk->used     += size;
+        context->inUse  += size;
+        context->highWater = (context->inUse > context->highWater) ? context->inUse : context->highWater;
+    }
+    
+#ifdef JPG_HAVE_PTHREADS
+    pthread_mutex_unlock( &context->lock );
+#endif
+    
+    return ptr;
+}
+
+
+// Empties the arena for the next image, as a single chunk
+static void arenaReset(jpg_context_t * context)
+{
+arenaChunk  * chunk;
+
+
+    if( context->chunks && (context->chunks->next || context->chunks->size < context->highWater) )
+    {
+        while( context->chunks )
+        {
+            chunk           = context->chunks;
+            context->chunks = chunk->next;
+            freeMemory(chunk);
+        }
+    }
+    
+    if( context->chunks )
+        context->chunks->used = 0;
+    
+    context->inUse = 0;
+}
+
+
+static void * allocMemory(size_t size)
+{
+    return allocator.malloc(allocator.user, size);
+}
+
+
+static void freeMemory(void * ptr)
+{
+    if( ptr )
+        allocator.free(allocator.user, ptr);
+}
+
+
+/* Scratch memory comes from the arena of the image's context, if it has 
+ * one, and otherwise from the heap. Memory from an arena isn't freed on its
+ * own, but released with everything allocated after a mark */
+
+static arenaMark scratchMark(const jpg_t * jpg)
+{
+arenaMark   mark = { NULL, 0, 0 };
+
+
+    if( jpg->context )
+    {
+        mark.chunk = jpg->context->chunks;
+        mark.used  = mark.chunk ? mark.chunk->used : 0;
+        mark.inUse = jpg->context->inUse;
+    }
+    
+    return mark;
+}
+
+
+static void scratchRelease(const jpg_t * jpg, arenaMark mark)
+{
+jpg_context_t   * context = jpg->context;
+arenaChunk      * chunk;
+
+
+    if( !context )
+        return;
+    
+ // Chunks allocated since the mark are freed, the arena is consolidated when it's reset
+    while( context->chunks && context->chunks != mark.chunk )
+    {
+        chunk           = context->chunks;
+        context->chunks = chunk->next;
+        freeMemory(chunk);
+    }
+    
+    if( context->chunks )
+        context->chunks->used = mark.used;
+    
+    context->inUse = mark.inUse;
+}
+
+
+static void * scratchAlloc(const jpg_t * jpg, size_t size)
+{
+memoryUsage   * usage = (memoryUsage *)jpg->usage;
+
+
+ // During a decode, memory is refused before it's allocated once the decode would go over its budget
+    if( usage && __atomic_add_fetch(&usage->used, size, __ATOMIC_RELAXED) > usage->limit && usage->limit )
+    {
+        __atomic_sub_fetch( &usage->used, size, __ATOMIC_RELAXED );
+        __atomic_store_n( &usage->exceeded, 1, __ATOMIC_RELAXED );
+        return NULL;
+    }
+    
+    return jpg->context ? arenaAlloc(jpg->context, size) : allocMemory(size);
+}
+
+
+static void scratchFree(const jpg_t * jpg, void * ptr)
+{
+    if( !jpg->context )
+        freeMemory(ptr);
+}
+
+
+// Why memory couldn't be allocated during a decode
+static uint8_t memoryError(const jpg_t * jpg)
+{
+    if( jpg->usage && ((memoryUsage *)jpg->usage)->exceeded )
+        return JPG_ERR_MEMORY_LIMIT;
+    
+    return JPG_ERR_MEMORY;
+}
+
+
+static jpg_t * createHandle(const jpg_options_t * options)
+{
+jpg_t   * jpg;
+uint8_t   i;
+
+
+ // In a context, the handle is the first thing allocated from its arena once it's been emptied
+    if( options && options->context )
+    {
+        if( options->context->busy )
+        {
+          setError(NULL, JPG_ERR_BUSY);
+          return NULL;
+        }
+        
+        arenaReset(options->context);
+        
+        jpg = (jpg_t *)arenaAlloc(options->context, sizeof(jpg_t));
+        if( jpg )
+        {
+            memset(jpg, 0, sizeof(jpg_t));
+            jpg->context = options->context;
+            jpg->context->busy = 1;
+        }
+    }
+    
+    else
+    {
+        jpg = (jpg_t *)allocMemory(sizeof(jpg_t));
+        if( jpg )
+            memset(jpg, 0, sizeof(jpg_t));
+    }
+    
+    if(!jpg)
+    {
+      setError(NULL, JPG_ERR_MEMORY);
+      return NULL;
+    }
+    
+ // Options need to be known before parsing, as they affect how the tables are set up
+    if(options)
+    {
+        jpg->idct      = options->idct;
+        jpg->threads   = options->threads;
+        jpg->log       = options->log;
+        jpg->log_user  = options->log_user;
+        jpg->log_level = options->log_level;
+        jpg->max_memory = options->max_memory;
+    }
+    
+ // Tables an image doesn't define decode as nothing, rather than as garbage
+    for( i = 0; i < 8; i++ )
+        jpg->seg.huffTbl[i >> 2][i & 3] = &emptyHuffTbl;
+    
+    return jpg;
+}
+
+
+static void releaseSource(jpg_t * jpg)
+{
+cachedHuffTbl   * entry;
+
+
+    while( jpg->tables )
+    {
+        entry       = (cachedHuffTbl *)jpg->tables;
+        jpg->tables = entry->next;
+        freeMemory(entry);
+    }
+    
+    switch( jpg->src )
+    {
+#ifdef JPG_HAVE_MMAP
+        case JPG_SRC_MMAP:
+            munmap( (void *)jpg->data, jpg->size );
+        break;
+#endif
+
+        case JPG_SRC_HEAP:
+            freeMemory( (void *)jpg->data );
+        break;
+    }
+    
+ // A handle from a context stays in its arena until the next image is opened
+    if( jpg->context )
+        jpg->context->busy = 0;
+    else
+        freeMemory(jpg);
+}
+
+
+static jpg_t * readHeaders(jpg_t * jpg)
+{
+uint16_t  marker;
+uint8_t   error = JPG_OK;
+uint8_t   i;
+
+
+    if(!validateJPEG(jpg))
+    {
+        setError(jpg, JPG_ERR_NOT_JPEG);
+        releaseSource(jpg);
+        return NULL;
+    }
+    
+    while(!error)
+    {
+        marker = readMarker(jpg);
+        
+        switch(marker)
+        {
+            case APP0:
+            {
+                JPG_LOG( jpg, JPG_LOG_DEBUG, "Reading APP0 segment..." );
+                readAPP0(jpg);
+                break;
+            }
+                
+            case APP14:
+            {
+                JPG_LOG( jpg, JPG_LOG_DEBUG, "Reading APP14 segment..." );
+                readAPP14(jpg);
+                break;
+            }
+            
+            case SOF0:
+            { 
+                JPG_LOG( jpg, JPG_LOG_DEBUG, "Reading SOF segment..." );
+                readSOF(jpg);     
+                jpg->width = jpg->seg.sof.frameWidth;
+                jpg->height = jpg->seg.sof.frameHeight;
+                jpg->nc = jpg->seg.sof.nComponents;
+                
+             // An MCU is as many blocks across (and down) as the largest sampling factor of the components
+                jpg->hsf = 1;
+                jpg->vsf = 1;
+                
+                for( i = 0; i < jpg->nc && i < JPG_MAX_COMPONENTS; i++ )
+                {
+                    jpg->hsf = jpg->seg.comp[i].HSmplFctr > jpg->hsf ? jpg->seg.comp[i].HSmplFctr : jpg->hsf;
+                    jpg->vsf = jpg->seg.comp[i].VSmplFctr > jpg->vsf ? jpg->seg.comp[i].VSmplFctr : jpg->vsf;
+                }
+                
+                /* The frame-width and frame-height of the image are extended to a whole number of MCUs (see decodeScanData) */ 
+                jpg->extended_width  = (uint32_t)( (jpg->width  + 8 * jpg->hsf - 1) / (8 * jpg->hsf) ) * 8 * jpg->hsf;
+                jpg->extended_height = (uint32_t)( (jpg->height + 8 * jpg->vsf - 1) / (8 * jpg->vsf) ) * 8 * jpg->vsf;
+                break;
+            }
+            
+            case SOF1:
+            {
+                JPG_LOG( jpg, JPG_LOG_ERROR, "Extended Sequential JPEG is not supported" );
+                error = JPG_ERR_UNSUPPORTED_SOF;
+                break;
+            }
+            
+            case SOF2:
+            {
+                JPG_LOG( jpg, JPG_LOG_ERROR, "Progressive JPEG is not supported" );
+                error = JPG_ERR_UNSUPPORTED_SOF;
+                break;
+            }
+            
+            case SOF3:
+            {
+                JPG_LOG( jpg, JPG_LOG_ERROR, "Lossless JPEG is not supported" );
+                error = JPG_ERR_UNSUPPORTED_SOF;
+                break;
+            }
+            
+            case DHT:
+            {
+                JPG_LOG( jpg, JPG_LOG_DEBUG, "Reading DHT segment..." );
+                if( !readDHT(jpg) )
+                    error = JPG_ERR_MEMORY;
+                break;
+            }
+            
+            case DQT:
+            {
+                JPG_LOG( jpg, JPG_LOG_DEBUG, "Reading DQT segment..." );
+                readDQT(jpg);                
+                break;
+            }
+            
+            case DRI:
+            {
+                JPG_LOG( jpg, JPG_LOG_DEBUG, "Reading DRI segment..." );
+                readDRI(jpg);                
+                break;
+            }
+            
+            case SOS:
+            {
+                setColorspace(jpg);
+                return jpg;
+            }
+            
+            case EOI:
+            {
+                /* EOI marker must come after SOS marker */
+                error = JPG_ERR_NO_SCAN;
+                break;
+            }
+            
+            case NOM:
+            {
+             // Either the image ends before its scan, or a segment isn't where it should be
+                error = (jpg->pos + 2 > jpg->size) ? JPG_ERR_TRUNCATED : JPG_ERR_BAD_MARKER;
+                break;
+            }
+            
+            default:
+            {
+                JPG_LOG( jpg, JPG_LOG_DEBUG, "Skipping trivial segment (Marker: 0x%x)...", marker & 0xffff );
+                if( !skipSegment(jpg) )
+                    error = JPG_ERR_BAD_MARKER;
+            }
+        }
+    }
+
+    
+    setError(jpg, error);
+    releaseSource(jpg);
+    return NULL;
+}
+
+
+jpg_t * jpg_open_ex(const char * JPGfile, const jpg_options_t * options)
+{
+jpg_t   * jpg;
+
+
+    jpg = createHandle(options);
+    if(!jpg)
+      return NULL;
+      
+    if(!loadFile(jpg, JPGfile))
+    {
+      setError(jpg, JPG_ERR_OPEN);
+      releaseSource(jpg);
+      return NULL;
+    }
+    
+    return readHeaders(jpg);
+}
+
+
+#ifdef JPG_HAVE_MMAP
+
+jpg_t * jpg_open_fd_ex(int fd, const jpg_options_t * options)
+{
+jpg_t   * jpg;
+
+
+    jpg = createHandle(options);
+    if(!jpg)
+      return NULL;
+      
+    if(!loadFD(jpg, fd))
+    {
+      setError(jpg, JPG_ERR_OPEN);
+      releaseSource(jpg);
+      return NULL;
+    }
+    
+    return readHeaders(jpg);
+}
+
+
+jpg_t * jpg_open_fd(int fd)
+{
+    return jpg_open_fd_ex(fd, NULL);
+}
+
+#endif
+
+
+jpg_t * jpg_open_mem_ex(const uint8_t * data, size_t size, const jpg_options_t * options)
+{
+jpg_t   * jpg;
+
+
+    jpg = createHandle(options);
+    if(!jpg)
+      return NULL;
+    
+ // The image is decoded in place, without copying it
+    jpg->data = data;
+    jpg->size = size;
+    jpg->src  = JPG_SRC_MEM;
+    
+    return readHeaders(jpg);
+}
+
+
+jpg_t * jpg_open(const char * JPGfile)
+{
+    return jpg_open_ex(JPGfile, NULL);
+}
+
+
+jpg_t * jpg_open_mem(const uint8_t * data, size_t size)
+{
+    return jpg_open_mem_ex(data, size, NULL);
+}
+
+
+void jpg_close(jpg_t * jpg)
+{
+    releaseSource(jpg);
+}
+
+
+jpg_error_t jpg_last_error(void)
+{
+    return (jpg_error_t)lastError;
+}
+
+
+const char * jpg_strerror(jpg_error_t error)
+{
+    
+    switch( error )
+    {
+        case JPG_OK:                        return "No error";
+        case JPG_ERR_OPEN:                  return "The file can't be opened or read";
+        case JPG_ERR_MEMORY:                return "Out of memory";
+        case JPG_ERR_NOT_JPEG:              return "Not a valid JPEG image";
+        case JPG_ERR_BAD_MARKER:            return "Invalid JPEG: a segment has no marker or an invalid length";
+        case JPG_ERR_TRUNCATED:             return "The JPEG image is truncated";
+        case JPG_ERR_NO_SCAN:               return "The JPEG image has no scan (SOS)";
+        case JPG_ERR_BAD_SCAN:              return "The scan (SOS) has no Huffman tables for some component";
+        case JPG_ERR_UNSUPPORTED_SOF:       return "Only baseline JPEG is supported";
+        case JPG_ERR_UNSUPPORTED_SAMPLING:  return "Unsupported sampling factor";
+        case JPG_ERR_BAD_SURFACE:           return "Invalid surface or region";
+        case JPG_ERR_STOPPED:               return "Decoding was stopped by the caller";
+        case JPG_ERR_BUSY:                  return "The context already holds an open image";
+        case JPG_ERR_MEMORY_LIMIT:          return "Decoding the image would take more memory than allowed";
+    }
+    
+    return "Unknown error";
+}
+
+
+jpg_context_t * jpg_context_create(void)
+{
+jpg_context_t   * context;
+
+
+    context = (jpg_context_t *)allocMemory(sizeof(jpg_context_t));
+    if( !context )
+        return NULL;
+    
+    memset(context, 0, sizeof(jpg_context_t));
+    
+#ifdef JPG_HAVE_PTHREADS
+    pthread_mutex_init( &context->lock, NULL );
+#endif
+    
+    return context;
+}
+
+
+void jpg_context_destroy(jpg_context_t * context)
+{
+arenaChunk  * chunk;
+
+
+    if( !context )
+        return;
+    
+    while( context->chunks )
+    {
+        chunk           = context->chunks;
+        context->chunks = chunk->next;
+        freeMemory(chunk);
+    }
+    
+#ifdef JPG_HAVE_PTHREADS
+    pthread_mutex_destroy( &context->lock );
+#endif
+    
+    freeMemory(context);
+}
+
+
+void jpg_set_allocator(const jpg_allocator_t * custom)
+{
+    if( custom && custom->malloc && custom->free )
+        allocator = *custom;
+    else
+        allocator = (jpg_allocator_t){ defaultMalloc, defaultFree, NULL };
+}
+
+
+const char * jpg_kernels(void)
+{
+#ifdef JPG_HAVE_PTHREADS
+    pthread_once( &coreOnce, initCore );
+#else
+    initCore();
+#endif
+    return kernelsName;
+}
+
+
+/* Returns n bytes of the image being probed from offset pos, reading the
+ * chunk of the file that starts there if need be, or NULL past its end */
+
+static const uint8_t * probeBytes(probeSource * src, uint64_t pos, size_t n)
+{
+#ifdef JPG_HAVE_MMAP
+ssize_t     got;
+#else
+size_t      got;
+#endif
+
+
+    if( pos >= src->offset && pos + n <= src->offset + src->size )
+        return src->data + (pos - src->offset);
+    
+#ifdef JPG_HAVE_MMAP
+    if( src->fd < 0 )
+        return NULL;
+    
+    got = pread( src->fd, src->chunk, JPG_PROBE_CHUNK, (off_t)pos );
+    if( got < 0 )
+        return NULL;
+#else
+    if( !src->fp || fseek( src->fp, (long)pos, SEEK_SET ) )
+        return NULL;
+    
+    got = fread( src->chunk, 1, JPG_PROBE_CHUNK, src->fp );
+#endif
+    
+    src->data   = src->chunk;
+    src->size   = (size_t)got;
+    src->offset = pos;
+    
+    return ( n <= src->size ) ? src->data : NULL;
+}
+
+
+/* Walks the markers of an image up to its first scan, reading only those 
+ * of the frame header and the restart interval. Other segments are skipped
+ * by their length. The info is only filled in once the scan is found */
+
+static int8_t probeHeaders(probeSource * src, uint64_t size, jpg_info_t * info)
+{
+const uint8_t * bytes;
+uint64_t        pos = 2;
+uint16_t        marker, length;
+uint8_t         frame = 0;
+jpg_info_t      found;
+
+
+    memset( &found, 0, sizeof(found) );
+    found.size = size;
+    
+    bytes = probeBytes(src, 0, 2);
+    if( !bytes || ( (bytes[0] << 8) | bytes[1] ) != SOI )
+        return -2;
+    
+    for( ;; )
+    {
+        bytes = probeBytes(src, pos, 4);
+        if( !bytes )
+            return -1;
+        
+        if( bytes[0] != 0xFF )
+            return -2;
+        
+        marker = (bytes[0] << 8) | bytes[1];
+        
+     // Markers may be preceded by any number of fill bytes
+        if( marker == 0xFFFF )
+        {
+            pos++;
+            continue;
+        }
+        
+     // TEM and RSTn stand alone, without a length
+        if( marker == 0xFF01 || (marker >= 0xFFD0 && marker <= 0xFFD7) )
+        {
+            pos += 2;
+            continue;
+        }
+        
+        if( marker == EOI )
+            return -1;
+        
+        length = (bytes[2] << 8) | bytes[3];
+        if( length < 2 )
+            return -2;
+        
+        switch( marker )
+        {
+         // SOF0 to SOF15, apart from DHT, JPG and DAC which share their range
+            case 0xFFC0: case 0xFFC1: case 0xFFC2: case 0xFFC3:
+            case 0xFFC5: case 0xFFC6: case 0xFFC7:
+            case 0xFFC9: case 0xFFCA: case 0xFFCB:
+            case 0xFFCD: case 0xFFCE: case 0xFFCF:
+            {
+             // Precision, height, width and components, then the sampling factors of the first
+                bytes = probeBytes(src, pos + 4, 9);
+                if( !bytes || length < 11 )
+                    return bytes ? -2 : -1;
+                
+                found.process = marker - SOF0;
+                found.height  = (bytes[1] << 8) | bytes[2];
+                found.width   = (bytes[3] << 8) | bytes[4];
+                found.nc      = bytes[5];
+                found.hsf     = bytes[7] >> 4;
+                found.vsf     = bytes[7] & 0x0F;
+                
+                if( !found.width || !found.height || !found.nc || 
+                    found.hsf < 1 || found.hsf > 4 || found.vsf < 1 || found.vsf > 4 )
+                    return -2;
+                
+                frame = 1;
+                break;
+            }
+            
+            case DRI:
+            {
+                bytes = probeBytes(src, pos + 4, 2);
+                if( !bytes )
+                    return -1;
+                
+                found.restart = (bytes[0] << 8) | bytes[1];
+                break;
+            }
+            
+            case SOS:
+            {
+                if( !frame )
+                    return -2;
+                
+                found.scan = (uint32_t)(pos + 2 + length);
+                *info      = found;
+                return 0;
+            }
+        }
+        
+        pos += 2 + length;
+    }
+}
+
+
+#ifdef JPG_HAVE_MMAP
+
+int8_t jpg_probe_fd(int fd, jpg_info_t * info)
+{
+probeSource   src;
+struct stat   st;
+
+
+    memset( info, 0, sizeof(jpg_info_t) );
+    
+    if( fstat(fd, &st) )
+        return -4;
+    
+    src.data   = NULL;
+    src.size   = 0;
+    src.offset = 0;
+    src.fd     = fd;
+    
+    return probeHeaders(&src, S_ISREG(st.st_mode) ? (uint64_t)st.st_size : 0, info);
+}
+
+#endif
+
+
+int8_t jpg_probe(const char * JPGfile, jpg_info_t * info)
+{
+#ifdef JPG_HAVE_MMAP
+int             fd;
+int8_t          status;
+
+
+    fd = open(JPGfile, O_RDONLY);
+    if( fd < 0 )
+    {
+        memset( info, 0, sizeof(jpg_info_t) );
+        return -4;
+    }
+    
+    status = jpg_probe_fd(fd, info);
+    close(fd);
+    
+    return status;
+    
+#else
+probeSource     src;
+int8_t          status;
+uint64_t        size = 0;
+
+
+    memset( info, 0, sizeof(jpg_info_t) );
+    
+    src.data   = NULL;
+    src.size   = 0;
+    src.offset = 0;
+    src.fp     = fopen(JPGfile, "rb");
+    
+    if( !src.fp )
+        return -4;
+    
+    if( !fseek(src.fp, 0, SEEK_END) )
+        size = (uint64_t)ftell(src.fp);
+    
+    status = probeHeaders(&src, size, info);
+    fclose(src.fp);
+    
+    return status;
+#endif
+}
+
+
+int8_t jpg_probe_mem(const uint8_t * data, size_t size, jpg_info_t * info)
+{
+probeSource   src;
+
+
+    memset( info, 0, sizeof(jpg_info_t) );
+    
+ // The whole image is in memory, so there's nothing to read
+    src.data   = data;
+    src.size   = size;
+    src.offset = 0;
+#ifdef JPG_HAVE_MMAP
+    src.fd     = -1;
+#else
+    src.fp     = NULL;
+#endif
+    
+    return probeHeaders(&src, size, info);
+}
+
+
+/* Decodes an item of a batch in the thread's context, into a surface of 
+ * its own (from the context too) if it has none */
+
+static void decodeItem(jpg_batch_item_t * item, const jpg_options_t * options)
+{
+jpg_t         * jpg;
+jpg_surface_t   surface = item->surface;
+size_t          size;
+
+
+    jpg = item->file ? jpg_open_ex(item->file, options) : jpg_open_mem_ex(item->data, item->size, options);
+    if( !jpg )
+    {
+        item->status = -4;
+        
+        if( item->done )
+            item->done( item, NULL );
+        
+        return;
+    }
+    
+    if( !surface.pixels && surface.format < JPG_FORMATS )
+    {
+        size           = (size_t)jpg->width * jpg->height * FORMATS[surface.format].size;
+        surface.pitch  = (size_t)jpg->width * FORMATS[surface.format].size;
+        surface.width  = jpg->width;
+        surface.height = jpg->height;
+        
+     // The surface comes out of the decode's budget
+        if( jpg->max_memory && size >= jpg->max_memory )
+        {
+            setError(jpg, JPG_ERR_MEMORY_LIMIT);
+        }
+        
+        else
+        {
+            jpg->max_memory -= jpg->max_memory ? size : 0;
+            surface.pixels   = scratchAlloc( jpg, size );
+            
+            if( !surface.pixels )
+                setError(jpg, JPG_ERR_MEMORY);
+        }
+    }
+    
+ // A caller's surface of an unknown format, or whose pitch is too small, is turned down as such (-3)
+    item->status = surface.pixels || surface.format >= JPG_FORMATS ? jpg_read_surface(&surface, jpg) : -2;
+    
+    if( item->done )
+        item->done( item, item->status ? NULL : &surface );
+    
+    if( surface.pixels != item->surface.pixels )
+        scratchFree(jpg, surface.pixels);
+    
+    jpg_close(jpg);
+}
+
+
+// Options of a thread of a batch, with a context of its own (or none if there's no memory for it)
+static void batchOptions(const jpg_options_t * options, jpg_options_t * threadOptions)
+{
+    if( options )
+        *threadOptions = *options;
+    else
+        memset( threadOptions, 0, sizeof(jpg_options_t) );
+    
+    threadOptions->context = jpg_context_create();
+}
+
+
+#ifdef JPG_HAVE_PTHREADS
+
+/* The cost of decoding an item is about that of entropy decoding its bytes
+ * plus that of reconstructing its blocks, whose number is known from the 
+ * frame header, so items are only probed. An item that can't be probed 
+ * costs nothing */
+
+static uint64_t estimateCost(const jpg_batch_item_t * item)
+{
+jpg_info_t  info;
+uint64_t    cost;
+
+
+    if( item->file ? jpg_probe(item->file, &info) : jpg_probe_mem(item->data, item->size, &info) )
+        return 0;
+    
+ // Blocks of Y, in whole MCUs
+    cost  = (uint64_t)( (info.width  + 8 * info.hsf - 1) / (8 * info.hsf) ) * info.hsf;
+    cost *= (uint64_t)( (info.height + 8 * info.vsf - 1) / (8 * info.vsf) ) * info.vsf;
+    
+ // Each MCU has a block of Cb and one of Cr besides those of Y
+    if( info.nc > 1 )
+        cost += 2 * cost / (info.hsf * info.vsf);
+    
+    return info.size + cost * JPG_BATCH_BLOCK_COST;
+}
+
+
+// Each thread estimates the cost of every nThreads-th item
+static void * estimateThread(void * arg)
+{
+batchWorker * worker = (batchWorker *)arg;
+batchPool   * pool   = worker->pool;
+size_t        i;
+
+
+    for( i = worker->id; i < pool->n; i += pool->nThreads )
+        pool->costs[i] = estimateCost( &pool->items[i] );
+    
+    return NULL;
+}
+
+
+// Each thread probes every nThreads-th file
+static void * probeThread(void * arg)
+{
+batchWorker * worker = (batchWorker *)arg;
+batchPool   * pool   = worker->pool;
+size_t        i;
+
+
+    for( i = worker->id; i < pool->n; i += pool->nThreads )
+        jpg_probe( pool->files[i], &pool->infos[i] );
+    
+    return NULL;
+}
+
+
+static void * decodeThread(void * arg)
+{
+batchWorker * worker = (batchWorker *)arg;
+batchPool   * pool   = worker->pool;
+batchQueue  * queue;
+jpg_options_t options;
+size_t        item;
+uint16_t      q;
+uint8_t       found;
+
+
+    batchOptions( pool->options, &options );
+    
+    for( ;; )
+    {
+        found = 0;
+        
+     // Take the next item of our own queue, or else steal the last of the first queue that has any left
+        for( q = 0; q < pool->nThreads && !found; q++ )
+        {
+            queue = &pool->queues[ (worker->id + q) % pool->nThreads ];
+            
+            pthread_mutex_lock( &queue->lock );
+            
+            if( queue->first < queue->end )
+            {
+                item  = q ? queue->order[--queue->end] : queue->order[queue->first++];
+                found = 1;
+            }
+            
+            pthread_mutex_unlock( &queue->lock );
+        }
+        
+     // No items are ever added, so once all the queues are empty, the thread is done
+        if( !found )
+            break;
+        
+        decodeItem( &pool->items[item], &options );
+    }
+    
+    jpg_context_destroy( options.context );
+    
+    return NULL;
+}
+
+
+// Sorts the items by decreasing cost
+static int compareCosts(const void * a, const void * b)
+{
+const uint64_t  * costA = (const uint64_t *)a;
+const uint64_t  * costB = (const uint64_t *)b;
+
+
+    return (costA[0] < costB[0]) - (costA[0] > costB[0]);
+}
+
+
+/* Runs 'thread' on each of the threads of the pool (the calling thread 
+ * being the first), and waits for them all */
+
+static void runPool(batchPool * pool, batchWorker * workers, void * (* thread)(void *))
+{
+pthread_t   threads[JPG_MAX_THREADS];
+uint8_t     started[JPG_MAX_THREADS] = { 0 };
+uint16_t    t;
+
+
+    for( t = 1; t < pool->nThreads; t++ )
+        started[t] = !pthread_create( &threads[t], NULL, thread, &workers[t] );
+    
+    thread( &workers[0] );
+    
+ // The work of threads that couldn't be started is stolen (or done) by the others
+    for( t = 1; t < pool->nThreads; t++ )
+    {
+        if( started[t] )
+            pthread_join( threads[t], NULL );
+        else
+            thread( &workers[t] );
+    }
+}
+
+#endif
+
+
+size_t jpg_read_batch(jpg_batch_item_t * items, size_t n, uint16_t threads, const jpg_options_t * options)
+{
+jpg_options_t   threadOptions;
+size_t          i, failed = 0;
+#ifdef JPG_HAVE_PTHREADS
+batchPool       pool;
+batchWorker     workers[JPG_MAX_THREADS];
+batchQueue      queues[JPG_MAX_THREADS];
+uint64_t        load[JPG_MAX_THREADS] = { 0 };
+uint64_t      * sorted;
+size_t        * order;
+uint16_t        t, q;
+#else
+    (void)threads;
+#endif
+
+
+#ifdef JPG_HAVE_PTHREADS
+    threads = threads < JPG_MAX_THREADS ? threads : JPG_MAX_THREADS;
+    threads = threads < n ? threads : (uint16_t)n;
+    
+    pool.items    = items;
+    pool.files    = NULL;
+    pool.infos    = NULL;
+    pool.n        = n;
+    pool.options  = options;
+    pool.queues   = queues;
+    pool.nThreads = threads;
+    pool.costs    = NULL;
+    sorted        = NULL;
+    order         = NULL;
+    
+    if( threads > 1 )
+    {
+        pool.costs = (uint64_t *)allocMemory( n * sizeof(uint64_t) );
+        sorted     = (uint64_t *)allocMemory( n * 2 * sizeof(uint64_t) );
+        order      = (size_t *)allocMemory( n * sizeof(size_t) );
+    }
+    
+ // Without the memory for the pool, the items are decoded in turn by the calling thread
+    if( pool.costs && sorted && order )
+    {
+        for( t = 0; t < threads; t++ )
+        {
+            workers[t].pool = &pool;
+            workers[t].id   = t;
+        }
+        
+        runPool( &pool, workers, estimateThread );
+        
+     // Pairs of (cost, item) sorted by decreasing cost
+        for( i = 0; i < n; i++ )
+        {
+            sorted[2 * i]     = pool.costs[i];
+            sorted[2 * i + 1] = i;
+        }
+        
+        qsort( sorted, n, 2 * sizeof(uint64_t), compareCosts );
+        
+     /* Each item goes to the queue with the least cost so far, so the queues
+      * are balanced and each of them is in order of decreasing cost. The 
+      * item's queue is kept in its cost until the queues are laid out */
+        for( i = 0; i < n; i++ )
+        {
+            for( q = 0, t = 1; t < threads; t++ )
+            {
+                if( load[t] < load[q] )
+                    q = t;
+            }
+            
+            load[q]      += sorted[2 * i];
+            sorted[2 * i] = q;
+        }
+        
+     // The queues are laid out one after the other, each in order of decreasing cost
+        for( t = 0; t < threads; t++ )
+            queues[t].end = 0;
+        
+        for( i = 0; i < n; i++ )
+            queues[ sorted[2 * i] ].end++;
+        
+        for( t = 0, i = 0; t < threads; t++ )
+        {
+            queues[t].order = order + i;
+            i              += queues[t].end;
+            queues[t].first = 0;
+            queues[t].end   = 0;
+            pthread_mutex_init( &queues[t].lock, NULL );
+        }
+        
+        for( i = 0; i < n; i++ )
+        {
+            q = sorted[2 * i];
+            queues[q].order[ queues[q].end++ ] = sorted[2 * i + 1];
+        }
+        
+        runPool( &pool, workers, decodeThread );
+        
+        for( t = 0; t < threads; t++ )
+            pthread_mutex_destroy( &queues[t].lock );
+    }
+    
+    else
+#endif
+    {
+        batchOptions( options, &threadOptions );
+        
+        for( i = 0; i < n; i++ )
+            decodeItem( &items[i], &threadOptions );
+        
+        jpg_context_destroy( threadOptions.context );
+    }
+    
+#ifdef JPG_HAVE_PTHREADS
+    freeMemory( pool.costs );
+    freeMemory( sorted );
+    freeMemory( order );
+#endif
+    
+    for( i = 0; i < n; i++ )
+        failed += (items[i].status != 0);
+    
+    return failed;
+}
+
+
+size_t jpg_probe_batch(const char * const * files, size_t n, jpg_info_t * infos, uint16_t threads)
+{
+size_t          i, failed = 0;
+#ifdef JPG_HAVE_PTHREADS
+batchPool       pool;
+batchWorker     workers[JPG_MAX_THREADS];
+uint16_t        t;
+#else
+    (void)threads;
+#endif
+
+
+#ifdef JPG_HAVE_PTHREADS
+ // Probing is mostly waiting for reads, so the files are simply dealt out among the threads
+    threads = threads < JPG_MAX_THREADS ? threads : JPG_MAX_THREADS;
+    threads = threads < n ? threads : (uint16_t)n;
+    
+    if( threads > 1 )
+    {
+        memset( &pool, 0, sizeof(pool) );
+        pool.files    = files;
+        pool.infos    = infos;
+        pool.n        = n;
+        pool.nThreads = threads;
+        
+        for( t = 0; t < threads; t++ )
+        {
+            workers[t].pool = &pool;
+            workers[t].id   = t;
+        }
+        
+        runPool( &pool, workers, probeThread );
+    }
+    
+    else
+#endif
+    {
+        for( i = 0; i < n; i++ )
+            jpg_probe( files[i], &infos[i] );
+    }
+    
+ // A file that fails is left zeroed
+    for( i = 0; i < n; i++ )
+        failed += (infos[i].width == 0);
+    
+    return failed;
+}
@@ -13,6 +13,7 @@
 
 #define     SOI     0xFFD8              // Start of Image
 #define     APP0    0xFFE0              // JPEG Application Segment
+#define     APP14   0xFFEE              // Adobe Application Segment (colour transform of the components)
 #define     EOI     0xFFD9              // End of Image
 #define     SOF0    0xFFC0              // Start of Frame (baseline DCT)
 #define     SOF1    0xFFC1              // Start of Frame (Extended Sequential DCT)
@@ -26,15 +27,28 @@
 
 #define     EOB     0x00                // END_OF_BLOCK marker for Huffman bitstream
 
+#define     HUFF_LOOKAHEAD  9           // Number of bits resolved by a single Huffman table lookup
 
-struct NODE
+#define     JPG_MAX_COMPONENTS  4       // Components of an image (Y, Cb, Cr and K of YCCK, at most)
+#define     JPG_MAX_BLOCKS      10      // Blocks of an MCU, at most, over all the components (as the standard allows)
+
+
+/* Huffman codes in JPEG are canonical, i.e. they are completely defined by
+ * the number of codewords of each length. Hence, instead of building a tree
+ * we build a table indexed by the next HUFF_LOOKAHEAD bits of the stream which
+ * resolves every codeword of up to HUFF_LOOKAHEAD bits in a single lookup.
+ * Longer (and rare) codewords are resolved by comparing against the largest
+ * codeword of each length */
+
+typedef struct
 {
-struct NODE *   parent;
-struct NODE *   leftChild;
-struct NODE *   rightChild;
-uint8_t         isLeaf;
-uint8_t         leafSymbol;
-};
+    uint16_t        lookup[1 << HUFF_LOOKAHEAD];    // (Codeword length << 8) | symbol, or 0 if the codeword is longer than HUFF_LOOKAHEAD bits
+    int16_t         fastCoeff[1 << HUFF_LOOKAHEAD]; // (Coefficient << 8) | (Zero-run-length << 4) | total bits, or 0 if it doesn't fit in HUFF_LOOKAHEAD bits
+    int32_t         maxCode[17];                    // Largest codeword of length i (-1 if there are no codewords of length i)
+    int32_t         valOffset[17];                  // Offset from a codeword of length i to the index of its symbol
+    uint8_t         symbols[256];                   // Symbols sorted by increasing codeword length
+}
+HUFFTBL;
 
 
 typedef struct
@@ -60,8 +74,9 @@ typedef struct
     uint8_t         HSmplFctr;          // The horizontal sampling factor
     uint8_t         VSmplFctr;          // The vertical sampling factor
     uint8_t   *     QntzTbl;            // Pointer to the 8x8 Quantization Table
-    struct NODE     HuffTreeDC;         // Root of the Huffman Tree for DC coefficients
-    struct NODE     HuffTreeAC;         // Root of the Huffman Tree for AC coefficients
+    int16_t         DequantTbl[64];     // Quantization Table (zig-zag order) prescaled for the IDCT in use
+    const HUFFTBL * HuffTblDC;          // Huffman Table for DC coefficients (as selected by the Scan Segment)
+    const HUFFTBL * HuffTblAC;          // Huffman Table for AC coefficients (as selected by the Scan Segment)
     int             DCcoeff;            // Current value for the DC coefficient
 }
 Component;
@@ -100,7 +115,7 @@ typedef struct
     uint16_t        frameHeight;        // Number of lines
     uint16_t        frameWidth;         // Samples per line
     uint8_t         nComponents;        // Number of Components, typically 3(Y,Cb,Cr)
-    FCSF            FCSFstruct[3];      // Frame Component specification for individual Components (assumming 3 Components)
+    FCSF            FCSFstruct[JPG_MAX_COMPONENTS]; // Frame Component specification for individual Components
 }
 __attribute__((packed)) SOFseg;
 
@@ -136,7 +151,7 @@ typedef struct
     uint16_t        SOS_marker;         // JPEG Start of Scan Marker (Always 0xFFDA)
     uint16_t        length;             // Length of segment
     uint8_t         nComponents;        // Number of Components, typically 3(Y,Cb,Cr)
-    SCSF            SCSFstruct[3];      // Scan Component specification for individual Components (assumming 3 Components)
+    SCSF            SCSFstruct[JPG_MAX_COMPONENTS]; // Scan Component specification for individual Components
     uint8_t         unused1;
     uint8_t         unused2;
     uint8_t         unused3;
@@ -159,41 +174,363 @@ typedef struct
 __attribute__((packed)) DRIseg;
 
 
+/* Only one row of MCUs is held in memory while decoding, as a plane of
+ * samples per component. The planes only span the MCUs that cover the
+ * region of the image being decoded. The image may be decoded at a reduced
+ * size, in which case each block is reconstructed into fewer samples. A 
+ * subsampled component may be reconstructed into more samples instead, up
+ * to the size of the image, which saves upsampling it */
+
 typedef struct
 {
-    FILE  *   fp;
+    uint8_t   *     planes[JPG_MAX_COMPONENTS];     // Samples of each component
+    uint8_t   *     upsampled[JPG_MAX_COMPONENTS];  // Row of samples of each component upsampled to the width of the region (NULL if not needed)
+    size_t          stride[JPG_MAX_COMPONENTS];     // Bytes between rows of samples of each component
+    uint8_t         size[JPG_MAX_COMPONENTS];       // Width and height of the samples of a block of each component
+    uint8_t         blockSize;          // Width and height of the samples of a block at the decoded size (8, 4, 2 or 1)
+    uint8_t         conversion;         // How rows of samples are converted to pixels (JPG_CONVERT_*, see jpg.c)
+    uint16_t        x;                  // Column of the planes the region starts at
+    uint16_t        y;                  // Row of the image the region starts at (at the decoded size)
+    uint16_t        width;              // Width of the region at the decoded size
+    uint16_t        height;             // Height of the region at the decoded size
+}
+MCUrow;
+
+
+/* Colour spaces of the components of an image */
+
+#define     JPG_COLOR_GRAY      0       /* A single component */
+#define     JPG_COLOR_YCBCR     1       /* Y, Cb and Cr (JFIF) */
+#define     JPG_COLOR_RGB       2       /* Red, green and blue, not transformed (Adobe, or components named R, G and B) */
+#define     JPG_COLOR_CMYK      3       /* Cyan, magenta, yellow and black inks, stored inverted (Adobe) */
+#define     JPG_COLOR_YCCK      4       /* CMYK whose inverted C, M and Y are transformed to Y, Cb and Cr (Adobe) */
+
+
+#define     JPG_IDCT_ACCURATE   0       /* 13-bit integer IDCT, within 1 LSB of a floating point IDCT (default) */
+#define     JPG_IDCT_FAST       1       /* AAN IDCT with 8-bit constants, peak error 2 at quality 75 and 11 at quality 95 (see README) */
+
+
+/* Why an image couldn't be opened or decoded, as returned by jpg_last_error() */
+
+typedef enum
+{
+    JPG_OK = 0,
+    JPG_ERR_OPEN,                   /* The file can't be opened or read */
+    JPG_ERR_MEMORY,                 /* Out of memory */
+    JPG_ERR_NOT_JPEG,               /* The image doesn't start with an SOI marker */
+    JPG_ERR_BAD_MARKER,             /* A segment doesn't start with a marker, or has an invalid length */
+    JPG_ERR_TRUNCATED,              /* The image ends within its headers */
+    JPG_ERR_NO_SCAN,                /* The image has no scan (SOS) */
+    JPG_ERR_BAD_SCAN,               /* The scan header doesn't give each component its Huffman tables */
+    JPG_ERR_UNSUPPORTED_SOF,        /* Extended sequential, progressive or lossless JPEG */
+    JPG_ERR_UNSUPPORTED_SAMPLING,   /* Sampling factors or components the decoder can't handle (or an MCU of more than 10 blocks) */
+    JPG_ERR_BAD_SURFACE,            /* The surface (or region) is invalid */
+    JPG_ERR_STOPPED,                /* Decoding was stopped by the caller's rows() callback */
+    JPG_ERR_BUSY,                   /* The context already holds an open image */
+    JPG_ERR_MEMORY_LIMIT            /* Decoding the image would take more memory than max_memory allows */
+}
+jpg_error_t;
+
+
+/* The library is silent unless given a log callback, which gets messages of
+ * the given level or more severe. Messages aren't even formatted without a
+ * callback, and building with -DJPG_NO_LOG compiles them out altogether */
+
+#define     JPG_LOG_ERROR       0       /* Why an image couldn't be opened or decoded */
+#define     JPG_LOG_WARNING     1       /* Oddities of an image that are worked around */
+#define     JPG_LOG_INFO        2       /* Properties of the image, such as its size and sampling */
+#define     JPG_LOG_DEBUG       3       /* Each segment parsed and each step of decoding */
+
+typedef void (* jpg_log_cb)(void * user, uint8_t level, const char * message);
+
+
+/* Functions the library allocates and frees all of its memory with (see 
+ * jpg_set_allocator) */
+
+typedef struct
+{
+    void    * (* malloc)(void * user, size_t size);
+    void      (* free)(void * user, void * ptr);
+    void      * user;           /* Caller's data, for malloc() and free() */
+}
+jpg_allocator_t;
+
+
+/* A context the memory of images is recycled through (see jpg_context_create) */
+
+typedef struct jpg_context jpg_context_t;
+
+
+/* Options that apply to an image from the time it's opened. A NULL pointer
+ * (or a zero-filled structure) selects the defaults */
+
+typedef struct
+{
+    uint8_t   idct;             /* IDCT used to decode the image (JPG_IDCT_ACCURATE or JPG_IDCT_FAST) */
+    uint16_t  threads;          /* Threads decoding an image with restart intervals in parallel (0 or 1 = the calling thread only) */
+    jpg_log_cb log;             /* Callback messages are logged to (NULL = silent) */
+    void    * log_user;         /* Caller's data, for log() */
+    uint8_t   log_level;        /* Least severe level logged (JPG_LOG_*) */
+    jpg_context_t * context;    /* Context the image is opened in, whose memory it reuses (NULL = the heap) */
+    size_t    max_memory;       /* Most bytes of memory a decode may allocate (0 = no limit) */
+}
+jpg_options_t;
+
+
+typedef struct
+{
+    const uint8_t * data;       /* The JPEG image (caller's buffer, memory mapped file or file loaded into memory) */
+    size_t    size;             /* Size of the JPEG image in bytes */
+    size_t    pos;              /* Offset of the next byte to parse */
+    uint8_t   src;              /* Where 'data' comes from, determines how it is released */
+    uint8_t   idct;             /* IDCT used to decode the image (JPG_IDCT_ACCURATE or JPG_IDCT_FAST) */
+    uint16_t  threads;          /* Threads decoding an image with restart intervals in parallel */
+    jpg_log_cb log;             /* Callback messages are logged to (NULL = silent) */
+    void    * log_user;         /* Caller's data, for log() */
+    uint8_t   log_level;        /* Least severe level logged (JPG_LOG_*) */
+    uint8_t   error;            /* Why the image last failed to decode (jpg_error_t) */
+    void    * tables;           /* Huffman Tables built for the image alone when the table cache is full, freed on jpg_close() */
+    jpg_context_t * context;    /* Context the image was opened in (NULL = the heap) */
+    size_t    max_memory;       /* Most bytes of memory a decode may allocate (0 = no limit) */
+    size_t    peak_memory;      /* Bytes of memory the last decode allocated */
+    void    * usage;            /* Memory allocated by the decode under way, shared with the threads decoding it */
     uint16_t  width;            /* Width of the JPEG image */
     uint16_t  height;           /* Height of the JPEG image */
-    uint16_t  extended_width;   /* Width of the image extended to the nearest 16 byte boundary */
-    uint16_t  extended_height;  /* Height of the image extended to the nearest 16 byte boundary */
+    uint32_t  extended_width;   /* Width of the image extended to a whole number of MCUs */
+    uint32_t  extended_height;  /* Height of the image extended to a whole number of MCUs */
     uint16_t  nc;               /* Number of Components */
-    uint16_t  hsf;              /* Horizontal sampling factor (luminance) */
-    uint16_t  vsf;              /* Vertical sampling factor (luminance) */
+    uint16_t  hsf;              /* Largest horizontal sampling factor, the width of an MCU in blocks */
+    uint16_t  vsf;              /* Largest vertical sampling factor, the height of an MCU in blocks */
+    uint8_t   colorspace;       /* Colour space of the components (JPG_COLOR_*) */
+    uint8_t   adobe;            /* Colour transform of the Adobe (APP14) segment plus 1 (0 = no such segment) */
     struct
     {
         APP0seg     app0;
         SOFseg      sof;
-        DQTseg      dqt[2];
+        DQTseg      dqt[4];
         DHTseg      dht;
         SOSseg      sos;
         DRIseg      dri;
-        Component   Y;
-        Component   Cb;
-        Component   Cr;
+        Component   comp[JPG_MAX_COMPONENTS];   /* Components in the order of the frame header (Y, Cb, Cr and so on) */
+        const HUFFTBL * huffTbl[2][4];  /* Huffman Tables indexed by class (0 = DC, 1 = AC) and identifier, shared through the table cache */
     } seg;
     
     struct
     {
-        uint8_t index;          /* Index of the next bit to read (Note: index of MSBit = 0 and LSBit = 7 (big-endian) */
-        uint8_t _byte;          /* Current byte in the stream */
+        uint64_t  bits;         /* Bits read ahead from the stream, the next bit to read is the MSBit */
+        uint8_t   nbits;        /* Number of valid bits in 'bits' */
+        uint8_t   marker;       /* Second byte of the marker that ended the entropy coded data (0 if none seen yet) */
+        const uint8_t * ptr;    /* Next byte of entropy coded data */
+        const uint8_t * end;    /* End of the JPEG image */
     } stream;
 }
 jpg_t;
 
 
+/* Formats of the pixels of a surface. XRGB pixels are 0x00RRGGBB words, as
+ * they have always been, while the other formats are named after the order
+ * of their bytes in memory (so BGRX and XRGB are alike on little endian 
+ * machines). Each format is written straight by the colour conversion, 
+ * Gray8 is the luma (Y) of the image alone, for which the chroma of YCbCr
+ * images is skipped rather than reconstructed (the luma of RGB and CMYK 
+ * images is computed from their colour) */
+
+#define     JPG_FORMAT_XRGB     0       /* 32-bit 0x00RRGGBB words (default) */
+#define     JPG_FORMAT_BGRX     1       /* Blue, green, red and an unused (zero) byte */
+#define     JPG_FORMAT_RGBA     2       /* Red, green, blue and an opaque alpha (255) byte */
+#define     JPG_FORMAT_RGB24    3       /* Red, green and blue bytes */
+#define     JPG_FORMAT_BGR24    4       /* Blue, green and red bytes */
+#define     JPG_FORMAT_GRAY8    5       /* A byte of luma */
+#define     JPG_FORMATS         6       /* Number of formats */
+
+
+/* Surface an image is decoded into, as pixels of the given format. Rows are
+ * 'pitch' bytes apart (at least width times the size of a pixel, and a 
+ * multiple of 4 for XRGB), so the image can be decoded straight into a part
+ * of a larger buffer, such as a framebuffer or a bitmap with padded rows. 
+ * When the size of the surface differs from that of the image, the image is
+ * scaled to fit. A surface of 1/2, 1/4 or 1/8 the size of the image (or 
+ * less) is decoded at that size in the DCT domain, which is much faster 
+ * than decoding at full size and scaling down.
+ * jpg_read() decodes into an XRGB surface with contiguous rows, and 
+ * jpg_read_format() into a surface of any format with contiguous rows.
+ * jpg_read_region() decodes only the w x h pixels at (x, y) of the image
+ * into the surface (again scaled to fit). Blocks outside the region are
+ * only entropy decoded, and decoding stops below the region, so a small 
+ * crop costs a fraction of decoding the whole image.
+ * All return 0 on success, -1 if the image data (SOS) is missing, -2 if 
+ * the image can't be decoded and -3 if the surface (or region, or format)
+ * is invalid */
+
+typedef struct
+{
+    void     *  pixels;         /* First pixel of the surface */
+    size_t      pitch;          /* Bytes from the start of a row to the start of the next */
+    uint16_t    width;          /* Width of the surface */
+    uint16_t    height;         /* Height of the surface */
+    uint8_t     format;         /* Format of the pixels (JPG_FORMAT_*) */
+}
+jpg_surface_t;
+
+
+/* Planes the components of an image are decoded into by jpg_read_planes(),
+ * each at its own resolution, as reconstructed by the IDCT: no colour 
+ * conversion and no upsampling of chroma. A component sampled Hi x Vi is
+ * ceil(width * Hi / hsf) x ceil(height * Vi / vsf) samples, so the Y plane
+ * is usually width x height samples and the Cb and Cr planes are 4:2:0, 
+ * 4:2:2 or 4:4:4 as the image is sampled. Images of 4 components (CMYK or
+ * YCCK) have a fourth plane. The Cb and Cr planes of a grayscale image are
+ * filled with 128, or left out if NULL */
+
+typedef struct
+{
+    uint8_t   * planes[JPG_MAX_COMPONENTS];     /* Planes of the components, in the order of the frame header (Y, Cb, Cr, K) */
+    size_t      pitch[JPG_MAX_COMPONENTS];      /* Bytes from the start of a row of each plane to the start of the next */
+}
+jpg_planes_t;
+
+
+/* A batch of images is decoded by a pool of threads, an image per thread at
+ * a time. Each item is a JPEG file (or a JPEG image in memory) along with
+ * the surface it's decoded into. An item whose surface has no pixels is 
+ * decoded into a surface the size of the image (in the format of the item's 
+ * surface), which is only valid until done() returns. done() is called from the thread that decoded the item, 
+ * with a NULL surface if the item failed */
+
+typedef struct jpg_batch_item
+{
+    const char    * file;       /* JPEG file to decode, or NULL to decode 'data' */
+    const uint8_t * data;       /* JPEG image in memory (when 'file' is NULL) */
+    size_t          size;       /* Size of the JPEG image in memory */
+    jpg_surface_t   surface;    /* Surface the image is decoded into */
+    void         (* done)(struct jpg_batch_item * item, const jpg_surface_t * surface);
+    void          * user;       /* Caller's data, for done() */
+    int8_t          status;     /* As returned by jpg_read_surface() (-2 also when the surface is over budget), or -4 if the image can't be opened */
+}
+jpg_batch_item_t;
+
+
+/* Rows of pixels handed to the caller as they're decoded by jpg_read_rows().
+ * 'pixels' holds the n rows of the image starting at row y, 'pitch' bytes
+ * apart, and is only valid until the callback returns, which returns 
+ * non-zero to stop decoding */
+
+typedef int (* jpg_rows_cb)(void * user, const uint32_t * pixels, size_t pitch, uint16_t y, uint16_t n);
+
+
+/* What probing an image finds out from its headers */
+
+typedef struct
+{
+    uint64_t  size;             /* Size of the JPEG image in bytes */
+    uint32_t  scan;             /* Offset of the entropy coded data of the first scan */
+    uint16_t  width;            /* Width of the JPEG image */
+    uint16_t  height;           /* Height of the JPEG image */
+    uint16_t  restart;          /* MCUs per restart interval (0 = no restart intervals) */
+    uint8_t   nc;               /* Number of Components */
+    uint8_t   hsf;              /* Horizontal sampling factor (luminance) */
+    uint8_t   vsf;              /* Vertical sampling factor (luminance) */
+    uint8_t   process;          /* Coding process, from the SOF marker (0 = baseline, the only one decoded, 2 = progressive...) */
+}
+jpg_info_t;
+
+
+/* A JPEG image can be opened from a file (which is memory mapped, where 
+ * supported), from an open file descriptor (which is not closed) or from a
+ * memory buffer. A memory buffer is decoded in place, so it must remain 
+ * valid until jpg_close() */
+
 jpg_t  *  jpg_open(const char * JPGfile);
+jpg_t  *  jpg_open_fd(int fd);
+jpg_t  *  jpg_open_mem(const uint8_t * data, size_t size);
+jpg_t  *  jpg_open_ex(const char * JPGfile, const jpg_options_t * options);
+jpg_t  *  jpg_open_fd_ex(int fd, const jpg_options_t * options);
+jpg_t  *  jpg_open_mem_ex(const uint8_t * data, size_t size, const jpg_options_t * options);
 int8_t    jpg_read( uint32_t * surface, uint16_t surface_width, uint16_t surface_height, jpg_t * jpg);
+int8_t    jpg_read_format(void * surface, uint16_t surface_width, uint16_t surface_height, uint8_t format, jpg_t * jpg);
+int8_t    jpg_read_surface(const jpg_surface_t * surface, jpg_t * jpg);
+int8_t    jpg_read_region(const jpg_surface_t * surface, uint16_t x, uint16_t y, uint16_t w, uint16_t h, jpg_t * jpg);
 void      jpg_close(jpg_t * jpg);
 
 
+/* When opening or decoding an image fails, jpg_last_error() tells why, for
+ * the calling thread (it's left as is on success), and jpg_strerror() 
+ * describes an error */
+
+jpg_error_t   jpg_last_error(void);
+const char  * jpg_strerror(jpg_error_t error);
+
+
+/* Names the instruction set the accurate IDCT runs on for this CPU ("avx2",
+ * "sse2" or "c"). The accurate kernels all give the same pixels, but the
+ * SSE2 and C versions of the fast IDCT round slightly differently */
+
+const char  * jpg_kernels(void);
+
+
+/* A context recycles the memory of the images opened in it. The handle and
+ * everything decoding needs (rows of MCUs, bands, the slots of a pipeline)
+ * come from an arena, which grows to the most an image has needed and is 
+ * then reused as is, so decoding image after image (thumbnails, say) no 
+ * longer allocates, frees and faults in memory for each of them. A context
+ * holds one open image at a time: opening another before jpg_close() fails
+ * with JPG_ERR_BUSY. jpg_read_batch() gives each of its threads a context */
+
+jpg_context_t * jpg_context_create(void);
+void            jpg_context_destroy(jpg_context_t * context);
+
+
+/* Replaces malloc() and free() for all of the library's memory (NULL puts
+ * them back). malloc() may be called from several threads at once. Set it
+ * before opening any image, as memory is freed with the allocator in use at
+ * the time. The max_memory option caps what a decode may allocate, beyond
+ * the handle and the surface: decoding fails with JPG_ERR_MEMORY_LIMIT, 
+ * before allocating, once it would take more. A decode allocates planes 
+ * for a row of MCUs per band (or worker), so it grows with the width of the
+ * image rather than its area, except when jpg_read_batch() allocates the 
+ * surface of an item, which counts too. The peak_memory field of the handle
+ * tells how much the last decode allocated */
+
+void            jpg_set_allocator(const jpg_allocator_t * allocator);
+
+
+/* Decodes the n items of a batch on up to 'threads' threads (0 or 1 = the
+ * calling thread only), with the given options. The cost of each item is 
+ * estimated from its size and its number of MCUs, the items are shared out
+ * among the threads most costly first, and a thread that runs out of items
+ * steals them from the others. Returns the number of items that failed */
+
+size_t    jpg_read_batch(jpg_batch_item_t * items, size_t n, uint16_t threads, const jpg_options_t * options);
+
+
+/* Decodes the image a row of MCUs (8 or 16 rows of pixels) at a time, and 
+ * hands each row to rows() in order, from the calling thread. Only a row of
+ * MCUs is held in memory, so memory use grows with the width of the image
+ * rather than its area, and images too large for a surface can be piped 
+ * straight into a writer or a resizer. Returns as jpg_read_region(), or -5
+ * if rows() stopped decoding */
+
+int8_t    jpg_read_rows(jpg_t * jpg, jpg_rows_cb rows, void * user);
+
+
+/* Decodes the image into the planes of its components, at full size. 
+ * Returns as jpg_read_surface(), -3 meaning the planes are invalid */
+
+int8_t    jpg_read_planes(const jpg_planes_t * planes, jpg_t * jpg);
+
+
+/* Probes an image without opening it: only the markers up to the first scan
+ * are read (a few KB of a file, in one or two reads), none of the tables 
+ * are set up and nothing is printed. jpg_probe_batch() probes n files on up
+ * to 'threads' threads, and leaves the info of a file that fails zeroed.
+ * Probing returns 0 on success, -1 if the image ends before its first scan,
+ * -2 if it's not a valid JPEG image and -4 if it can't be opened, while
+ * jpg_probe_batch() returns the number of files that failed */
+
+int8_t    jpg_probe(const char * JPGfile, jpg_info_t * info);
+int8_t    jpg_probe_fd(int fd, jpg_info_t * info);
+int8_t    jpg_probe_mem(const uint8_t * data, size_t size, jpg_info_t * info);
+size_t    jpg_probe_batch(const char * const * files, size_t n, jpg_info_t * infos, uint16_t threads);
+
+
 #endif
@@ -2,31 +2,306 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "jpg.h"
 #include "bmp.c"
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define JPG2BMP_HAVE_DIRS
+#endif
+
+
+/* In batch mode, each JPEG file is converted to a bitmap of the same name,
+ * either next to it or in the output directory. done() is called on the 
+ * thread that decoded the file, so the thread's last error is the file's */
+
+static void writeBitmap(jpg_batch_item_t * item, const jpg_surface_t * surface)
+{
+    if( !surface )
+    {
+        printf("Error: %s: %s\n", item->file, jpg_strerror(jpg_last_error()));
+        return;
+    }
+
+    bmp_write( (char *)item->user, surface->pixels, surface->width, surface->height );
+}
+
+
+// Name of the bitmap a JPEG file is converted to
+static char * bitmapName(const char * file, const char * outdir)
+{
+const char *    base;
+const char *    ext;
+char *          name;
+size_t          len;
+
+
+    base = strrchr(file, '/');
+    base = base ? base + 1 : file;
+    ext  = strrchr(base, '.');
+    ext  = ext ? ext : base + strlen(base);
+
+    if( !outdir )
+    {
+     // Next to the JPEG file
+        len  = ext - file;
+        name = malloc(len + 5);
+        if( name )
+        {
+            memcpy(name, file, len);
+            strcpy(name + len, ".bmp");
+        }
+        return name;
+    }
+
+    len  = strlen(outdir) + 1 + (ext - base);
+    name = malloc(len + 5);
+    if( name )
+    {
+        sprintf(name, "%s/%.*s.bmp", outdir, (int)(ext - base), base);
+    }
+    return name;
+}
+
+
+// Adds a JPEG file to the batch
+static int addFile(jpg_batch_item_t ** items, size_t * n, size_t * capacity, const char * file, const char * outdir)
+{
+jpg_batch_item_t *  grown;
+
+
+    if( *n == *capacity )
+    {
+        *capacity = *capacity ? 2 * *capacity : 64;
+        grown     = realloc(*items, *capacity * sizeof(jpg_batch_item_t));
+        if( !grown )
+            return 0;
+        *items = grown;
+    }
+
+    memset(&(*items)[*n], 0, sizeof(jpg_batch_item_t));
+    (*items)[*n].file = strdup(file);
+    (*items)[*n].user = bitmapName(file, outdir);
+    (*items)[*n].done = writeBitmap;
+
+    if( !(*items)[*n].file || !(*items)[*n].user )
+        return 0;
+
+    (*n)++;
+    return 1;
+}
+
+
+static int compareBitmaps(const void * a, const void * b)
+{
+    return strcmp( (const char *)(*(jpg_batch_item_t * const *)a)->user, (const char *)(*(jpg_batch_item_t * const *)b)->user );
+}
+
+
+/* Files of the same name in different directories (or x.jpg and x.jpeg)
+ * would be converted to the same bitmap, written by different threads at
+ * once. Returns 0, having named them, if any two files are */
+
+static int uniqueBitmaps(jpg_batch_item_t * items, size_t n)
+{
+jpg_batch_item_t ** sorted;
+size_t              i;
+int                 unique = 1;
+
+
+    if( n < 2 )
+        return 1;
+
+    sorted = malloc(n * sizeof(jpg_batch_item_t *));
+    if( !sorted )
+        return 0;
+
+    for( i = 0; i < n; i++ )
+        sorted[i] = &items[i];
+
+    qsort(sorted, n, sizeof(jpg_batch_item_t *), compareBitmaps);
+
+    for( i = 1; i < n; i++ )
+    {
+        if( !strcmp( (const char *)sorted[i - 1]->user, (const char *)sorted[i]->user ) )
+        {
+            printf("Error: %s and %s would both be converted to %s\n", sorted[i - 1]->file, sorted[i]->file,
+                   (const char *)sorted[i]->user);
+            unique = 0;
+        }
+    }
+
+    free(sorted);
+    return unique;
+}
+
+
+#ifdef JPG2BMP_HAVE_DIRS
+
+// Adds the JPEG files (*.jpg or *.jpeg) of a directory to the batch
+static int addDirectory(jpg_batch_item_t ** items, size_t * n, size_t * capacity, const char * dir, const char * outdir)
+{
+DIR *           d;
+struct dirent * entry;
+const char *    ext;
+char *          path;
+int             added = 1;
+
+
+    d = opendir(dir);
+    if( !d )
+        return 0;
+
+    while( added && (entry = readdir(d)) )
+    {
+        ext = strrchr(entry->d_name, '.');
+        if( !ext || (strcasecmp(ext, ".jpg") && strcasecmp(ext, ".jpeg")) )
+            continue;
+
+        path = malloc(strlen(dir) + strlen(entry->d_name) + 2);
+        if( !path )
+        {
+            added = 0;
+            break;
+        }
+
+        sprintf(path, "%s/%s", dir, entry->d_name);
+        added = addFile(items, n, capacity, path, outdir);
+        free(path);
+    }
+
+    closedir(d);
+    return added;
+}
+
+
+static int isDirectory(const char * path)
+{
+struct stat     st;
+
+    return !stat(path, &st) && S_ISDIR(st.st_mode);
+}
+
+#endif
+
+
+static int usage(void)
+{
+    printf("Usage: jpg2bmp <jpgfile>\n");
+    printf("       jpg2bmp [-t threads] [-o directory] <jpgfile | directory>...\n\n");
+    printf("With a single JPEG file, it's converted to output.bmp. Otherwise, each JPEG file\n");
+    printf("(and each *.jpg or *.jpeg file of a directory) is converted to a bitmap of the\n");
+    printf("same name, next to it or in the output directory, on several threads. Files\n");
+    printf("that would be converted to the same bitmap are reported, and nothing is converted\n");
+    return -1;
+}
+
 
 int main(int argc, char *argv[])
 {
-jpg_t *     jpg;
-uint32_t *  buf;
-
-    if( argc != 2 ) {
-      printf("Usage: jpg2bmp <jpgfile>\n");
-      return -1;
-    }
-    
-    jpg = jpg_open(argv[1]);
-    if( jpg == NULL ) {
-      printf("\nError: jpg_open(%s)\n", argv[1]);
-      return 1;
-    }
-    
-    buf = malloc(jpg->width * jpg->height * 4);
-    jpg_read(buf, jpg->width, jpg->height, jpg);
-    bmp_write("output.bmp", buf, jpg->width, jpg->height);
-    jpg_close(jpg);
-    free(buf);
-    
-    return 0;
+jpg_t *             jpg;
+uint32_t *          buf;
+jpg_batch_item_t *  items = NULL;
+size_t              n = 0, capacity = 0;
+size_t              i, failed;
+const char *        outdir = NULL;
+int                 threads = 1;
+int                 arg;
+int                 added = 1;
+
+    if( argc < 2 )
+      return usage();
+
+#ifdef JPG2BMP_HAVE_DIRS
+    if( argc == 2 && argv[1][0] != '-' && !isDirectory(argv[1]) )
+#else
+    if( argc == 2 && argv[1][0] != '-' )
+#endif
+    {
+        jpg = jpg_open(argv[1]);
+        if( jpg == NULL ) {
+          printf("Error: %s: %s\n", argv[1], jpg_strerror(jpg_last_error()));
+          return 1;
+        }
+
+        buf = malloc(jpg->width * jpg->height * 4);
+        if( !buf || jpg_read(buf, jpg->width, jpg->height, jpg) ) {
+          printf("Error: %s: %s\n", argv[1], buf ? jpg_strerror(jpg->error) : "Out of memory");
+          jpg_close(jpg);
+          free(buf);
+          return 1;
+        }
+
+        bmp_write("output.bmp", buf, jpg->width, jpg->height);
+        jpg_close(jpg);
+        free(buf);
+
+        return 0;
+    }
+
+ // Batch mode, on as many threads as there are processors unless told otherwise
+#ifdef JPG2BMP_HAVE_DIRS
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    for( arg = 1; arg < argc; arg++ )
+    {
+        if( !strcmp(argv[arg], "-t") && arg + 1 < argc )
+        {
+            threads = atoi(argv[++arg]);
+        }
+
+        else if( !strcmp(argv[arg], "-o") && arg + 1 < argc )
+        {
+            outdir = argv[++arg];
+        }
+
+        else if( argv[arg][0] == '-' )
+        {
+            return usage();
+        }
+    }
+
+ // The options apply to all the files, wherever they're given
+    for( arg = 1; arg < argc && added; arg++ )
+    {
+        if( !strcmp(argv[arg], "-t") || !strcmp(argv[arg], "-o") )
+        {
+            arg++;
+        }
+
+#ifdef JPG2BMP_HAVE_DIRS
+        else if( isDirectory(argv[arg]) )
+        {
+            added = addDirectory(&items, &n, &capacity, argv[arg], outdir);
+            if( !added )
+                printf("Error: can't read directory %s\n", argv[arg]);
+        }
+#endif
+
+        else
+        {
+            added = addFile(&items, &n, &capacity, argv[arg], outdir);
+        }
+    }
+
+    if( added )
+        added = uniqueBitmaps(items, n);
+
+    failed = added ? jpg_read_batch(items, n, threads > 0 ? threads : 1, NULL) : n;
+
+    printf("Converted %zu of %zu files\n", n - failed, n);
+
+    for( i = 0; i < n; i++ )
+    {
+        free( (char *)items[i].file );
+        free( items[i].user );
+    }
+    free(items);
+
+    return failed ? 1 : 0;
 }
@@ -2,16 +2,25 @@
 #define __JPEGCORE_C
 
 #include "stddef.h"
+#include "stdint.h"
 
-// Integer Transformation of floating point numbers using 8-bit precision
+/* The accurate IDCT uses 13-bit constants. The output of its first pass
+ * keeps 3 extra bits of precision */
 
-#define     C1  251         // 0.98079 * 2E8
-#define     C2  237         // 0.92388 * 2E8
-#define     C3  213         // 0.83147 * 2E8
-#define     C4  181         // 0.70711 * 2E8
-#define     C5  142         // 0.55557 * 2E8
-#define     C6  98          // 0.38268 * 2E8
-#define     C7  50          // 0.19509 * 2E8
+#define     IDCT_CONST_BITS     13
+#define     IDCT_PASS1_BITS     3
+
+#define     K1      8035        // cos(1*pi/16) * 2E13
+#define     K2      7568        // cos(2*pi/16) * 2E13
+#define     K3      6811        // cos(3*pi/16) * 2E13
+#define     K4      5793        // cos(4*pi/16) * 2E13
+#define     K5      4551        // cos(5*pi/16) * 2E13
+#define     K6      3135        // cos(6*pi/16) * 2E13
+#define     K7      1598        // cos(7*pi/16) * 2E13
+
+// The result of each 1-D pass is 2E13 * 2 times the actual 1-D IDCT
+#define     IDCT_PASS1_SHIFT    (IDCT_CONST_BITS + 1 - IDCT_PASS1_BITS)
+#define     IDCT_PASS2_SHIFT    (IDCT_CONST_BITS + 1 + IDCT_PASS1_BITS)
 
 
 uint8_t  deZigZagVector[64] = 
@@ -60,164 +69,435 @@ uint8_t bound(int value)
 }
 
 
-void RowIDCT(int *Row)
+// Saturates to 16-bit, like the packs of the SIMD kernels do between and after the passes
+static inline int saturate16(int value)
 {
-int   Sum[6];
-int   Exp[8];
+    return value > 32767 ? 32767 : value < -32768 ? -32768 : value;
+}
 
 
-    Sum[0] = (int)(C4 * Row[0]) ;
-    Sum[1] = (int)(C4 * Row[4]) ;
-    Sum[2] = (int)(C2 * Row[2]) ;
-    Sum[3] = (int)(C6 * Row[2]) ;
-    Sum[4] = (int)(C2 * Row[6]) ;
-    Sum[5] = (int)(C6 * Row[6]) ;
+/* 1-D IDCT of in[0], in[stride], ... in[7*stride]. The even part (0, 2,
+ * 4, 6) and the odd part (1, 3, 5, 7) are computed separately and then
+ * added/subtracted. 'bias' rounds the result (and level shifts it, in the
+ * second pass) before it is descaled by 'shift' */
+
+static inline void IDCT_1D(const int * in, uint8_t stride, int * out, int shift, int bias)
+{
+int     tmp0, tmp1, tmp2, tmp3;
+int     e0, e1, e2, e3;
+int     o0, o1, o2, o3;
+
+
+    tmp0 = K4 * in[0] + K4 * in[4*stride] + bias;
+    tmp1 = K4 * in[0] - K4 * in[4*stride] + bias;
+    tmp2 = K2 * in[2*stride] + K6 * in[6*stride];
+    tmp3 = K6 * in[2*stride] - K2 * in[6*stride];
     
-    Exp[0] = (int)(Sum[0] + Sum[2] + Sum[1] + Sum[5]) ;
-    Exp[1] = (int)(Sum[0] + Sum[3] - Sum[1] - Sum[4]) ;
-    Exp[2] = (int)(Sum[0] - Sum[3] - Sum[1] + Sum[4]) ;
-    Exp[3] = (int)(Sum[0] - Sum[2] + Sum[1] - Sum[5]) ;
+    e0 = tmp0 + tmp2;
+    e3 = tmp0 - tmp2;
+    e1 = tmp1 + tmp3;
+    e2 = tmp1 - tmp3;
     
-    Exp[4] = (int)(C1 * Row[1] + C3 * Row[3] + C5 * Row[5] + C7 * Row[7]) ;
-    Exp[5] = (int)(C3 * Row[1] - C7 * Row[3] - C1 * Row[5] - C5 * Row[7]) ;
-    Exp[6] = (int)(C5 * Row[1] - C1 * Row[3] + C7 * Row[5] + C3 * Row[7]) ;
-    Exp[7] = (int)(C7 * Row[1] - C5 * Row[3] + C3 * Row[5] - C1 * Row[7]) ;
+    o0 = K1 * in[stride] + K3 * in[3*stride] + K5 * in[5*stride] + K7 * in[7*stride];
+    o1 = K3 * in[stride] - K7 * in[3*stride] - K1 * in[5*stride] - K5 * in[7*stride];
+    o2 = K5 * in[stride] - K1 * in[3*stride] + K7 * in[5*stride] + K3 * in[7*stride];
+    o3 = K7 * in[stride] - K5 * in[3*stride] + K3 * in[5*stride] - K1 * in[7*stride];
+    
+    out[0] = saturate16( (e0 + o0) >> shift );
+    out[7] = saturate16( (e0 - o0) >> shift );
+    out[1] = saturate16( (e1 + o1) >> shift );
+    out[6] = saturate16( (e1 - o1) >> shift );
+    out[2] = saturate16( (e2 + o2) >> shift );
+    out[5] = saturate16( (e2 - o2) >> shift );
+    out[3] = saturate16( (e3 + o3) >> shift );
+    out[4] = saturate16( (e3 - o3) >> shift );
     
-    Row[0] = (int)( (Exp[0] + Exp[4]) >> 1 );
-    Row[1] = (int)( (Exp[1] + Exp[5]) >> 1 );
-    Row[2] = (int)( (Exp[2] + Exp[6]) >> 1 );
-    Row[3] = (int)( (Exp[3] + Exp[7]) >> 1 );
-    Row[4] = (int)( (Exp[3] - Exp[7]) >> 1 );
-    Row[5] = (int)( (Exp[2] - Exp[6]) >> 1 );
-    Row[6] = (int)( (Exp[1] - Exp[5]) >> 1 );
-    Row[7] = (int)( (Exp[0] - Exp[4]) >> 1 );    
-       
 }
 
 
-void ColumnIDCT(int *Column)
+/* The reference (and portable) implementation of the accurate IDCT, which
+ * the SIMD kernels (see jpgSIMD.c) match bit for bit. The decoder works on
+ * blocks of 16-bit coefficients and writes 8-bit samples (rows 'stride'
+ * bytes apart) straight into the planes of each component.
+ * Most of the AC coefficients of a block are zero. When the non-zero
+ * coefficients are confined to the top-left nxn corner of the block, the
+ * remaining columns are zero and remain so after the column transform. 
+ * Hence, only n columns need to be transformed */
+
+static inline void sparseIDCT_reference(const int16_t * coeffTbl, uint8_t * samples, size_t stride, uint8_t n)
 {
-int   Sum[6];
-int   Exp[8];
+int         in[64];
+int         Block8x8[64];
+int         out[8];
+uint8_t     x, y;
 
 
-    Sum[0] = (int)(C4 * Column[0])  ;
-    Sum[1] = (int)(C4 * Column[32]) ;
-    Sum[2] = (int)(C2 * Column[16]) ;
-    Sum[3] = (int)(C6 * Column[16]) ;
-    Sum[4] = (int)(C2 * Column[48]) ;
-    Sum[5] = (int)(C6 * Column[48]) ;
+    for( x = 0; x < 64; x++ )
+    {
+        in[x] = coeffTbl[x];
+    }
     
-    Exp[0] = (int)(Sum[0] + Sum[2] + Sum[1] + Sum[5]) ;
-    Exp[1] = (int)(Sum[0] + Sum[3] - Sum[1] - Sum[4]) ;
-    Exp[2] = (int)(Sum[0] - Sum[3] - Sum[1] + Sum[4]) ;
-    Exp[3] = (int)(Sum[0] - Sum[2] + Sum[1] - Sum[5]) ;
+ // First we perform 1D IDCT on each column, then on each row
+    memset( Block8x8, 0, sizeof(Block8x8) );
     
-    Exp[4] = (int)(C1 * Column[8] + C3 * Column[24] + C5 * Column[40] + C7 * Column[56]) ;
-    Exp[5] = (int)(C3 * Column[8] - C7 * Column[24] - C1 * Column[40] - C5 * Column[56]) ;
-    Exp[6] = (int)(C5 * Column[8] - C1 * Column[24] + C7 * Column[40] + C3 * Column[56]) ;
-    Exp[7] = (int)(C7 * Column[8] - C5 * Column[24] + C3 * Column[40] - C1 * Column[56]) ;
+    for( x = 0; x < n; x++ )
+    {
+        IDCT_1D( in + x, 8, out, IDCT_PASS1_SHIFT, 1 << (IDCT_PASS1_SHIFT - 1) );
+        
+        for( y = 0; y < 8; y++ )
+        {
+            Block8x8[(y << 3) + x] = out[y];
+        }
+    }
     
-    Column[0]  = (int)( (Exp[0] + Exp[4]) >> 1 );
-    Column[8]  = (int)( (Exp[1] + Exp[5]) >> 1 );
-    Column[16] = (int)( (Exp[2] + Exp[6]) >> 1 );
-    Column[24] = (int)( (Exp[3] + Exp[7]) >> 1 );
-    Column[32] = (int)( (Exp[3] - Exp[7]) >> 1 );
-    Column[40] = (int)( (Exp[2] - Exp[6]) >> 1 );
-    Column[48] = (int)( (Exp[1] - Exp[5]) >> 1 );
-    Column[56] = (int)( (Exp[0] - Exp[4]) >> 1 );    
-       
+ // The level shift (+128) is folded into the rounding bias of the second pass
+    for( y = 0; y < 8; y++ )
+    {
+        IDCT_1D( Block8x8 + (y << 3), 1, out, IDCT_PASS2_SHIFT, (1 << (IDCT_PASS2_SHIFT - 1)) + (128 << IDCT_PASS2_SHIFT) );
+        
+        for( x = 0; x < 8; x++ )
+        {
+            samples[y * stride + x] = bound( out[x] );
+        }
+    }
+
+}
+
+
+static void IDCT_reference(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
+{
+    sparseIDCT_reference( coeffTbl, samples, stride, 8 );
 }
 
 
-void performIDCT(int *Block8x8)
+static void IDCT4x4_reference(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
 {
+    sparseIDCT_reference( coeffTbl, samples, stride, 4 );
+}
+
+
+static void IDCT2x2_reference(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
+{
+    sparseIDCT_reference( coeffTbl, samples, stride, 2 );
+}
+
+
+// A block with only a DC coefficient is flat, this is the value IDCT_reference() gives it
+static uint8_t DC_reference(int16_t coeff)
+{
+int     value;
+
+
+    value = saturate16( ( coeff * K4 + (1 << (IDCT_PASS1_SHIFT - 1)) ) >> IDCT_PASS1_SHIFT );
+    value = ( value * K4 + (1 << (IDCT_PASS2_SHIFT - 1)) + (128 << IDCT_PASS2_SHIFT) ) >> IDCT_PASS2_SHIFT;
+    
+    return bound( value );
+}
+
+
+/* Fast IDCT, based on the AAN (Arai, Agui and Nakajima) factorization of
+ * the DCT. Most of the multiplications of the AAN algorithm are scale
+ * factors applied to each coefficient, so they are folded into the 
+ * dequantization tables (see AANscale and setupDequantTbl() in jpg.c).
+ * That leaves only 5 multiplications per 1-D IDCT, at the cost of some 
+ * accuracy (8-bit constants). The coefficients are expected to be scaled
+ * by AANscale[] and 2E2 */
+
+#define     AAN_SCALE_BITS      2           // Extra bits of precision carried by the prescaled coefficients
+
+#define     F_1_082             277         // 1.082392200 * 2E8
+#define     F_1_414             362         // 1.414213562 * 2E8
+#define     F_1_847             473         // 1.847759065 * 2E8
+#define     F_2_613             669         // 2.613125930 * 2E8
+
+#define     AAN_MULTIPLY(v, c)  ( ( (v) * (c) + 128 ) >> 8 )
+
+
+// AAN scale factors (2E14 * s(u) * s(v), where s(0) = 1 and s(k) = sqrt(2) * cos(k*pi/16))
+uint16_t  AANscale[64] =
+{
+    16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+    22725, 31521, 29692, 26722, 22725, 17855, 12299,  6270,
+    21407, 29692, 27969, 25172, 21407, 16819, 11585,  5906,
+    19266, 26722, 25172, 22654, 19266, 15137, 10426,  5315,
+    16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+    12873, 17855, 16819, 15137, 12873, 10114,  6967,  3552,
+     8867, 12299, 11585, 10426,  8867,  6967,  4799,  2446,
+     4520,  6270,  5906,  5315,  4520,  3552,  2446,  1247
+};
+
+
+static inline void FastIDCT(int * Vector, uint8_t stride)
+{
+int   tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+int   tmp10, tmp11, tmp12, tmp13;
+int   z5, z10, z11, z12, z13;
+
+
+ // Even part
+    tmp10 = Vector[0] + Vector[4*stride];
+    tmp11 = Vector[0] - Vector[4*stride];
+    tmp13 = Vector[2*stride] + Vector[6*stride];
+    tmp12 = AAN_MULTIPLY( Vector[2*stride] - Vector[6*stride], F_1_414 ) - tmp13;
+    
+    tmp0  = tmp10 + tmp13;
+    tmp3  = tmp10 - tmp13;
+    tmp1  = tmp11 + tmp12;
+    tmp2  = tmp11 - tmp12;
+    
+ // Odd part
+    z13   = Vector[5*stride] + Vector[3*stride];
+    z10   = Vector[5*stride] - Vector[3*stride];
+    z11   = Vector[1*stride] + Vector[7*stride];
+    z12   = Vector[1*stride] - Vector[7*stride];
+    
+    tmp7  = z11 + z13;
+    tmp11 = AAN_MULTIPLY( z11 - z13, F_1_414 );
+    z5    = AAN_MULTIPLY( z10 + z12, F_1_847 );
+    tmp10 = AAN_MULTIPLY( z12, F_1_082 ) - z5;
+    tmp12 = z5 - AAN_MULTIPLY( z10, F_2_613 );
+    
+    tmp6  = tmp12 - tmp7;
+    tmp5  = tmp11 - tmp6;
+    tmp4  = tmp10 + tmp5;
+    
+    Vector[0]        = tmp0 + tmp7;
+    Vector[7*stride] = tmp0 - tmp7;
+    Vector[1*stride] = tmp1 + tmp6;
+    Vector[6*stride] = tmp1 - tmp6;
+    Vector[2*stride] = tmp2 + tmp5;
+    Vector[5*stride] = tmp2 - tmp5;
+    Vector[4*stride] = tmp3 + tmp4;
+    Vector[3*stride] = tmp3 - tmp4;
+    
+}
+
+
+// Only the first n columns of the block may have non-zero coefficients
+static inline void sparseFastIDCT(const int16_t * coeffTbl, uint8_t * samples, size_t stride, uint8_t n)
+{
+int         Block8x8[64];
 uint8_t     i;
 
- // First we perform 1D IDCT on each rows of a 8x8 block
-    for( i = 0; i < 8; i++ )
+
+    for( i = 0; i < 64; i++ )
+    {
+        Block8x8[i] = coeffTbl[i];
+    }
+    
+ // First we perform 1D IDCT on each column, then on each row 
+    for( i = 0; i < n; i++ )
     {
-        RowIDCT( Block8x8 + (i << 3) );
+        FastIDCT( Block8x8 + i, 8 );
     }
     
- // Then, we perform 1D IDCT on each column of the row transformed block
     for( i = 0; i < 8; i++ )
     {
-        ColumnIDCT( Block8x8 + i );
+        FastIDCT( Block8x8 + (i << 3), 1 );
     }
     
-    for (i = 0; i < 64; i++ )
+ // Remove the extra precision (and the factor of 8 of the 2D IDCT) and level shift
+    for( i = 0; i < 64; i++ )
     {
-        Block8x8[i] >>= 16;
-        Block8x8[i]  += 128;
+        samples[(i >> 3) * stride + (i & 7)] = bound( ( (Block8x8[i] + (1 << (AAN_SCALE_BITS + 2))) >> (AAN_SCALE_BITS + 3) ) + 128 );
     }
 
 }
 
 
-/* To improve decoding performance, it is desirable to have different
- * YCbCr to XRGB transformation routines for different Sampling factors.
- * The key advantage of this is that each routine can be distinctly
- * optimized */
- 
-void Y4Cb1Cr1toXRGB(uint32_t * XRGB8x8Block, int * YBlock, int * CbBlock, int * CrBlock)
+static void performFastIDCT(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
 {
-uint8_t     red, green, blue;
+    sparseFastIDCT( coeffTbl, samples, stride, 8 );
+}
+
+
+static void FastIDCT4x4(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
+{
+    sparseFastIDCT( coeffTbl, samples, stride, 4 );
+}
+
+
+static void FastIDCT2x2(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
+{
+    sparseFastIDCT( coeffTbl, samples, stride, 2 );
+}
+
+
+// A DC coefficient goes through both passes of the AAN IDCT unchanged
+static uint8_t FastDC(int16_t coeff)
+{
+    return bound( ( (coeff + (1 << (AAN_SCALE_BITS + 2))) >> (AAN_SCALE_BITS + 3) ) + 128 );
+}
+
+
+/* Reduced size IDCT. To decode an image at 1/2, 1/4 or 1/8 of its size,
+ * each block is transformed straight into 4x4, 2x2 or 1x1 samples by the
+ * 4-point or 2-point IDCT of its lowest frequencies (the higher ones can't
+ * be represented at the reduced size). At 1/8, only the DC coefficient is
+ * left. Just like the 8-point IDCT, the 2D result is 1/4 of the products
+ * of the 1-D transforms, which use the 13-bit constants K1 - K7 */
+
+#define     REDUCED_PASS1_SHIFT     (IDCT_CONST_BITS - IDCT_PASS1_BITS)
+#define     REDUCED_PASS2_SHIFT     (IDCT_CONST_BITS + IDCT_PASS1_BITS + 2)
+
+#define     REDUCED_DESCALE1(v)     ( ( (v) + (1 << (REDUCED_PASS1_SHIFT - 1)) ) >> REDUCED_PASS1_SHIFT )
+#define     REDUCED_DESCALE2(v)     bound( ( (v) + (1 << (REDUCED_PASS2_SHIFT - 1)) + (128 << REDUCED_PASS2_SHIFT) ) >> REDUCED_PASS2_SHIFT )
+
+
+// 4-point IDCT of in[0], in[stride], in[2*stride] and in[3*stride]
+static inline void reducedIDCT4_1D(const int * in, uint8_t stride, int * out)
+{
+int     e0, e1, o0, o1;
+
+
+ // The cos(pi/4) of the DC coefficient and that of the 2nd coefficient coincide
+    e0 = K4 * ( in[0] + in[2*stride] );
+    e1 = K4 * ( in[0] - in[2*stride] );
+    
+    o0 = K2 * in[stride] + K6 * in[3*stride];
+    o1 = K6 * in[stride] - K2 * in[3*stride];
+    
+    out[0] = e0 + o0;
+    out[3] = e0 - o0;
+    out[1] = e1 + o1;
+    out[2] = e1 - o1;
+    
+}
+
+
+static void reducedIDCT4(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
+{
+int         in[32];
+int         Block4x4[16];
+int         out[4];
 uint8_t     x, y;
-uint8_t     i, j;
-short       Y, Cb_, Cr_;
-short       Exp1, Exp2, Exp3;
 
 
-    for( y = 0, i = 0; y < 8; y++ )
+    for( y = 0; y < 4; y++ )
     {
-        for( x = 0, j = ( y & 0x06 ) << 2; x < 4; x++, j++ )
+        for( x = 0; x < 8; x++ )
         {
-         // Y is sampled every 1x1 pixel, Cb and Cr is sampled every 2x2 pixels
-         
-            Y       =   YBlock[i];
-            Cb_     =   CbBlock[j] - 128 ;
-            Cr_     =   CrBlock[j] - 128;
-            
-            Exp1    =   45 * Cr_ / 32;
-            Exp2    =   (11  * Cb_ + 23 * Cr_) / 32; 
-            Exp3    =   113 * Cb_ / 64;
-
-            red     = bound(Y + Exp1);
-            green   = bound(Y - Exp2);
-            blue    = bound(Y + Exp3);
-            
-            XRGB8x8Block[i++] = (red << 16) + (green << 8) + blue;
-            
-            Y       = YBlock[i];
-               
-            red     = bound(Y + Exp1);
-            green   = bound(Y - Exp2);
-            blue    = bound(Y + Exp3);
-            
-            XRGB8x8Block[i++] = (red << 16) + (green << 8) + blue;
+            in[(y << 3) + x] = coeffTbl[(y << 3) + x];
+        }
+    }
+    
+ // First on the columns of the lowest 4x4 frequencies, then on the rows
+    for( x = 0; x < 4; x++ )
+    {
+        reducedIDCT4_1D( in + x, 8, out );
+        
+        for( y = 0; y < 4; y++ )
+        {
+            Block4x4[(y << 2) + x] = REDUCED_DESCALE1( out[y] );
+        }
+    }
+    
+    for( y = 0; y < 4; y++ )
+    {
+        reducedIDCT4_1D( Block4x4 + (y << 2), 1, out );
+        
+        for( x = 0; x < 4; x++ )
+        {
+            samples[y * stride + x] = REDUCED_DESCALE2( out[x] );
         }
     }
 
 }
 
 
-void Y2Cb1Cr1toXRGB(uint32_t * XRGB8x8Block, int * YBlock, int * CbBlock, int * CrBlock)
+static void reducedIDCT2(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
+{
+int     Block2x2[4];
+uint8_t x, y;
+
+
+ // The 2-point IDCT is just the sum and the difference, times cos(pi/4)
+    for( x = 0; x < 2; x++ )
+    {
+        Block2x2[x]     = REDUCED_DESCALE1( K4 * (coeffTbl[x] + coeffTbl[8 + x]) );
+        Block2x2[2 + x] = REDUCED_DESCALE1( K4 * (coeffTbl[x] - coeffTbl[8 + x]) );
+    }
+    
+    for( y = 0; y < 2; y++ )
+    {
+        samples[y * stride]     = REDUCED_DESCALE2( K4 * (Block2x2[y << 1] + Block2x2[(y << 1) + 1]) );
+        samples[y * stride + 1] = REDUCED_DESCALE2( K4 * (Block2x2[y << 1] - Block2x2[(y << 1) + 1]) );
+    }
+
+}
+
+
+// The sample value of a DC only block, which is also what reducedIDCT4() and reducedIDCT2() give it 
+static uint8_t reducedDC(int16_t coeff)
+{
+    return REDUCED_DESCALE2( K4 * REDUCED_DESCALE1( K4 * coeff ) );
+}
+
+
+static void reducedIDCT1(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
+{
+    (void)stride;
+    samples[0] = reducedDC( coeffTbl[0] );
+}
+
+
+/* To improve decoding performance, it is desirable to have different
+ * YCbCr to RGB transformation routines for different Sampling factors.
+ * The key advantage of this is that each routine can be distinctly
+ * optimized. Each routine converts a row of n pixels, whose Cb and Cr 
+ * samples are either sampled every pixel (1x1) or every other pixel (2x1).
+ * Vertical subsampling is just a matter of which row of Cb and Cr samples
+ * is passed. The routines are written once for all the formats of pixels,
+ * and stamped out for each format (the format being a constant, the 
+ * compiler keeps only the stores of that format). These are the reference
+ * implementations, the SIMD kernels (jpgSIMD.c) reproduce their results
+ * exactly */
+
+static inline __attribute__((always_inline)) uint8_t * storePixel(uint8_t * dest, uint8_t format, uint8_t red, uint8_t green, uint8_t blue)
+{
+uint32_t    XRGB;
+
+
+    switch( format )
+    {
+        case JPG_FORMAT_XRGB:
+            XRGB = (red << 16) + (green << 8) + blue;
+            memcpy( dest, &XRGB, 4 );
+            return dest + 4;
+        
+        case JPG_FORMAT_BGRX:
+            dest[0] = blue;  dest[1] = green;  dest[2] = red;   dest[3] = 0;
+            return dest + 4;
+        
+        case JPG_FORMAT_RGBA:
+            dest[0] = red;   dest[1] = green;  dest[2] = blue;  dest[3] = 255;
+            return dest + 4;
+        
+        case JPG_FORMAT_RGB24:
+            dest[0] = red;   dest[1] = green;  dest[2] = blue;
+            return dest + 3;
+        
+        default:
+            dest[0] = blue;  dest[1] = green;  dest[2] = red;
+            return dest + 3;
+    }
+}
+
+
+static inline __attribute__((always_inline)) void YCbCr11row(uint8_t * dest, const uint8_t * Yrow, const uint8_t * Cbrow, const uint8_t * Crrow, uint16_t n, uint8_t format)
 {
 uint8_t     red, green, blue;
-uint8_t     i, j;
+uint16_t    i;
 short       Y, Cb_, Cr_;
 short       Exp1, Exp2, Exp3;
 
 
-    for( i = 0, j = 0; i < 64; j++ )
+    for( i = 0; i < n; i++ )
     { 
-     // Y is sampled every 2x1 pixels, Cb and Cr are sampled every 1x1 pixel
-      
-        Y       =   YBlock[i];
-        Cb_     =   CbBlock[j] - 128;
-        Cr_     =   CrBlock[j] - 128;
-        
+        Y       =   Yrow[i];
+        Cb_     =   Cbrow[i] - 128;
+        Cr_     =   Crrow[i] - 128;
+           
         Exp1    =   45 * Cr_ / 32;
         Exp2    =   (11  * Cb_ + 23 * Cr_) / 32; 
         Exp3    =   113 * Cb_ / 64;
@@ -226,45 +506,280 @@ short       Exp1, Exp2, Exp3;
         green   = bound(Y - Exp2);
         blue    = bound(Y + Exp3);
             
-        XRGB8x8Block[i++] = (red << 16) + (green << 8) + blue;
-        
-        Y       =   YBlock[i];
-           
-        red     = bound(Y + Exp1);
-        green   = bound(Y - Exp2);
-        blue    = bound(Y + Exp3);
-            
-        XRGB8x8Block[i++] = (red << 16) + (green << 8) + blue;
+        dest    = storePixel( dest, format, red, green, blue );
     }
 
 }
 
 
-void Y1Cb1Cr1toXRGB(uint32_t * XRGB8x8Block, int * YBlock, int * CbBlock, int * CrBlock)
+static inline __attribute__((always_inline)) void YCbCr21row(uint8_t * dest, const uint8_t * Yrow, const uint8_t * Cbrow, const uint8_t * Crrow, uint16_t n, uint8_t format)
 {
 uint8_t     red, green, blue;
-uint8_t     i;
+uint16_t    i;
 short       Y, Cb_, Cr_;
-short       Exp1, Exp2, Exp3;
+short       Exp1 = 0, Exp2 = 0, Exp3 = 0;
 
 
-    for( i = 0; i < 64; i++ )
+    for( i = 0; i < n; i++ )
     { 
-     // Each of Y, Cb and Cr are sampled over 1x1 pixel
-      
-        Y       =   YBlock[i];
-        Cb_     =   CbBlock[i] - 128 ;
-        Cr_     =   CrBlock[i] - 128;
-           
-        Exp1    =   45 * Cr_ / 32;
-        Exp2    =   (11  * Cb_ + 23 * Cr_) / 32; 
-        Exp3    =   113 * Cb_ / 64;
+     // Each pair of pixels shares the same Cb and Cr
+        if( !(i & 1) )
+        {
+            Cb_     =   Cbrow[i >> 1] - 128;
+            Cr_     =   Crrow[i >> 1] - 128;
+            
+            Exp1    =   45 * Cr_ / 32;
+            Exp2    =   (11  * Cb_ + 23 * Cr_) / 32; 
+            Exp3    =   113 * Cb_ / 64;
+        }
+        
+        Y       =   Yrow[i];
 
         red     = bound(Y + Exp1);
         green   = bound(Y - Exp2);
         blue    = bound(Y + Exp3);
             
-        XRGB8x8Block[i] = (red << 16) + (green << 8) + blue;
+        dest    = storePixel( dest, format, red, green, blue );
+    }
+
+}
+
+
+/* Grayscale images have no chroma to convert: each pixel is its luma, 
+ * replicated into the red, green and blue of the format. This is what the
+ * YCbCr routines give with neutral chroma, without the arithmetic */
+
+static inline __attribute__((always_inline)) void Grayrow(uint8_t * dest, const uint8_t * Yrow, uint16_t n, uint8_t format)
+{
+uint16_t    i;
+
+
+    for( i = 0; i < n; i++ )
+    {
+        dest = storePixel( dest, format, Yrow[i], Yrow[i], Yrow[i] );
+    }
+}
+
+
+#define     COLOUR_ROUTINES(name, format)                                                                                   \
+static void YCbCr11to##name##row(void * dest, const uint8_t * Yrow, const uint8_t * Cbrow, const uint8_t * Crrow, uint16_t n)  \
+{                                                                                                                           \
+    YCbCr11row( (uint8_t *)dest, Yrow, Cbrow, Crrow, n, format );                                                           \
+}                                                                                                                           \
+static void YCbCr21to##name##row(void * dest, const uint8_t * Yrow, const uint8_t * Cbrow, const uint8_t * Crrow, uint16_t n)  \
+{                                                                                                                           \
+    YCbCr21row( (uint8_t *)dest, Yrow, Cbrow, Crrow, n, format );                                                           \
+}                                                                                                                           \
+static void Grayto##name##row(void * dest, const uint8_t * Yrow, uint16_t n)                                                \
+{                                                                                                                           \
+    Grayrow( (uint8_t *)dest, Yrow, n, format );                                                                            \
+}
+
+COLOUR_ROUTINES(XRGB,  JPG_FORMAT_XRGB)
+COLOUR_ROUTINES(BGRX,  JPG_FORMAT_BGRX)
+COLOUR_ROUTINES(RGBA,  JPG_FORMAT_RGBA)
+COLOUR_ROUTINES(RGB24, JPG_FORMAT_RGB24)
+COLOUR_ROUTINES(BGR24, JPG_FORMAT_BGR24)
+
+
+// Gray pixels are the luma of the image, whatever the sampling of chroma
+static void YtoGray8row(void * dest, const uint8_t * Yrow, const uint8_t * Cbrow, const uint8_t * Crrow, uint16_t n)
+{
+    (void)Cbrow;
+    (void)Crrow;
+    memcpy( dest, Yrow, n );
+}
+
+
+// Gray pixels of a grayscale image are the clamped output of the IDCT as is
+static void GraytoGray8row(void * dest, const uint8_t * Yrow, uint16_t n)
+{
+    memcpy( dest, Yrow, n );
+}
+
+
+/* Images that aren't YCbCr (RGB, and the CMYK and YCCK of Adobe) are rare
+ * enough to be converted a pixel at a time by the one C routine, whatever
+ * the format. Adobe stores the inks inverted, so that a channel times K 
+ * gives the colour (YCCK being the transform of the uninverted C, M and Y).
+ * Gray pixels of such images are their luma */
+
+static void convertOtherRow(void * dest, const uint8_t * const * rows, uint16_t n, uint8_t colorspace, uint8_t format)
+{
+uint8_t   * pixels = (uint8_t *)dest;
+uint8_t     red, green, blue;
+uint16_t    i;
+short       Y, Cb_, Cr_;
+
+
+    for( i = 0; i < n; i++ )
+    {
+        if( colorspace == JPG_COLOR_YCCK )
+        {
+            Y       =   rows[0][i];
+            Cb_     =   rows[1][i] - 128;
+            Cr_     =   rows[2][i] - 128;
+            
+            red     =   255 - bound(Y + 45 * Cr_ / 32);
+            green   =   255 - bound(Y - (11 * Cb_ + 23 * Cr_) / 32);
+            blue    =   255 - bound(Y + 113 * Cb_ / 64);
+        }
+        
+        else
+        {
+            red     =   rows[0][i];
+            green   =   rows[1][i];
+            blue    =   rows[2][i];
+        }
+        
+        if( colorspace != JPG_COLOR_RGB )
+        {
+            red     =   (red   * rows[3][i] + 127) / 255;
+            green   =   (green * rows[3][i] + 127) / 255;
+            blue    =   (blue  * rows[3][i] + 127) / 255;
+        }
+        
+        if( format == JPG_FORMAT_GRAY8 )
+            *pixels++ = (77 * red + 150 * green + 29 * blue + 128) >> 8;
+        else
+            pixels = storePixel( pixels, format, red, green, blue );
+    }
+}
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(JPG_NO_SIMD)
+#define     JPG_SIMD_X86
+#include    "jpgSIMD.c"
+#endif
+
+
+/* Each IDCT comes with kernels for sparse blocks, all of which give the
+ * same result as the full 8x8 kernel for such blocks. The reduced size
+ * IDCTs only look at the lowest frequencies anyway */
+
+typedef struct
+{
+    uint8_t     size;                                               // Size of the blocks of samples (8, or 4, 2, 1 for the reduced size IDCTs)
+    uint8_t  (* DC)(int16_t coeff);                                 // Sample value of a DC only block
+    void     (* IDCT2x2)(const int16_t * coeffTbl, uint8_t * samples, size_t stride);
+    void     (* IDCT4x4)(const int16_t * coeffTbl, uint8_t * samples, size_t stride);
+    void     (* IDCT8x8)(const int16_t * coeffTbl, uint8_t * samples, size_t stride);
+} IDCTkernels;
+
+
+// Kernels used by the decoder, selected by initCore() according to the CPU
+static IDCTkernels IDCT      = { 8, DC_reference, IDCT2x2_reference, IDCT4x4_reference, IDCT_reference  };
+static IDCTkernels IDCT_FAST = { 8, FastDC,       FastIDCT2x2,       FastIDCT4x4,       performFastIDCT };
+
+// Indexed by the scale of the image (1/2, 1/4, 1/8) minus 1
+static const IDCTkernels IDCT_REDUCED[3] =
+{
+    { 4, reducedDC, reducedIDCT4, reducedIDCT4, reducedIDCT4 },
+    { 2, reducedDC, reducedIDCT2, reducedIDCT2, reducedIDCT2 },
+    { 1, reducedDC, reducedIDCT1, reducedIDCT1, reducedIDCT1 }
+};
+
+/* The colour conversion routines of each format of pixels, indexed by the
+ * format (JPG_FORMAT_*) */
+
+typedef struct
+{
+    uint8_t     size;                                               // Bytes per pixel
+    void     (* row11)(void * dest, const uint8_t * Yrow, const uint8_t * Cbrow, const uint8_t * Crrow, uint16_t n);
+    void     (* row21)(void * dest, const uint8_t * Yrow, const uint8_t * Cbrow, const uint8_t * Crrow, uint16_t n);
+    void     (* gray)(void * dest, const uint8_t * Yrow, uint16_t n);     // Rows of grayscale images
+} PixelFormat;
+
+
+// Routines used by the decoder, selected by initCore() according to the CPU
+static PixelFormat FORMATS[JPG_FORMATS] =
+{
+    { 4, YCbCr11toXRGBrow,  YCbCr21toXRGBrow,  GraytoXRGBrow  },
+    { 4, YCbCr11toBGRXrow,  YCbCr21toBGRXrow,  GraytoBGRXrow  },
+    { 4, YCbCr11toRGBArow,  YCbCr21toRGBArow,  GraytoRGBArow  },
+    { 3, YCbCr11toRGB24row, YCbCr21toRGB24row, GraytoRGB24row },
+    { 3, YCbCr11toBGR24row, YCbCr21toBGR24row, GraytoBGR24row },
+    { 1, YtoGray8row,       YtoGray8row,       GraytoGray8row }
+};
+
+// Instruction set of the accurate IDCT, as reported by jpg_kernels()
+static const char * kernelsName = "c";
+
+
+static void initCore(void)
+{
+#ifdef JPG_SIMD_X86
+    __builtin_cpu_init();
+    
+    if( __builtin_cpu_supports("avx2") )
+    {
+        IDCT = (IDCTkernels){ 8, DC_reference, IDCT2x2_AVX2, IDCT4x4_AVX2, IDCT_AVX2 };
+        kernelsName = "avx2";
+    }
+    
+    else if( __builtin_cpu_supports("sse2") )
+    {
+        IDCT = (IDCTkernels){ 8, DC_reference, IDCT2x2_SSE2, IDCT4x4_SSE2, IDCT_SSE2 };
+        kernelsName = "sse2";
+    }
+    
+    if( __builtin_cpu_supports("sse2") )
+    {
+        IDCT_FAST = (IDCTkernels){ 8, FastDC_SSE2, FastIDCT2x2_SSE2, FastIDCT4x4_SSE2, FastIDCT_SSE2 };
+        FORMATS[JPG_FORMAT_XRGB]  = (PixelFormat){ 4, YCbCr11toXRGBrow_SSE2,  YCbCr21toXRGBrow_SSE2,  GraytoXRGBrow_SSE2  };
+        FORMATS[JPG_FORMAT_BGRX]  = (PixelFormat){ 4, YCbCr11toBGRXrow_SSE2,  YCbCr21toBGRXrow_SSE2,  GraytoBGRXrow_SSE2  };
+        FORMATS[JPG_FORMAT_RGBA]  = (PixelFormat){ 4, YCbCr11toRGBArow_SSE2,  YCbCr21toRGBArow_SSE2,  GraytoRGBArow_SSE2  };
+        FORMATS[JPG_FORMAT_RGB24] = (PixelFormat){ 3, YCbCr11toRGB24row_SSE2, YCbCr21toRGB24row_SSE2, GraytoRGB24row_SSE2 };
+        FORMATS[JPG_FORMAT_BGR24] = (PixelFormat){ 3, YCbCr11toBGR24row_SSE2, YCbCr21toBGR24row_SSE2, GraytoBGR24row_SSE2 };
+    }
+#endif
+}
+
+
+/* Transforms a block of coefficients, given the zigzag index of its last 
+ * non-zero coefficient, using the cheapest kernel that covers it. Rows of
+ * samples are written 'stride' bytes apart. The coefficients are then 
+ * reset to zero, so that the next block only has to write its non-zero
+ * coefficients. In zigzag order, indices 0-2 lie in the top-left 2x2 
+ * corner and indices 0-9 lie in the top-left 4x4 corner */
+
+static inline void reconstructBlock(const IDCTkernels * kernels, int16_t * coeffTbl, uint8_t last, uint8_t * samples, size_t stride)
+{
+uint8_t     i;
+uint8_t     value;
+
+
+    if( last == 0 )
+    {
+        value = kernels->DC( coeffTbl[0] );
+        
+        for( i = 0; i < kernels->size; i++ )
+        {
+            memset( samples + i * stride, value, kernels->size );
+        }
+        coeffTbl[0] = 0;
+    }
+    
+    else if( last <= 2 )
+    {
+        kernels->IDCT2x2( coeffTbl, samples, stride );
+        coeffTbl[0] = coeffTbl[1] = coeffTbl[8] = 0;
+    }
+    
+    else if( last <= 9 )
+    {
+        kernels->IDCT4x4( coeffTbl, samples, stride );
+        
+        for( i = 0; i < 32; i += 8 )
+        {
+            memset( coeffTbl + i, 0, 4 * sizeof(int16_t) );
+        }
+    }
+    
+    else
+    {
+        kernels->IDCT8x8( coeffTbl, samples, stride );
+        memset( coeffTbl, 0, 64 * sizeof(int16_t) );
     }
 
 }
@@ -0,0 +1,677 @@
+#ifndef __JPEGSIMD_C
+#define __JPEGSIMD_C
+
+/* x86 SIMD kernels. Each kernel is compiled for its own instruction set
+ * (using GCC's target attribute), so the library as a whole still runs on
+ * any x86 CPU; initCore() picks the best kernels the CPU supports */
+
+#include <immintrin.h>
+
+#define     __SSE2__FN      static inline __attribute__((target("sse2"), always_inline))
+#define     __AVX2__FN      static inline __attribute__((target("avx2"), always_inline))
+
+
+/* The SIMD IDCT does the same arithmetic as IDCT_reference() (see
+ * jpgCore.c), 8 columns or rows at a time: it multiplies pairs of 16-bit
+ * coefficients at once (pmaddwd) into 32-bit sums. The output of the first
+ * pass is kept with 3 extra bits of precision and the output of the second
+ * pass is level shifted and clamped to 8-bit */
+
+// Pair of constants to multiply the interleaved coefficients (a, b) with: a * c0 + b * c1
+#define     PAIR(c0, c1)        ( (int)( (uint16_t)(int16_t)(c0) | ( (uint32_t)(uint16_t)(int16_t)(c1) << 16 ) ) )
+
+
+__SSE2__FN void transpose8x8_SSE2(__m128i * r)
+{
+__m128i     a0, a1, a2, a3, a4, a5, a6, a7;
+__m128i     b0, b1, b2, b3, b4, b5, b6, b7;
+
+
+    a0 = _mm_unpacklo_epi16(r[0], r[1]);
+    a1 = _mm_unpackhi_epi16(r[0], r[1]);
+    a2 = _mm_unpacklo_epi16(r[2], r[3]);
+    a3 = _mm_unpackhi_epi16(r[2], r[3]);
+    a4 = _mm_unpacklo_epi16(r[4], r[5]);
+    a5 = _mm_unpackhi_epi16(r[4], r[5]);
+    a6 = _mm_unpacklo_epi16(r[6], r[7]);
+    a7 = _mm_unpackhi_epi16(r[6], r[7]);
+
+    b0 = _mm_unpacklo_epi32(a0, a2);
+    b1 = _mm_unpackhi_epi32(a0, a2);
+    b2 = _mm_unpacklo_epi32(a1, a3);
+    b3 = _mm_unpackhi_epi32(a1, a3);
+    b4 = _mm_unpacklo_epi32(a4, a6);
+    b5 = _mm_unpackhi_epi32(a4, a6);
+    b6 = _mm_unpacklo_epi32(a5, a7);
+    b7 = _mm_unpackhi_epi32(a5, a7);
+
+    r[0] = _mm_unpacklo_epi64(b0, b4);
+    r[1] = _mm_unpackhi_epi64(b0, b4);
+    r[2] = _mm_unpacklo_epi64(b1, b5);
+    r[3] = _mm_unpackhi_epi64(b1, b5);
+    r[4] = _mm_unpacklo_epi64(b2, b6);
+    r[5] = _mm_unpackhi_epi64(b2, b6);
+    r[6] = _mm_unpacklo_epi64(b3, b7);
+    r[7] = _mm_unpackhi_epi64(b3, b7);
+
+}
+
+
+// Clamps the 8 rows of 16-bit samples to 8-bit (two rows at a time) and stores them 'stride' bytes apart
+__SSE2__FN void storeRows_SSE2(uint8_t * samples, size_t stride, const __m128i * r)
+{
+__m128i     p;
+uint8_t     i;
+
+
+    for( i = 0; i < 8; i += 2, samples += stride << 1 )
+    {
+        p = _mm_packus_epi16(r[i], r[i+1]);
+        
+        _mm_storel_epi64( (__m128i *)samples, p );
+        _mm_storel_epi64( (__m128i *)(samples + stride), _mm_unpackhi_epi64(p, p) );
+    }
+
+}
+
+
+/* 1-D IDCT of the 8 columns held in r[0..7] (one lane per column). Just
+ * like IDCT_1D(), the even part (0, 2, 4, 6) and the odd part (1, 3, 5, 7)
+ * are computed separately and then added/subtracted.
+ * Only r[0..n-1] may be non-zero (n = 2, 4 or 8), so the products of the
+ * rows known to be zero are skipped. For the same reason, when only lanes
+ * 0-3 are non-zero (halves = 1), lanes 4-7 of the result are zero */
+
+__SSE2__FN void IDCTpass_SSE2(__m128i * r, const int shift, const int bias, const int n, const int halves)
+{
+__m128i     t04, t26, t13, t57;
+__m128i     tmp0, tmp1, tmp2, tmp3;
+__m128i     e0, e1, e2, e3;
+__m128i     o0, o1, o2, o3;
+__m128i     out[8][2];
+__m128i     round = _mm_set1_epi32(bias);
+__m128i     zero  = _mm_setzero_si128();
+uint8_t     h;
+
+
+    for( h = 0; h < halves; h++ )
+    {
+     // Interleave the coefficients that are multiplied together (lanes 0-3 first, then 4-7)
+        t04 = h ? _mm_unpackhi_epi16(r[0], n > 4 ? r[4] : zero) : _mm_unpacklo_epi16(r[0], n > 4 ? r[4] : zero);
+        t13 = h ? _mm_unpackhi_epi16(r[1], n > 2 ? r[3] : zero) : _mm_unpacklo_epi16(r[1], n > 2 ? r[3] : zero);
+
+        tmp0 = _mm_madd_epi16(t04, _mm_set1_epi32( PAIR(K4,  K4) ));
+        tmp1 = _mm_madd_epi16(t04, _mm_set1_epi32( PAIR(K4, -K4) ));
+
+        tmp0 = _mm_add_epi32(tmp0, round);
+        tmp1 = _mm_add_epi32(tmp1, round);
+
+        e0 = e3 = tmp0;
+        e1 = e2 = tmp1;
+
+        if( n > 2 )
+        {
+            t26  = h ? _mm_unpackhi_epi16(r[2], n > 4 ? r[6] : zero) : _mm_unpacklo_epi16(r[2], n > 4 ? r[6] : zero);
+            tmp2 = _mm_madd_epi16(t26, _mm_set1_epi32( PAIR(K2,  K6) ));
+            tmp3 = _mm_madd_epi16(t26, _mm_set1_epi32( PAIR(K6, -K2) ));
+
+            e0 = _mm_add_epi32(tmp0, tmp2);
+            e3 = _mm_sub_epi32(tmp0, tmp2);
+            e1 = _mm_add_epi32(tmp1, tmp3);
+            e2 = _mm_sub_epi32(tmp1, tmp3);
+        }
+
+        o0 = _mm_madd_epi16(t13, _mm_set1_epi32( PAIR( K1,  K3) ));
+        o1 = _mm_madd_epi16(t13, _mm_set1_epi32( PAIR( K3, -K7) ));
+        o2 = _mm_madd_epi16(t13, _mm_set1_epi32( PAIR( K5, -K1) ));
+        o3 = _mm_madd_epi16(t13, _mm_set1_epi32( PAIR( K7, -K5) ));
+
+        if( n > 4 )
+        {
+            t57 = h ? _mm_unpackhi_epi16(r[5], r[7]) : _mm_unpacklo_epi16(r[5], r[7]);
+
+            o0 = _mm_add_epi32( o0, _mm_madd_epi16(t57, _mm_set1_epi32( PAIR( K5,  K7) )) );
+            o1 = _mm_add_epi32( o1, _mm_madd_epi16(t57, _mm_set1_epi32( PAIR(-K1, -K5) )) );
+            o2 = _mm_add_epi32( o2, _mm_madd_epi16(t57, _mm_set1_epi32( PAIR( K7,  K3) )) );
+            o3 = _mm_add_epi32( o3, _mm_madd_epi16(t57, _mm_set1_epi32( PAIR( K3, -K1) )) );
+        }
+
+        out[0][h] = _mm_srai_epi32( _mm_add_epi32(e0, o0), shift );
+        out[7][h] = _mm_srai_epi32( _mm_sub_epi32(e0, o0), shift );
+        out[1][h] = _mm_srai_epi32( _mm_add_epi32(e1, o1), shift );
+        out[6][h] = _mm_srai_epi32( _mm_sub_epi32(e1, o1), shift );
+        out[2][h] = _mm_srai_epi32( _mm_add_epi32(e2, o2), shift );
+        out[5][h] = _mm_srai_epi32( _mm_sub_epi32(e2, o2), shift );
+        out[3][h] = _mm_srai_epi32( _mm_add_epi32(e3, o3), shift );
+        out[4][h] = _mm_srai_epi32( _mm_sub_epi32(e3, o3), shift );
+    }
+
+    for( h = 0; h < 8; h++ )
+    {
+        r[h] = _mm_packs_epi32(out[h][0], halves > 1 ? out[h][1] : zero);
+    }
+
+}
+
+
+// IDCT of a block whose non-zero coefficients are all in its top-left nxn corner
+__SSE2__FN void sparseIDCT_SSE2(const int16_t * coeffTbl, uint8_t * samples, size_t stride, const int n)
+{
+__m128i     r[8];
+uint8_t     i;
+
+
+    for( i = 0; i < n; i++ )
+    {
+        r[i] = _mm_loadu_si128( (const __m128i *)(coeffTbl + (i << 3)) );
+    }
+
+ // Column pass, then row pass (after transposing the block)
+    IDCTpass_SSE2( r, IDCT_PASS1_SHIFT, 1 << (IDCT_PASS1_SHIFT - 1), n, n > 4 ? 2 : 1 );
+    transpose8x8_SSE2( r );
+
+ // The level shift (+128) is folded into the rounding bias of the final pass
+    IDCTpass_SSE2( r, IDCT_PASS2_SHIFT, (1 << (IDCT_PASS2_SHIFT - 1)) + (128 << IDCT_PASS2_SHIFT), n, 2 );
+    transpose8x8_SSE2( r );
+
+    storeRows_SSE2( samples, stride, r );
+
+}
+
+
+__attribute__((target("sse2")))
+static void IDCT_SSE2(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
+{
+    sparseIDCT_SSE2( coeffTbl, samples, stride, 8 );
+}
+
+
+__attribute__((target("sse2")))
+static void IDCT4x4_SSE2(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
+{
+    sparseIDCT_SSE2( coeffTbl, samples, stride, 4 );
+}
+
+
+__attribute__((target("sse2")))
+static void IDCT2x2_SSE2(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
+{
+    sparseIDCT_SSE2( coeffTbl, samples, stride, 2 );
+}
+
+
+/* The AVX2 version does exactly the same arithmetic as the SSE2 version,
+ * but processes lanes 0-3 and 4-7 of each column pass in one register */
+
+__AVX2__FN __m256i interleave_AVX2(__m128i a, __m128i b)
+{
+    return _mm256_inserti128_si256( _mm256_castsi128_si256( _mm_unpacklo_epi16(a, b) ),
+                                    _mm_unpackhi_epi16(a, b), 1 );
+}
+
+
+__AVX2__FN void pack_AVX2(__m128i * lo, __m128i * hi, __m256i a, __m256i b)
+{
+__m256i     p;
+
+
+ // packs works within 128-bit lanes, so the 4-lane halves need to be rearranged
+    p   = _mm256_permute4x64_epi64( _mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0) );
+    *lo = _mm256_castsi256_si128(p);
+    *hi = _mm256_extracti128_si256(p, 1);
+
+}
+
+
+__AVX2__FN void IDCTpass_AVX2(__m128i * r, const int shift, const int bias, const int n)
+{
+__m256i     t04, t26, t13, t57;
+__m256i     tmp0, tmp1, tmp2, tmp3;
+__m256i     e0, e1, e2, e3;
+__m256i     o0, o1, o2, o3;
+__m256i     round = _mm256_set1_epi32(bias);
+__m128i     zero  = _mm_setzero_si128();
+
+
+    t04 = interleave_AVX2(r[0], n > 4 ? r[4] : zero);
+    t13 = interleave_AVX2(r[1], n > 2 ? r[3] : zero);
+
+    tmp0 = _mm256_madd_epi16(t04, _mm256_set1_epi32( PAIR(K4,  K4) ));
+    tmp1 = _mm256_madd_epi16(t04, _mm256_set1_epi32( PAIR(K4, -K4) ));
+
+    tmp0 = _mm256_add_epi32(tmp0, round);
+    tmp1 = _mm256_add_epi32(tmp1, round);
+
+    e0 = e3 = tmp0;
+    e1 = e2 = tmp1;
+
+    if( n > 2 )
+    {
+        t26  = interleave_AVX2(r[2], n > 4 ? r[6] : zero);
+        tmp2 = _mm256_madd_epi16(t26, _mm256_set1_epi32( PAIR(K2,  K6) ));
+        tmp3 = _mm256_madd_epi16(t26, _mm256_set1_epi32( PAIR(K6, -K2) ));
+
+        e0 = _mm256_add_epi32(tmp0, tmp2);
+        e3 = _mm256_sub_epi32(tmp0, tmp2);
+        e1 = _mm256_add_epi32(tmp1, tmp3);
+        e2 = _mm256_sub_epi32(tmp1, tmp3);
+    }
+
+    o0 = _mm256_madd_epi16(t13, _mm256_set1_epi32( PAIR( K1,  K3) ));
+    o1 = _mm256_madd_epi16(t13, _mm256_set1_epi32( PAIR( K3, -K7) ));
+    o2 = _mm256_madd_epi16(t13, _mm256_set1_epi32( PAIR( K5, -K1) ));
+    o3 = _mm256_madd_epi16(t13, _mm256_set1_epi32( PAIR( K7, -K5) ));
+
+    if( n > 4 )
+    {
+        t57 = interleave_AVX2(r[5], r[7]);
+
+        o0 = _mm256_add_epi32( o0, _mm256_madd_epi16(t57, _mm256_set1_epi32( PAIR( K5,  K7) )) );
+        o1 = _mm256_add_epi32( o1, _mm256_madd_epi16(t57, _mm256_set1_epi32( PAIR(-K1, -K5) )) );
+        o2 = _mm256_add_epi32( o2, _mm256_madd_epi16(t57, _mm256_set1_epi32( PAIR( K7,  K3) )) );
+        o3 = _mm256_add_epi32( o3, _mm256_madd_epi16(t57, _mm256_set1_epi32( PAIR( K3, -K1) )) );
+    }
+
+    pack_AVX2( &r[0], &r[7], _mm256_srai_epi32( _mm256_add_epi32(e0, o0), shift ),
+                             _mm256_srai_epi32( _mm256_sub_epi32(e0, o0), shift ) );
+    pack_AVX2( &r[1], &r[6], _mm256_srai_epi32( _mm256_add_epi32(e1, o1), shift ),
+                             _mm256_srai_epi32( _mm256_sub_epi32(e1, o1), shift ) );
+    pack_AVX2( &r[2], &r[5], _mm256_srai_epi32( _mm256_add_epi32(e2, o2), shift ),
+                             _mm256_srai_epi32( _mm256_sub_epi32(e2, o2), shift ) );
+    pack_AVX2( &r[3], &r[4], _mm256_srai_epi32( _mm256_add_epi32(e3, o3), shift ),
+                             _mm256_srai_epi32( _mm256_sub_epi32(e3, o3), shift ) );
+
+}
+
+
+__AVX2__FN void sparseIDCT_AVX2(const int16_t * coeffTbl, uint8_t * samples, size_t stride, const int n)
+{
+__m128i     r[8];
+uint8_t     i;
+
+
+    for( i = 0; i < n; i++ )
+    {
+        r[i] = _mm_loadu_si128( (const __m128i *)(coeffTbl + (i << 3)) );
+    }
+
+    IDCTpass_AVX2( r, IDCT_PASS1_SHIFT, 1 << (IDCT_PASS1_SHIFT - 1), n );
+    transpose8x8_SSE2( r );
+    IDCTpass_AVX2( r, IDCT_PASS2_SHIFT, (1 << (IDCT_PASS2_SHIFT - 1)) + (128 << IDCT_PASS2_SHIFT), n );
+    transpose8x8_SSE2( r );
+
+    storeRows_SSE2( samples, stride, r );
+
+}
+
+
+__attribute__((target("avx2")))
+static void IDCT_AVX2(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
+{
+    sparseIDCT_AVX2( coeffTbl, samples, stride, 8 );
+}
+
+
+__attribute__((target("avx2")))
+static void IDCT4x4_AVX2(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
+{
+    sparseIDCT_AVX2( coeffTbl, samples, stride, 4 );
+}
+
+
+__attribute__((target("avx2")))
+static void IDCT2x2_AVX2(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
+{
+    sparseIDCT_AVX2( coeffTbl, samples, stride, 2 );
+}
+
+
+/* SSE2 version of performFastIDCT(). The AAN multipliers are applied with
+ * pmulhw, which keeps the high 16 bits of a product. So, each multiplier 
+ * is split into a small integer and a 16-bit fraction below 0.5 (e.g. 
+ * 1.847 * x = 2 * x - 0.153 * x). It's not bit-exact with the scalar
+ * version (pmulhw truncates rather than rounds) but is just as accurate */
+
+#define     Q_0_414     27146       // (1.414213562 - 1) * 2E16
+#define     Q_0_152     9977        // (2 - 1.847759065) * 2E16
+#define     Q_0_082     5400        // (1.082392200 - 1) * 2E16
+#define     Q_0_386     25354       // (3 - 2.613125930) * 2E16
+
+#define     MULHI(v, q)     _mm_mulhi_epi16( v, _mm_set1_epi16(q) )
+
+
+// Only r[0..n-1] may be non-zero, the additions of zero rows are left out by the compiler
+__SSE2__FN void FastIDCTpass_SSE2(__m128i * r, const int n)
+{
+__m128i     tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+__m128i     tmp10, tmp11, tmp12, tmp13;
+__m128i     z5, z10, z11, z12, z13, d;
+__m128i     r2, r3, r4, r5, r6, r7;
+
+
+    r2 = n > 2 ? r[2] : _mm_setzero_si128();
+    r3 = n > 2 ? r[3] : _mm_setzero_si128();
+    r4 = n > 4 ? r[4] : _mm_setzero_si128();
+    r5 = n > 4 ? r[5] : _mm_setzero_si128();
+    r6 = n > 4 ? r[6] : _mm_setzero_si128();
+    r7 = n > 4 ? r[7] : _mm_setzero_si128();
+    
+ // Even part
+    tmp10 = _mm_add_epi16( r[0], r4 );
+    tmp11 = _mm_sub_epi16( r[0], r4 );
+    tmp13 = _mm_add_epi16( r2, r6 );
+    d     = _mm_sub_epi16( r2, r6 );
+    tmp12 = _mm_sub_epi16( _mm_add_epi16( d, MULHI(d, Q_0_414) ), tmp13 );
+    
+    tmp0  = _mm_add_epi16( tmp10, tmp13 );
+    tmp3  = _mm_sub_epi16( tmp10, tmp13 );
+    tmp1  = _mm_add_epi16( tmp11, tmp12 );
+    tmp2  = _mm_sub_epi16( tmp11, tmp12 );
+    
+ // Odd part
+    z13   = _mm_add_epi16( r5, r3 );
+    z10   = _mm_sub_epi16( r5, r3 );
+    z11   = _mm_add_epi16( r[1], r7 );
+    z12   = _mm_sub_epi16( r[1], r7 );
+    
+    tmp7  = _mm_add_epi16( z11, z13 );
+    d     = _mm_sub_epi16( z11, z13 );
+    tmp11 = _mm_add_epi16( d, MULHI(d, Q_0_414) );
+    
+    d     = _mm_add_epi16( z10, z12 );
+    z5    = _mm_sub_epi16( _mm_add_epi16(d, d), MULHI(d, Q_0_152) );
+    tmp10 = _mm_sub_epi16( _mm_add_epi16( z12, MULHI(z12, Q_0_082) ), z5 );
+    d     = _mm_add_epi16( _mm_add_epi16(z10, z10), z10 );
+    tmp12 = _mm_sub_epi16( z5, _mm_sub_epi16( d, MULHI(z10, Q_0_386) ) );
+    
+    tmp6  = _mm_sub_epi16( tmp12, tmp7 );
+    tmp5  = _mm_sub_epi16( tmp11, tmp6 );
+    tmp4  = _mm_add_epi16( tmp10, tmp5 );
+    
+    r[0]  = _mm_add_epi16( tmp0, tmp7 );
+    r[7]  = _mm_sub_epi16( tmp0, tmp7 );
+    r[1]  = _mm_add_epi16( tmp1, tmp6 );
+    r[6]  = _mm_sub_epi16( tmp1, tmp6 );
+    r[2]  = _mm_add_epi16( tmp2, tmp5 );
+    r[5]  = _mm_sub_epi16( tmp2, tmp5 );
+    r[4]  = _mm_add_epi16( tmp3, tmp4 );
+    r[3]  = _mm_sub_epi16( tmp3, tmp4 );
+
+}
+
+
+#define     FAST_SIMD_BIAS      ( (1 << (AAN_SCALE_BITS + 2)) + (128 << (AAN_SCALE_BITS + 3)) )
+
+
+__SSE2__FN void sparseFastIDCT_SSE2(const int16_t * coeffTbl, uint8_t * samples, size_t stride, const int n)
+{
+__m128i     r[8];
+__m128i     bias = _mm_set1_epi16( FAST_SIMD_BIAS );
+uint8_t     i;
+
+
+    for( i = 0; i < n; i++ )
+    {
+        r[i] = _mm_loadu_si128( (const __m128i *)(coeffTbl + (i << 3)) );
+    }
+
+    FastIDCTpass_SSE2( r, n );
+    transpose8x8_SSE2( r );
+    FastIDCTpass_SSE2( r, n );
+    transpose8x8_SSE2( r );
+
+ // Descale, level shift and clamp to 8-bit
+    for( i = 0; i < 8; i++ )
+    {
+        r[i] = _mm_srai_epi16( _mm_adds_epi16(r[i], bias), AAN_SCALE_BITS + 3 );
+    }
+    
+    storeRows_SSE2( samples, stride, r );
+
+}
+
+
+__attribute__((target("sse2")))
+static void FastIDCT_SSE2(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
+{
+    sparseFastIDCT_SSE2( coeffTbl, samples, stride, 8 );
+}
+
+
+__attribute__((target("sse2")))
+static void FastIDCT4x4_SSE2(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
+{
+    sparseFastIDCT_SSE2( coeffTbl, samples, stride, 4 );
+}
+
+
+__attribute__((target("sse2")))
+static void FastIDCT2x2_SSE2(const int16_t * coeffTbl, uint8_t * samples, size_t stride)
+{
+    sparseFastIDCT_SSE2( coeffTbl, samples, stride, 2 );
+}
+
+
+// A DC coefficient goes through both passes unchanged
+static uint8_t FastDC_SSE2(int16_t coeff)
+{
+int     value;
+
+
+    value = coeff + FAST_SIMD_BIAS;
+    value = value > 32767 ? 32767 : value;
+    
+    return bound( value >> (AAN_SCALE_BITS + 3) );
+}
+
+
+/* YCbCr to XRGB conversion, 8 pixels at a time on 16-bit lanes. The scalar
+ * routines divide by 32 and 64, i.e. they round towards zero. So, to give
+ * exactly the same results, the arithmetic shifts (which round down) are
+ * applied to negative values after adding divisor - 1. All the products
+ * fit in 16 bits, and the saturating packs do what bound() does */
+
+__SSE2__FN __m128i div_SSE2(__m128i x, const int bits)
+{
+    return _mm_srai_epi16( _mm_add_epi16( x, _mm_and_si128( _mm_srai_epi16(x, 15), _mm_set1_epi16((1 << bits) - 1) ) ), bits );
+}
+
+
+// Red, green and blue offsets (Exp1, Exp2, Exp3) of 8 pairs of Cb and Cr samples
+__SSE2__FN void chroma_SSE2(__m128i cb, __m128i cr, __m128i * e)
+{
+    cb   = _mm_sub_epi16( cb, _mm_set1_epi16(128) );
+    cr   = _mm_sub_epi16( cr, _mm_set1_epi16(128) );
+
+    e[0] = div_SSE2( _mm_mullo_epi16(cr, _mm_set1_epi16(45)), 5 );
+    e[1] = div_SSE2( _mm_add_epi16( _mm_mullo_epi16(cb, _mm_set1_epi16(11)), _mm_mullo_epi16(cr, _mm_set1_epi16(23)) ), 5 );
+    e[2] = div_SSE2( _mm_mullo_epi16(cb, _mm_set1_epi16(113)), 6 );
+}
+
+
+/* Packs 4 pixels of 32-bit lanes holding 3 bytes each (the fourth being 
+ * zero) into 12 contiguous bytes, at the bottom of the register. Each 
+ * 64-bit lane is packed into 6 bytes, then the upper one is moved down */
+
+__SSE2__FN __m128i pack24_SSE2(__m128i p)
+{
+    p = _mm_or_si128( _mm_and_si128( p, _mm_set_epi32(0, 0xFFFFFF, 0, 0xFFFFFF) ),
+                      _mm_srli_epi64( _mm_and_si128( p, _mm_set_epi32(0xFFFFFF, 0, 0xFFFFFF, 0) ), 8 ) );
+    
+    return _mm_or_si128( _mm_and_si128( p, _mm_set_epi32(0, 0, 0xFFFF, -1) ), _mm_srli_si128( _mm_and_si128( p, _mm_set_epi32(0xFFFF, -1, 0, 0) ), 2 ) );
+}
+
+
+// Stores 8 pixels of the format, returns where the next pixels go
+__SSE2__FN uint8_t * storePixels_SSE2(uint8_t * dest, __m128i y, const __m128i * e, uint8_t format)
+{
+__m128i     red, green, blue;
+__m128i     lo, hi, p0, p1;
+__m128i     x;
+
+
+    red   = _mm_add_epi16( y, e[0] );
+    green = _mm_sub_epi16( y, e[1] );
+    blue  = _mm_add_epi16( y, e[2] );
+
+ // Clamp to 8-bit and interleave the bytes of the format, in pairs
+    red   = _mm_packus_epi16(red, red);
+    green = _mm_packus_epi16(green, green);
+    blue  = _mm_packus_epi16(blue, blue);
+    x     = format == JPG_FORMAT_RGBA ? _mm_set1_epi8(-1) : _mm_setzero_si128();
+    
+    if( format == JPG_FORMAT_RGBA || format == JPG_FORMAT_RGB24 )
+    {
+        lo = _mm_unpacklo_epi8( red, green );
+        hi = _mm_unpacklo_epi8( blue, x );
+    }
+    
+    else
+    {
+        lo = _mm_unpacklo_epi8( blue, green );
+        hi = _mm_unpacklo_epi8( red, x );
+    }
+    
+    p0 = _mm_unpacklo_epi16(lo, hi);
+    p1 = _mm_unpackhi_epi16(lo, hi);
+    
+    if( format == JPG_FORMAT_RGB24 || format == JPG_FORMAT_BGR24 )
+    {
+        p0 = pack24_SSE2(p0);
+        p1 = pack24_SSE2(p1);
+        
+        _mm_storeu_si128( (__m128i *)dest, _mm_or_si128( p0, _mm_slli_si128(p1, 12) ) );
+        _mm_storel_epi64( (__m128i *)(dest + 16), _mm_srli_si128(p1, 4) );
+        return dest + 24;
+    }
+
+    _mm_storeu_si128( (__m128i *)dest,     p0 );
+    _mm_storeu_si128( (__m128i *)dest + 1, p1 );
+    return dest + 32;
+}
+
+
+__SSE2__FN __m128i load8_SSE2(const uint8_t * src)
+{
+    return _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i *)src ), _mm_setzero_si128() );
+}
+
+
+__SSE2__FN void YCbCr11row_SSE2(uint8_t * dest, const uint8_t * Yrow, const uint8_t * Cbrow, const uint8_t * Crrow, uint16_t n, uint8_t format)
+{
+__m128i     e[3];
+uint16_t    i;
+
+
+    for( i = 0; i + 8 <= n; i += 8 )
+    {
+        chroma_SSE2( load8_SSE2(Cbrow + i), load8_SSE2(Crrow + i), e );
+        dest = storePixels_SSE2( dest, load8_SSE2(Yrow + i), e, format );
+    }
+
+    if( i < n )
+    {
+        YCbCr11row( dest, Yrow + i, Cbrow + i, Crrow + i, n - i, format );
+    }
+
+}
+
+
+/* For 2x1 sampled chroma, the offsets of each Cb, Cr pair are duplicated 
+ * in-register to cover both pixels that share it */
+
+__SSE2__FN void YCbCr21row_SSE2(uint8_t * dest, const uint8_t * Yrow, const uint8_t * Cbrow, const uint8_t * Crrow, uint16_t n, uint8_t format)
+{
+__m128i     e[3], lo[3], hi[3];
+__m128i     y;
+uint32_t    cb, cr;
+uint16_t    i;
+uint8_t     k;
+
+
+    for( i = 0; i + 16 <= n; i += 16 )
+    {
+        chroma_SSE2( load8_SSE2(Cbrow + (i >> 1)), load8_SSE2(Crrow + (i >> 1)), e );
+
+        for( k = 0; k < 3; k++ )
+        {
+            lo[k] = _mm_unpacklo_epi16( e[k], e[k] );
+            hi[k] = _mm_unpackhi_epi16( e[k], e[k] );
+        }
+
+        y    = _mm_loadu_si128( (const __m128i *)(Yrow + i) );
+        dest = storePixels_SSE2( dest, _mm_unpacklo_epi8(y, _mm_setzero_si128()), lo, format );
+        dest = storePixels_SSE2( dest, _mm_unpackhi_epi8(y, _mm_setzero_si128()), hi, format );
+    }
+
+ // Rows of a single block are 8 pixels wide, with just 4 Cb and Cr samples
+    if( i + 8 <= n )
+    {
+        memcpy( &cb, Cbrow + (i >> 1), 4 );
+        memcpy( &cr, Crrow + (i >> 1), 4 );
+        
+        chroma_SSE2( _mm_unpacklo_epi8( _mm_cvtsi32_si128(cb), _mm_setzero_si128() ),
+                     _mm_unpacklo_epi8( _mm_cvtsi32_si128(cr), _mm_setzero_si128() ), e );
+
+        for( k = 0; k < 3; k++ )
+        {
+            lo[k] = _mm_unpacklo_epi16( e[k], e[k] );
+        }
+
+        dest = storePixels_SSE2( dest, load8_SSE2(Yrow + i), lo, format );
+        i += 8;
+    }
+
+    if( i < n )
+    {
+        YCbCr21row( dest, Yrow + i, Cbrow + (i >> 1), Crrow + (i >> 1), n - i, format );
+    }
+
+}
+
+
+// Luma is stored as it is, with no chroma offsets to add
+__SSE2__FN void Grayrow_SSE2(uint8_t * dest, const uint8_t * Yrow, uint16_t n, uint8_t format)
+{
+const __m128i   e[3] = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+uint16_t        i;
+
+
+    for( i = 0; i + 8 <= n; i += 8 )
+    {
+        dest = storePixels_SSE2( dest, load8_SSE2(Yrow + i), e, format );
+    }
+
+    if( i < n )
+    {
+        Grayrow( dest, Yrow + i, n - i, format );
+    }
+
+}
+
+
+#define     COLOUR_ROUTINES_SSE2(name, format)                                                                              \
+__attribute__((target("sse2")))                                                                                             \
+static void YCbCr11to##name##row_SSE2(void * dest, const uint8_t * Yrow, const uint8_t * Cbrow, const uint8_t * Crrow, uint16_t n) \
+{                                                                                                                           \
+    YCbCr11row_SSE2( (uint8_t *)dest, Yrow, Cbrow, Crrow, n, format );                                                      \
+}                                                                                                                           \
+__attribute__((target("sse2")))                                                                                             \
+static void YCbCr21to##name##row_SSE2(void * dest, const uint8_t * Yrow, const uint8_t * Cbrow, const uint8_t * Crrow, uint16_t n) \
+{                                                                                                                           \
+    YCbCr21row_SSE2( (uint8_t *)dest, Yrow, Cbrow, Crrow, n, format );                                                      \
+}                                                                                                                           \
+__attribute__((target("sse2")))                                                                                             \
+static void Grayto##name##row_SSE2(void * dest, const uint8_t * Yrow, uint16_t n)                                           \
+{                                                                                                                           \
+    Grayrow_SSE2( (uint8_t *)dest, Yrow, n, format );                                                                       \
+}
+
+COLOUR_ROUTINES_SSE2(XRGB,  JPG_FORMAT_XRGB)
+COLOUR_ROUTINES_SSE2(BGRX,  JPG_FORMAT_BGRX)
+COLOUR_ROUTINES_SSE2(RGBA,  JPG_FORMAT_RGBA)
+COLOUR_ROUTINES_SSE2(RGB24, JPG_FORMAT_RGB24)
+COLOUR_ROUTINES_SSE2(BGR24, JPG_FORMAT_BGR24)
+
+
+#endif
@@ -0,0 +1,639 @@
+#ifndef  __JPGENC_C
+#define  __JPGENC_C
+
+/* A minimal baseline JPEG encoder, used to generate the benchmark corpus.
+ * It writes the standard (Annex K) quantization and Huffman tables scaled
+ * to a quality, with any of the sampling factors the decoder handles, and
+ * optionally restart intervals, in grayscale, YCbCr, or the CMYK and YCCK
+ * of Adobe. Only integer arithmetic is used, so the images it writes are
+ * the same on every machine */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+typedef struct
+{
+    uint8_t *   data;               // the JPEG image being written
+    size_t      size;               // bytes written so far
+    size_t      capacity;           // bytes allocated
+    uint32_t    bits;               // bits waiting to be written, in the low 'nbits' bits
+    uint8_t     nbits;
+    uint8_t     failed;             // set when memory runs out
+}
+JPGENC_STREAM;
+
+
+typedef struct
+{
+    uint16_t    code[256];          // Huffman code of each symbol
+    uint8_t     size[256];          // length of the code of each symbol
+}
+JPGENC_HUFFTBL;
+
+
+// Natural order index of each zigzag position
+static const uint8_t jpgenc_zigzag[64] =
+{
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+
+// Quantization tables of Annex K, for a quality of 50
+static const uint8_t jpgenc_lumaQ[64] =
+{
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+};
+
+static const uint8_t jpgenc_chromaQ[64] =
+{
+    17,  18,  24,  47,  99,  99,  99,  99,
+    18,  21,  26,  66,  99,  99,  99,  99,
+    24,  26,  56,  99,  99,  99,  99,  99,
+    47,  66,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99
+};
+
+
+// Huffman tables of Annex K: the number of codes of each length, then the symbols
+static const uint8_t jpgenc_lumaDCbits[16]   = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const uint8_t jpgenc_chromaDCbits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const uint8_t jpgenc_DCvals[12]       = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const uint8_t jpgenc_lumaACbits[16]   = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const uint8_t jpgenc_lumaACvals[162]  =
+{
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+static const uint8_t jpgenc_chromaACbits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const uint8_t jpgenc_chromaACvals[162] =
+{
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+
+// DCT basis, C(u) / 2 * cos((2x + 1) * u * pi / 16) in 2.14 fixed point
+static const int16_t jpgenc_basis[8][8] =
+{
+    {   5793,   5793,   5793,   5793,   5793,   5793,   5793,   5793 },
+    {   8035,   6811,   4551,   1598,  -1598,  -4551,  -6811,  -8035 },
+    {   7568,   3135,  -3135,  -7568,  -7568,  -3135,   3135,   7568 },
+    {   6811,  -1598,  -8035,  -4551,   4551,   8035,   1598,  -6811 },
+    {   5793,  -5793,  -5793,   5793,   5793,  -5793,  -5793,   5793 },
+    {   4551,  -8035,   1598,   6811,  -6811,  -1598,   8035,  -4551 },
+    {   3135,  -7568,   7568,  -3135,  -3135,   7568,  -7568,   3135 },
+    {   1598,  -4551,   6811,  -8035,   8035,  -6811,   4551,  -1598 }
+};
+
+
+static void jpgenc_putByte(JPGENC_STREAM * s, uint8_t byte)
+{
+uint8_t *   grown;
+
+
+    if( s->size == s->capacity )
+    {
+        s->capacity = s->capacity ? 2 * s->capacity : 65536;
+        grown       = realloc(s->data, s->capacity);
+        if( !grown )
+        {
+            s->failed = 1;
+            s->size   = 0;
+            return;
+        }
+        s->data = grown;
+    }
+
+    s->data[s->size++] = byte;
+}
+
+
+static void jpgenc_putWord(JPGENC_STREAM * s, uint16_t word)
+{
+    jpgenc_putByte(s, word >> 8);
+    jpgenc_putByte(s, word & 0xFF);
+}
+
+
+// Writes the n low bits of 'bits' to the entropy coded data, stuffing a 0 after each 0xFF
+static void jpgenc_putBits(JPGENC_STREAM * s, uint32_t bits, uint8_t n)
+{
+uint8_t     byte;
+
+
+    s->bits   = (s->bits << n) | (bits & ((1u << n) - 1));
+    s->nbits += n;
+
+    while( s->nbits >= 8 )
+    {
+        byte = (s->bits >> (s->nbits - 8)) & 0xFF;
+        jpgenc_putByte(s, byte);
+        if( byte == 0xFF )
+            jpgenc_putByte(s, 0);
+        s->nbits -= 8;
+    }
+}
+
+
+// Pads the last byte of entropy coded data with 1s
+static void jpgenc_flushBits(JPGENC_STREAM * s)
+{
+    if( s->nbits )
+        jpgenc_putBits(s, 0x7F, 8 - s->nbits);
+}
+
+
+static void jpgenc_buildHuffman(JPGENC_HUFFTBL * tbl, const uint8_t * bits, const uint8_t * vals)
+{
+uint16_t    code = 0;
+uint8_t     len, i, k = 0;
+
+
+    for( len = 1; len <= 16; len++ )
+    {
+        for( i = 0; i < bits[len - 1]; i++, k++ )
+        {
+            tbl->code[ vals[k] ] = code++;
+            tbl->size[ vals[k] ] = len;
+        }
+        code <<= 1;
+    }
+}
+
+
+static void jpgenc_writeDHT(JPGENC_STREAM * s, uint8_t classId, const uint8_t * bits, const uint8_t * vals)
+{
+uint16_t    n = 0;
+uint8_t     i;
+
+
+    for( i = 0; i < 16; i++ )
+        n += bits[i];
+
+    jpgenc_putWord(s, 0xFFC4);
+    jpgenc_putWord(s, 2 + 1 + 16 + n);
+    jpgenc_putByte(s, classId);
+    for( i = 0; i < 16; i++ )
+        jpgenc_putByte(s, bits[i]);
+    for( i = 0; i < n; i++ )
+        jpgenc_putByte(s, vals[i]);
+}
+
+
+// Forward DCT of a block of level shifted samples, then quantization, into zigzag order
+static void jpgenc_transform(const int16_t * samples, const uint16_t * Q, int16_t * coeffs)
+{
+int32_t     rows[64], cols[64];
+int32_t     sum, q;
+uint8_t     u, v, x, y;
+
+
+    for( y = 0; y < 8; y++ )
+    {
+        for( u = 0; u < 8; u++ )
+        {
+            for( sum = 0, x = 0; x < 8; x++ )
+                sum += samples[y * 8 + x] * jpgenc_basis[u][x];
+
+            rows[y * 8 + u] = (sum + (1 << 10)) >> 11;
+        }
+    }
+
+    for( v = 0; v < 8; v++ )
+    {
+        for( u = 0; u < 8; u++ )
+        {
+            for( sum = 0, y = 0; y < 8; y++ )
+                sum += rows[y * 8 + u] * jpgenc_basis[v][y];
+
+            sum = (sum + (1 << 16)) >> 17;
+            q   = Q[v * 8 + u];
+
+         // Rounded to the nearest, symmetrically around 0
+            cols[v * 8 + u] = sum >= 0 ? (sum + q / 2) / q : -((-sum + q / 2) / q);
+        }
+    }
+
+    for( u = 0; u < 64; u++ )
+        coeffs[u] = (int16_t)cols[ jpgenc_zigzag[u] ];
+}
+
+
+static uint8_t jpgenc_category(int value)
+{
+uint8_t     n = 0;
+
+    if( value < 0 )
+        value = -value;
+
+    for( ; value; value >>= 1 )
+        n++;
+
+    return n;
+}
+
+
+static void jpgenc_encodeBlock(JPGENC_STREAM * s, const int16_t * coeffs, int16_t * DCpred,
+                               const JPGENC_HUFFTBL * DC, const JPGENC_HUFFTBL * AC)
+{
+int         diff, value;
+uint8_t     cat, run = 0;
+uint8_t     k;
+
+
+    diff    = coeffs[0] - *DCpred;
+    *DCpred = coeffs[0];
+    cat     = jpgenc_category(diff);
+
+    jpgenc_putBits(s, DC->code[cat], DC->size[cat]);
+    if( cat )
+        jpgenc_putBits(s, diff < 0 ? diff + (1 << cat) - 1 : diff, cat);
+
+    for( k = 1; k < 64; k++ )
+    {
+        value = coeffs[k];
+        if( !value )
+        {
+            run++;
+            continue;
+        }
+
+     // Runs of more than 15 zeros are written as ZRL symbols
+        for( ; run > 15; run -= 16 )
+            jpgenc_putBits(s, AC->code[0xF0], AC->size[0xF0]);
+
+        cat = jpgenc_category(value);
+        jpgenc_putBits(s, AC->code[run << 4 | cat], AC->size[run << 4 | cat]);
+        jpgenc_putBits(s, value < 0 ? value + (1 << cat) - 1 : value, cat);
+        run = 0;
+    }
+
+    if( run )
+        jpgenc_putBits(s, AC->code[0x00], AC->size[0x00]);
+}
+
+
+/* Sampling factors and colour space of an image. Each component is 1 to 4
+ * blocks across and down an MCU (of at most 10 blocks), and the largest
+ * factors must be multiples of the others. 1 component is grayscale, 3 are
+ * YCbCr, and 4 are the CMYK (transform 0) or YCCK (transform 2) of Adobe,
+ * which are written with an Adobe segment and inverted inks */
+
+typedef struct
+{
+    uint8_t     nc;                 // Number of components: 1, 3 or 4
+    uint8_t     transform;          // Of 4 components, as the Adobe segment: 0 = CMYK, 2 = YCCK
+    uint8_t     H[4];               // Blocks of each component across an MCU
+    uint8_t     V[4];               // Blocks of each component down an MCU
+}
+JPGENC_LAYOUT;
+
+
+// YCbCr of an RGB pixel
+static void jpgenc_YCbCr(int32_t r, int32_t g, int32_t b, uint8_t * Y, uint8_t * Cb, uint8_t * Cr)
+{
+    *Y  = (uint8_t)( ( 19595 * r + 38470 * g +  7471 * b + 32768) >> 16 );
+    *Cb = (uint8_t)( (-11059 * r - 21709 * g + 32768 * b + (128 << 16) + 32767) >> 16 );
+    *Cr = (uint8_t)( ( 32768 * r - 27439 * g -  5329 * b + (128 << 16) + 32767) >> 16 );
+}
+
+
+/* Encodes a w x h image of RGB (or, for a single component, gray) samples
+ * into a malloc'd JPEG image of the given layout, whose size is returned (0
+ * if memory ran out or the layout is invalid). A restart marker is written
+ * every 'restart' MCUs (0 = none). The inverted black of a CMYK or YCCK
+ * image is the largest of red, green and blue, and the other inverted inks
+ * are red, green and blue over it, so that the decoded colour is the same */
+
+size_t jpgenc_encodeLayout(uint8_t ** out, const uint8_t * pixels, uint16_t w, uint16_t h, const JPGENC_LAYOUT * layout,
+                           uint8_t quality, uint16_t restart)
+{
+JPGENC_STREAM       s;
+JPGENC_HUFFTBL      DC[2], AC[2];
+uint16_t            Q[2][64];
+uint8_t *           planes[4];
+uint8_t             table[4];
+int16_t             block[64], coeffs[64];
+int16_t             DCpred[4] = { 0, 0, 0, 0 };
+uint32_t            pw, ph, cw[4], ch;
+uint32_t            mx, my, bx, by, x, y, sx, sy;
+uint32_t            nMCUs = 0;
+uint32_t            scale, sum;
+int32_t             r, g, b, k;
+const uint8_t *     p;
+uint8_t             nc = layout->nc;
+uint8_t             hsf = 1, vsf = 1, hr, vr;
+uint8_t             c, i, nBlocks = 0, rst = 0;
+
+
+    memset(&s, 0, sizeof(s));
+    *out = NULL;
+
+    if( nc != 1 && nc != 3 && nc != 4 )
+        return 0;
+
+    for( c = 0; c < nc; c++ )
+    {
+        if( layout->H[c] < 1 || layout->H[c] > 4 || layout->V[c] < 1 || layout->V[c] > 4 )
+            return 0;
+
+        hsf      = layout->H[c] > hsf ? layout->H[c] : hsf;
+        vsf      = layout->V[c] > vsf ? layout->V[c] : vsf;
+        nBlocks += layout->H[c] * layout->V[c];
+    }
+
+    for( c = 0; c < nc; c++ )
+    {
+        if( hsf % layout->H[c] || vsf % layout->V[c] || nBlocks > 10 )
+            return 0;
+    }
+
+ // The chroma of YCbCr and YCCK images has tables of its own
+    for( c = 0; c < nc; c++ )
+        table[c] = (c == 1 || c == 2) && (nc == 3 || layout->transform == 2);
+
+ // The planes are extended to whole MCUs by repeating the last column and row
+    pw = (w + 8 * hsf - 1) / (8 * hsf) * (8 * hsf);
+    ph = (h + 8 * vsf - 1) / (8 * vsf) * (8 * vsf);
+
+    planes[0] = malloc(pw * ph * nc);
+    if( !planes[0] )
+        return 0;
+    for( c = 1; c < nc; c++ )
+        planes[c] = planes[c - 1] + pw * ph;
+
+    for( y = 0; y < ph; y++ )
+    {
+        for( x = 0; x < pw; x++ )
+        {
+            p = pixels + ( (size_t)(y < h ? y : h - 1u) * w + (x < w ? x : w - 1u) ) * (nc == 1 ? 1 : 3);
+
+            if( nc == 1 )
+            {
+                planes[0][y * pw + x] = p[0];
+                continue;
+            }
+
+            r = p[0];
+            g = p[1];
+            b = p[2];
+
+            if( nc == 4 )
+            {
+                k = r > g ? r : g;
+                k = k > b ? k : b;
+                r = k ? (r * 255 + k / 2) / k : 255;
+                g = k ? (g * 255 + k / 2) / k : 255;
+                b = k ? (b * 255 + k / 2) / k : 255;
+                planes[3][y * pw + x] = (uint8_t)k;
+
+             // YCCK is the YCbCr of the uninverted inks
+                if( layout->transform == 2 )
+                {
+                    r = 255 - r;
+                    g = 255 - g;
+                    b = 255 - b;
+                }
+
+                else
+                {
+                    planes[0][y * pw + x] = (uint8_t)r;
+                    planes[1][y * pw + x] = (uint8_t)g;
+                    planes[2][y * pw + x] = (uint8_t)b;
+                    continue;
+                }
+            }
+
+            jpgenc_YCbCr(r, g, b, &planes[0][y * pw + x], &planes[1][y * pw + x], &planes[2][y * pw + x]);
+        }
+    }
+
+ // Components are subsampled in place, by averaging each group of samples
+    for( c = 0; c < nc; c++ )
+    {
+        hr    = hsf / layout->H[c];
+        vr    = vsf / layout->V[c];
+        cw[c] = pw / hr;
+        ch    = ph / vr;
+
+        for( y = 0; y < ch && hr * vr > 1; y++ )
+        {
+            for( x = 0; x < cw[c]; x++ )
+            {
+                for( sum = 0, sy = 0; sy < vr; sy++ )
+                    for( sx = 0; sx < hr; sx++ )
+                        sum += planes[c][(y * vr + sy) * pw + x * hr + sx];
+
+                planes[c][y * cw[c] + x] = (uint8_t)( (sum + hr * vr / 2) / (hr * vr) );
+            }
+        }
+    }
+
+ // Quantization tables scaled to the quality, as the IJG encoder does
+    quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+    scale   = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+
+    for( i = 0; i < 64; i++ )
+    {
+        sum     = (jpgenc_lumaQ[i] * scale + 50) / 100;
+        Q[0][i] = sum < 1 ? 1 : sum > 255 ? 255 : sum;
+        sum     = (jpgenc_chromaQ[i] * scale + 50) / 100;
+        Q[1][i] = sum < 1 ? 1 : sum > 255 ? 255 : sum;
+    }
+
+    jpgenc_buildHuffman(&DC[0], jpgenc_lumaDCbits, jpgenc_DCvals);
+    jpgenc_buildHuffman(&AC[0], jpgenc_lumaACbits, jpgenc_lumaACvals);
+    jpgenc_buildHuffman(&DC[1], jpgenc_chromaDCbits, jpgenc_DCvals);
+    jpgenc_buildHuffman(&AC[1], jpgenc_chromaACbits, jpgenc_chromaACvals);
+
+ // SOI and a JFIF APP0 segment, or for CMYK and YCCK, an Adobe APP14 segment
+    jpgenc_putWord(&s, 0xFFD8);
+
+    if( nc == 4 )
+    {
+        jpgenc_putWord(&s, 0xFFEE);
+        jpgenc_putWord(&s, 14);
+        jpgenc_putByte(&s, 'A');
+        jpgenc_putByte(&s, 'd');
+        jpgenc_putByte(&s, 'o');
+        jpgenc_putByte(&s, 'b');
+        jpgenc_putByte(&s, 'e');
+        jpgenc_putWord(&s, 100);
+        jpgenc_putWord(&s, 0);
+        jpgenc_putWord(&s, 0);
+        jpgenc_putByte(&s, layout->transform);
+    }
+
+    else
+    {
+        jpgenc_putWord(&s, 0xFFE0);
+        jpgenc_putWord(&s, 16);
+        jpgenc_putByte(&s, 'J');
+        jpgenc_putByte(&s, 'F');
+        jpgenc_putByte(&s, 'I');
+        jpgenc_putByte(&s, 'F');
+        jpgenc_putByte(&s, 0);
+        jpgenc_putWord(&s, 0x0101);
+        jpgenc_putByte(&s, 0);
+        jpgenc_putWord(&s, 1);
+        jpgenc_putWord(&s, 1);
+        jpgenc_putWord(&s, 0);
+    }
+
+    for( c = 0; c < (table[1] ? 2 : 1); c++ )
+    {
+        jpgenc_putWord(&s, 0xFFDB);
+        jpgenc_putWord(&s, 2 + 65);
+        jpgenc_putByte(&s, c);
+        for( i = 0; i < 64; i++ )
+            jpgenc_putByte(&s, (uint8_t)Q[c][ jpgenc_zigzag[i] ]);
+    }
+
+    jpgenc_putWord(&s, 0xFFC0);
+    jpgenc_putWord(&s, 8 + 3 * nc);
+    jpgenc_putByte(&s, 8);
+    jpgenc_putWord(&s, h);
+    jpgenc_putWord(&s, w);
+    jpgenc_putByte(&s, nc);
+    for( c = 0; c < nc; c++ )
+    {
+        jpgenc_putByte(&s, c + 1);
+        jpgenc_putByte(&s, layout->H[c] << 4 | layout->V[c]);
+        jpgenc_putByte(&s, table[c]);
+    }
+
+    jpgenc_writeDHT(&s, 0x00, jpgenc_lumaDCbits, jpgenc_DCvals);
+    jpgenc_writeDHT(&s, 0x10, jpgenc_lumaACbits, jpgenc_lumaACvals);
+    if( table[1] )
+    {
+        jpgenc_writeDHT(&s, 0x01, jpgenc_chromaDCbits, jpgenc_DCvals);
+        jpgenc_writeDHT(&s, 0x11, jpgenc_chromaACbits, jpgenc_chromaACvals);
+    }
+
+    if( restart )
+    {
+        jpgenc_putWord(&s, 0xFFDD);
+        jpgenc_putWord(&s, 4);
+        jpgenc_putWord(&s, restart);
+    }
+
+    jpgenc_putWord(&s, 0xFFDA);
+    jpgenc_putWord(&s, 6 + 2 * nc);
+    jpgenc_putByte(&s, nc);
+    for( c = 0; c < nc; c++ )
+    {
+        jpgenc_putByte(&s, c + 1);
+        jpgenc_putByte(&s, table[c] ? 0x11 : 0x00);
+    }
+    jpgenc_putByte(&s, 0);
+    jpgenc_putByte(&s, 63);
+    jpgenc_putByte(&s, 0);
+
+    for( my = 0; my < ph / (8 * vsf); my++ )
+    {
+        for( mx = 0; mx < pw / (8 * hsf); mx++ )
+        {
+         // At the end of each restart interval, the bits are flushed and the DC predictions reset
+            if( restart && nMCUs && nMCUs % restart == 0 )
+            {
+                jpgenc_flushBits(&s);
+                jpgenc_putWord(&s, 0xFFD0 + rst);
+                rst = (rst + 1) & 7;
+                DCpred[0] = DCpred[1] = DCpred[2] = DCpred[3] = 0;
+            }
+
+            for( c = 0; c < nc; c++ )
+            {
+                for( by = 0; by < layout->V[c]; by++ )
+                {
+                    for( bx = 0; bx < layout->H[c]; bx++ )
+                    {
+                        for( y = 0; y < 8; y++ )
+                            for( x = 0; x < 8; x++ )
+                                block[y * 8 + x] = planes[c][( (my * layout->V[c] + by) * 8 + y ) * cw[c] +
+                                                             (mx * layout->H[c] + bx) * 8 + x] - 128;
+
+                        jpgenc_transform(block, Q[table[c]], coeffs);
+                        jpgenc_encodeBlock(&s, coeffs, &DCpred[c], &DC[table[c]], &AC[table[c]]);
+                    }
+                }
+            }
+
+            nMCUs++;
+        }
+    }
+
+    jpgenc_flushBits(&s);
+    jpgenc_putWord(&s, 0xFFD9);
+
+    free(planes[0]);
+
+    if( s.failed )
+    {
+        free(s.data);
+        return 0;
+    }
+
+    *out = s.data;
+    return s.size;
+}
+
+
+/* Encodes a grayscale (nc = 1) or YCbCr image whose luma is sampled hsf x
+ * vsf times as often as chroma (1 to 4 each way) */
+
+size_t jpgenc_encode(uint8_t ** out, const uint8_t * pixels, uint16_t w, uint16_t h, uint8_t nc,
+                     uint8_t hsf, uint8_t vsf, uint8_t quality, uint16_t restart)
+{
+JPGENC_LAYOUT       layout = { 3, 0, { 1, 1, 1, 1 }, { 1, 1, 1, 1 } };
+
+
+    if( nc == 1 )
+        layout.nc = 1;
+    else
+    {
+        layout.H[0] = hsf;
+        layout.V[0] = vsf;
+    }
+
+    return jpgenc_encodeLayout(out, pixels, w, h, &layout, quality, restart);
+}
+
+#endif
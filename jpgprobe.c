@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jpg.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define JPGPROBE_HAVE_DIRS
+#endif
+
+
+/* The catalog is a header followed by a record per image that was probed,
+ * each followed by the path of the image (not NUL terminated). Fields are
+ * in the byte order of the machine that wrote the catalog */
+
+#define CATALOG_MAGIC       "JPGC"
+#define CATALOG_VERSION     1
+
+typedef struct __attribute__((packed))
+{
+    char        magic[4];           // "JPGC"
+    uint32_t    version;            // version of the catalog format
+    uint32_t    nRecords;           // number of records that follow
+}
+CATALOG_HEADER;
+
+
+typedef struct __attribute__((packed))
+{
+    uint64_t    size;               // size of the image in bytes
+    uint32_t    scan;               // offset of the entropy coded data of the first scan
+    uint16_t    width;              // width of the image
+    uint16_t    height;             // height of the image
+    uint16_t    restart;            // MCUs per restart interval (0 = none)
+    uint8_t     nc;                 // number of components
+    uint8_t     sampling;           // sampling factors of luminance (horizontal << 4 | vertical)
+    uint8_t     process;            // coding process (0 = baseline)
+    uint8_t     reserved;
+    uint16_t    pathLength;         // length of the path that follows
+}
+CATALOG_RECORD;
+
+
+typedef struct
+{
+    char     ** files;
+    size_t      n;
+    size_t      capacity;
+}
+fileList;
+
+
+// Adds a JPEG file to the list
+static int addFile(fileList * list, const char * file)
+{
+char     ** grown;
+
+
+    if( list->n == list->capacity )
+    {
+        list->capacity = list->capacity ? 2 * list->capacity : 256;
+        grown          = realloc(list->files, list->capacity * sizeof(char *));
+        if( !grown )
+        {
+            printf("Error: out of memory\n");
+            return 0;
+        }
+        list->files = grown;
+    }
+
+    list->files[list->n] = strdup(file);
+    if( !list->files[list->n] )
+    {
+        printf("Error: out of memory\n");
+        return 0;
+    }
+
+    list->n++;
+    return 1;
+}
+
+
+#ifdef JPGPROBE_HAVE_DIRS
+
+// Symbolic links are only followed when asked to, so that walking a tree can't loop
+static int isDirectory(const char * path, int follow)
+{
+struct stat     st;
+
+    return !(follow ? stat(path, &st) : lstat(path, &st)) && S_ISDIR(st.st_mode);
+}
+
+
+// Adds the JPEG files (*.jpg or *.jpeg) of a directory tree to the list
+static int addDirectory(fileList * list, const char * dir)
+{
+DIR *           d;
+struct dirent * entry;
+const char *    ext;
+char *          path;
+int             added = 1;
+
+
+    d = opendir(dir);
+    if( !d )
+    {
+        printf("Error: can't read directory %s\n", dir);
+        return 0;
+    }
+
+    while( added && (entry = readdir(d)) )
+    {
+        if( !strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..") )
+            continue;
+
+        path = malloc(strlen(dir) + strlen(entry->d_name) + 2);
+        if( !path )
+        {
+            printf("Error: out of memory\n");
+            added = 0;
+            break;
+        }
+
+        sprintf(path, "%s/%s", dir, entry->d_name);
+
+     // Symbolic links to directories are skipped, they may lead back up the tree
+        if( isDirectory(path, 0) )
+        {
+            added = addDirectory(list, path);
+        }
+
+        else
+        {
+            ext = strrchr(entry->d_name, '.');
+            if( ext && (!strcasecmp(ext, ".jpg") || !strcasecmp(ext, ".jpeg")) )
+                added = addFile(list, path);
+        }
+
+        free(path);
+    }
+
+    closedir(d);
+    return added;
+}
+
+#endif
+
+
+// Writes the images that were probed to the catalog
+static int writeCatalog(const char * catalog, const fileList * list, const jpg_info_t * infos, size_t nProbed)
+{
+CATALOG_HEADER      header;
+CATALOG_RECORD      record;
+FILE *              fp;
+size_t              i, len;
+
+
+    fp = fopen(catalog, "wb");
+    if( !fp )
+        return 0;
+
+    memcpy(header.magic, CATALOG_MAGIC, 4);
+    header.version  = CATALOG_VERSION;
+    header.nRecords = (uint32_t)nProbed;
+    fwrite(&header, sizeof(header), 1, fp);
+
+    for( i = 0; i < list->n; i++ )
+    {
+        if( !infos[i].width )
+            continue;
+
+        len = strlen(list->files[i]);
+
+        record.size       = infos[i].size;
+        record.scan       = infos[i].scan;
+        record.width      = infos[i].width;
+        record.height     = infos[i].height;
+        record.restart    = infos[i].restart;
+        record.nc         = infos[i].nc;
+        record.sampling   = infos[i].hsf << 4 | infos[i].vsf;
+        record.process    = infos[i].process;
+        record.reserved   = 0;
+        record.pathLength = len < UINT16_MAX ? (uint16_t)len : UINT16_MAX;
+
+        fwrite(&record, sizeof(record), 1, fp);
+        fwrite(list->files[i], 1, record.pathLength, fp);
+    }
+
+    return !fclose(fp);
+}
+
+
+static int usage(void)
+{
+    printf("Usage: jpgprobe [-t threads] [-o catalog] <jpgfile | directory>...\n\n");
+    printf("Probes the JPEG files (and the *.jpg or *.jpeg files of directory trees) for\n");
+    printf("their dimensions and layout without decoding them, on several threads, and\n");
+    printf("prints what was found, or writes it to a binary catalog\n");
+    return -1;
+}
+
+
+int main(int argc, char *argv[])
+{
+fileList        list = { NULL, 0, 0 };
+jpg_info_t *    infos;
+const char *    catalog = NULL;
+size_t          i, failed;
+int             threads = 1;
+int             arg;
+int             added = 1;
+
+    if( argc < 2 )
+      return usage();
+
+ // On as many threads as there are processors unless told otherwise
+#ifdef JPGPROBE_HAVE_DIRS
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    for( arg = 1; arg < argc && added; arg++ )
+    {
+        if( !strcmp(argv[arg], "-t") && arg + 1 < argc )
+        {
+            threads = atoi(argv[++arg]);
+        }
+
+        else if( !strcmp(argv[arg], "-o") && arg + 1 < argc )
+        {
+            catalog = argv[++arg];
+        }
+
+        else if( argv[arg][0] == '-' )
+        {
+            return usage();
+        }
+
+#ifdef JPGPROBE_HAVE_DIRS
+        else if( isDirectory(argv[arg], 1) )
+        {
+            added = addDirectory(&list, argv[arg]);
+        }
+#endif
+
+        else
+        {
+            added = addFile(&list, argv[arg]);
+        }
+    }
+
+    if( !added )
+        return 1;
+
+    infos = malloc(list.n * sizeof(jpg_info_t) + 1);
+    if( !infos )
+    {
+        printf("Error: out of memory\n");
+        return 1;
+    }
+
+    failed = jpg_probe_batch((const char * const *)list.files, list.n, infos, threads > 0 ? threads : 1);
+
+    if( catalog )
+    {
+        if( !writeCatalog(catalog, &list, infos, list.n - failed) )
+        {
+            printf("Error: can't write %s\n", catalog);
+            failed = list.n;
+        }
+
+        printf("Probed %zu of %zu files\n", list.n - failed, list.n);
+    }
+
+    else
+    {
+        for( i = 0; i < list.n; i++ )
+        {
+            if( !infos[i].width )
+                printf("%s: not a JPEG image\n", list.files[i]);
+            else
+                printf("%s: %ux%u, %u components, %ux%u sampling, restart %u, scan at %u, SOF%u\n",
+                       list.files[i], infos[i].width, infos[i].height, infos[i].nc, infos[i].hsf, infos[i].vsf,
+                       infos[i].restart, infos[i].scan, infos[i].process);
+        }
+    }
+
+    for( i = 0; i < list.n; i++ )
+        free(list.files[i]);
+    free(list.files);
+    free(infos);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,544 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "jpg.c"
+#include "jpgenc.c"
+
+
+/* Tests of the kernels of the decoder, which is compiled in along with
+ * them (so that its static kernels can be called directly). Each SIMD
+ * kernel the CPU supports is checked against the portable C kernel it
+ * replaces, which it must match bit for bit, and the accuracy of the IDCTs
+ * is measured against a floating point IDCT */
+
+#define TEST_BLOCKS     200000      // Random blocks per range of coefficients
+#define ACCURACY_BLOCKS 20000       // Random blocks per quality
+#define REDUCED_MSE     16.0        // Largest mean squared error of the reduced size IDCTs against averaged samples
+#define ROW_PIXELS      69          // Rows of 1 to ROW_PIXELS pixels cover every tail of the SIMD loops
+#define ROW_GUARD       64          // Bytes past the end of a row that must be left alone
+#define ROW_REPEATS     16          // Random rows per kernel and length
+
+
+// Xorshift, so that the tests are the same everywhere
+static uint32_t random32(void)
+{
+static uint32_t     state = 2463534242u;
+
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    return state;
+}
+
+
+typedef struct
+{
+    const char    * name;
+    IDCTkernels     kernels;
+}
+namedKernels;
+
+
+// The accurate IDCT kernels the CPU supports, the C kernels first
+static size_t accurateKernels(namedKernels * sets)
+{
+size_t      n = 0;
+
+
+    sets[n++] = (namedKernels){ "c", { 8, DC_reference, IDCT2x2_reference, IDCT4x4_reference, IDCT_reference } };
+
+#ifdef JPG_SIMD_X86
+    __builtin_cpu_init();
+
+    if( __builtin_cpu_supports("sse2") )
+        sets[n++] = (namedKernels){ "sse2", { 8, DC_reference, IDCT2x2_SSE2, IDCT4x4_SSE2, IDCT_SSE2 } };
+    if( __builtin_cpu_supports("avx2") )
+        sets[n++] = (namedKernels){ "avx2", { 8, DC_reference, IDCT2x2_AVX2, IDCT4x4_AVX2, IDCT_AVX2 } };
+#endif
+
+    return n;
+}
+
+
+// Random coefficients in [-range, range) in the top-left nxn corner of the block, zero elsewhere
+static void randomBlock(int16_t * coeffTbl, uint8_t n, int32_t range)
+{
+uint8_t     x, y;
+
+
+    memset(coeffTbl, 0, 64 * sizeof(int16_t));
+
+    for( y = 0; y < n; y++ )
+    {
+        for( x = 0; x < n; x++ )
+        {
+         // Half of the AC coefficients are zero, as in real images most are
+            if( (x || y) && (random32() & 1) )
+                continue;
+
+            coeffTbl[(y << 3) + x] = (int16_t)( (int32_t)(random32() % (uint32_t)(2 * range)) - range );
+        }
+    }
+}
+
+
+static int sameBlock(const uint8_t * a, const uint8_t * b, const char * name, const char * kernel,
+                     const int16_t * coeffTbl)
+{
+uint8_t     i;
+
+
+    if( !memcmp(a, b, 64) )
+        return 1;
+
+    printf("  %s %s differs from the C IDCT for the block:\n", name, kernel);
+    for( i = 0; i < 64; i++ )
+        printf("%6d%s", coeffTbl[i], (i & 7) == 7 ? "\n" : "");
+
+    return 0;
+}
+
+
+/* Every accurate kernel, sparse ones included, must give the same samples
+ * as the full C IDCT. From small coefficients to the whole 16-bit range,
+ * where the first pass saturates */
+
+static int testIDCT(void)
+{
+static const int32_t    ranges[] = { 64, 1024, 4096, 32768 };
+static const uint8_t    sizes[]  = { 1, 2, 4, 8 };
+namedKernels            sets[3];
+int16_t                 coeffTbl[64];
+uint8_t                 reference[64];
+uint8_t                 samples[64];
+size_t                  nSets, k, r, i;
+uint8_t                 n;
+int                     ok = 1;
+
+
+    nSets = accurateKernels(sets);
+
+    printf("IDCT kernels:");
+    for( k = 0; k < nSets; k++ )
+        printf(" %s", sets[k].name);
+    printf("\n");
+
+    for( r = 0; r < sizeof(ranges) / sizeof(ranges[0]) && ok; r++ )
+    {
+        for( i = 0; i < TEST_BLOCKS && ok; i++ )
+        {
+            n = sizes[i & 3];
+            randomBlock(coeffTbl, n, ranges[r]);
+            IDCT_reference(coeffTbl, reference, 8);
+
+            for( k = 0; k < nSets && ok; k++ )
+            {
+                sets[k].kernels.IDCT8x8(coeffTbl, samples, 8);
+                ok = sameBlock(samples, reference, sets[k].name, "IDCT8x8", coeffTbl);
+
+                if( ok && n <= 4 )
+                {
+                    sets[k].kernels.IDCT4x4(coeffTbl, samples, 8);
+                    ok = sameBlock(samples, reference, sets[k].name, "IDCT4x4", coeffTbl);
+                }
+
+                if( ok && n <= 2 )
+                {
+                    sets[k].kernels.IDCT2x2(coeffTbl, samples, 8);
+                    ok = sameBlock(samples, reference, sets[k].name, "IDCT2x2", coeffTbl);
+                }
+
+                if( ok && n == 1 )
+                {
+                    memset(samples, sets[k].kernels.DC(coeffTbl[0]), 64);
+                    ok = sameBlock(samples, reference, sets[k].name, "DC", coeffTbl);
+                }
+            }
+        }
+
+        printf("  coefficients in [%6d, %5d): %s\n", -ranges[r], ranges[r], ok ? "ok" : "failed");
+    }
+
+    return ok;
+}
+
+
+/* Samples of a block of dequantized coefficients (natural order) by a
+ * floating point IDCT, level shifted and clamped, but not rounded */
+
+static void floatIDCT(const double * coeffs, double * samples)
+{
+static double   basis[8][8];        // C(u) / 2 * cos((2x + 1) * u * pi / 16), C(0) = 1 / sqrt(2)
+double          rows[64];
+double          sum;
+uint8_t         u, v, x, y;
+
+
+    if( basis[0][0] == 0 )
+    {
+        for( u = 0; u < 8; u++ )
+            for( x = 0; x < 8; x++ )
+                basis[u][x] = (u ? 0.5 : 0.5 / sqrt(2.0)) * cos((2 * x + 1) * u * M_PI / 16);
+    }
+
+    for( v = 0; v < 8; v++ )
+    {
+        for( x = 0; x < 8; x++ )
+        {
+            for( sum = 0, u = 0; u < 8; u++ )
+                sum += coeffs[v * 8 + u] * basis[u][x];
+
+            rows[v * 8 + x] = sum;
+        }
+    }
+
+    for( y = 0; y < 8; y++ )
+    {
+        for( x = 0; x < 8; x++ )
+        {
+            for( sum = 0, v = 0; v < 8; v++ )
+                sum += rows[v * 8 + x] * basis[v][y];
+
+            sum += 128;
+            samples[y * 8 + x] = sum < 0 ? 0 : sum > 255 ? 255 : sum;
+        }
+    }
+}
+
+
+typedef struct
+{
+    const char    * name;
+    uint8_t         idct;           // JPG_IDCT_ACCURATE or JPG_IDCT_FAST, for the dequantization
+    uint8_t         size;           // Of the blocks of samples: 8, or 4, 2 and 1 for the reduced size IDCTs
+    void         (* IDCT8x8)(const int16_t * coeffTbl, uint8_t * samples, size_t stride);
+    uint32_t        peak;           // Largest error in the samples, against the floating point IDCT
+    double          squares;        // Sum of the squared errors
+}
+accuracyKernel;
+
+
+/* A block of random samples, or a smooth one: a random gradient and a wave
+ * of at most a quarter of a cycle per sample, with a little noise, which is
+ * what most blocks of a photograph look like */
+
+static void accuracyBlock(int16_t * block, uint8_t smooth)
+{
+double      base, gx, gy, amplitude, fx, fy, phase, value;
+uint8_t     x, y;
+
+
+    if( !smooth )
+    {
+        for( x = 0; x < 64; x++ )
+            block[x] = (int16_t)(random32() & 255) - 128;
+        return;
+    }
+
+    base      = 32 + random32() % 192;
+    gx        = (double)(random32() % 17) - 8;
+    gy        = (double)(random32() % 17) - 8;
+    amplitude = random32() % 48;
+    fx        = (random32() % 64) * M_PI / 256;
+    fy        = (random32() % 64) * M_PI / 256;
+    phase     = (random32() % 64) * M_PI / 32;
+
+    for( y = 0; y < 8; y++ )
+    {
+        for( x = 0; x < 8; x++ )
+        {
+            value = base + gx * (x - 3.5) + gy * (y - 3.5) + amplitude * cos(fx * x + fy * y + phase);
+            value = value + (double)(random32() % 5) - 2;
+            block[y * 8 + x] = (int16_t)lround(value < 0 ? 0 : value > 255 ? 255 : value) - 128;
+        }
+    }
+}
+
+
+/* Measures the error of IDCT kernels against a floating point IDCT, on
+ * blocks transformed and quantized by the test encoder with the luma table
+ * of Annex K scaled to a quality (as the IJG encoder does). A sample of a
+ * reduced size IDCT is measured against the average of the samples of the
+ * floating point IDCT that it covers */
+
+static void measureAccuracy(accuracyKernel * kernels, size_t nKernels, uint8_t quality, uint8_t smooth)
+{
+Component               component;
+uint16_t                Q[64];
+uint8_t                 QntzTbl[64];
+int16_t                 block[64];
+int16_t                 quantized[64];
+int16_t                 coeffTbl[64];
+double                  coeffs[64];
+double                  reference[64];
+double                  average;
+uint8_t                 samples[64];
+size_t                  k, i;
+int32_t                 scale, value;
+uint32_t                error;
+uint8_t                 j, n, x, y, step;
+
+
+    memset(&component, 0, sizeof(component));
+    component.QntzTbl = QntzTbl;
+
+    scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+
+    for( i = 0; i < 64; i++ )
+    {
+        value = (jpgenc_lumaQ[i] * scale + 50) / 100;
+        Q[i]  = value < 1 ? 1 : value > 255 ? 255 : value;
+    }
+
+    for( i = 0; i < 64; i++ )
+        QntzTbl[i] = (uint8_t)Q[ jpgenc_zigzag[i] ];
+
+    for( k = 0; k < nKernels; k++ )
+    {
+        kernels[k].peak    = 0;
+        kernels[k].squares = 0;
+    }
+
+    for( i = 0; i < ACCURACY_BLOCKS; i++ )
+    {
+        accuracyBlock(block, smooth);
+        jpgenc_transform(block, Q, quantized);
+
+        for( j = 0; j < 64; j++ )
+            coeffs[ deZigZagVector[j] ] = quantized[j] * QntzTbl[j];
+
+        floatIDCT(coeffs, reference);
+
+        for( k = 0; k < nKernels; k++ )
+        {
+            setupDequantTbl(&component, kernels[k].idct);
+
+            for( j = 0; j < 64; j++ )
+                coeffTbl[ deZigZagVector[j] ] = (int16_t)(quantized[j] * component.DequantTbl[j]);
+
+            kernels[k].IDCT8x8(coeffTbl, samples, 8);
+
+            step = 8 / kernels[k].size;
+
+            for( y = 0; y < kernels[k].size; y++ )
+            {
+                for( x = 0; x < kernels[k].size; x++ )
+                {
+                    for( average = 0, n = 0; n < step * step; n++ )
+                        average += reference[ (y * step + n / step) * 8 + x * step + n % step ];
+                    average /= step * step;
+
+                    error = (uint32_t)abs( samples[y * 8 + x] - (int)lround(average) );
+                    kernels[k].peak     = error > kernels[k].peak ? error : kernels[k].peak;
+                    kernels[k].squares += (samples[y * 8 + x] - average) * (samples[y * 8 + x] - average);
+                }
+            }
+        }
+    }
+}
+
+
+/* Measures the IDCT kernels at a range of qualities. The full size kernels
+ * are measured on blocks of random samples, the worst case: the accurate
+ * IDCT must stay within 1 of the floating point IDCT, the fast IDCT is only
+ * reported. The reduced size IDCTs drop the highest frequencies, which
+ * averaging the samples only attenuates, so they are measured on smooth
+ * blocks: their mean squared error against the average of the samples they
+ * cover must stay within REDUCED_MSE */
+
+static int testAccuracy(void)
+{
+static const uint8_t    qualities[] = { 1, 25, 50, 75, 90, 95, 98, 100 };
+accuracyKernel          kernels[3];
+accuracyKernel          reduced[3];
+size_t                  nKernels = 0, k, q;
+double                  mse;
+int                     ok = 1, reducedOk = 1;
+
+
+    kernels[nKernels++] = (accuracyKernel){ "accurate", JPG_IDCT_ACCURATE, 8, IDCT_reference, 0, 0 };
+    kernels[nKernels++] = (accuracyKernel){ "fast c", JPG_IDCT_FAST, 8, performFastIDCT, 0, 0 };
+#ifdef JPG_SIMD_X86
+    if( __builtin_cpu_supports("sse2") )
+        kernels[nKernels++] = (accuracyKernel){ "fast sse2", JPG_IDCT_FAST, 8, FastIDCT_SSE2, 0, 0 };
+#endif
+
+    reduced[0] = (accuracyKernel){ "1/2 (4x4)", JPG_IDCT_ACCURATE, 4, reducedIDCT4, 0, 0 };
+    reduced[1] = (accuracyKernel){ "1/4 (2x2)", JPG_IDCT_ACCURATE, 2, reducedIDCT2, 0, 0 };
+    reduced[2] = (accuracyKernel){ "1/8 (1x1)", JPG_IDCT_ACCURATE, 1, reducedIDCT1, 0, 0 };
+
+    printf("\nIDCT accuracy against a floating point IDCT (peak error, mean squared error):\n%-8s", "quality");
+    for( k = 0; k < nKernels; k++ )
+        printf(" %20s", kernels[k].name);
+    printf("\n");
+
+    for( q = 0; q < sizeof(qualities) / sizeof(qualities[0]); q++ )
+    {
+        measureAccuracy(kernels, nKernels, qualities[q], 0);
+
+        printf("%-8u", qualities[q]);
+        for( k = 0; k < nKernels; k++ )
+            printf(" %9u %10.3f", kernels[k].peak, kernels[k].squares / (64.0 * ACCURACY_BLOCKS));
+        printf("\n");
+
+        if( kernels[0].peak > 1 )
+            ok = 0;
+    }
+
+    printf("  accurate IDCT within 1 of the floating point IDCT: %s\n", ok ? "ok" : "failed");
+
+    printf("\nReduced size IDCT accuracy against the average of a floating point IDCT, smooth blocks:\n%-8s", "quality");
+    for( k = 0; k < 3; k++ )
+        printf(" %20s", reduced[k].name);
+    printf("\n");
+
+    for( q = 0; q < sizeof(qualities) / sizeof(qualities[0]); q++ )
+    {
+        measureAccuracy(reduced, 3, qualities[q], 1);
+
+        printf("%-8u", qualities[q]);
+        for( k = 0; k < 3; k++ )
+        {
+            mse = reduced[k].squares / (reduced[k].size * reduced[k].size * (double)ACCURACY_BLOCKS);
+            printf(" %9u %10.3f", reduced[k].peak, mse);
+
+            if( mse > REDUCED_MSE )
+                reducedOk = 0;
+        }
+        printf("\n");
+    }
+
+    printf("  reduced size IDCTs within a mean squared error of %.0f of the average: %s\n", REDUCED_MSE,
+           reducedOk ? "ok" : "failed");
+    return ok && reducedOk;
+}
+
+
+#ifdef JPG_SIMD_X86
+
+// Converts a row of n pixels with the 1x1, 2x1 or grayscale routine of a format
+static void convertTestRow(const PixelFormat * format, uint8_t layout, uint8_t * dest, const uint8_t * Yrow,
+                       const uint8_t * Cbrow, const uint8_t * Crrow, uint16_t n)
+{
+    switch( layout )
+    {
+        case 0:  format->row11(dest, Yrow, Cbrow, Crrow, n); break;
+        case 1:  format->row21(dest, Yrow, Cbrow, Crrow, n); break;
+        default: format->gray(dest, Yrow, n);                break;
+    }
+}
+
+
+/* The SSE2 colour conversion must write the same pixels as the C routines
+ * for rows of any length (the SIMD loops handle 8 or 16 pixels at a time
+ * and leave the rest to the C code), and nothing past the end of the row */
+
+static int testRows(void)
+{
+static const char *     formatNames[] = { "XRGB", "BGRX", "RGBA", "RGB24", "BGR24" };
+static const char *     layoutNames[] = { "1x1", "2x1", "gray" };
+static const PixelFormat C[] =
+{
+    { 4, YCbCr11toXRGBrow,  YCbCr21toXRGBrow,  GraytoXRGBrow  },
+    { 4, YCbCr11toBGRXrow,  YCbCr21toBGRXrow,  GraytoBGRXrow  },
+    { 4, YCbCr11toRGBArow,  YCbCr21toRGBArow,  GraytoRGBArow  },
+    { 3, YCbCr11toRGB24row, YCbCr21toRGB24row, GraytoRGB24row },
+    { 3, YCbCr11toBGR24row, YCbCr21toBGR24row, GraytoBGR24row }
+};
+static const PixelFormat SSE2[] =
+{
+    { 4, YCbCr11toXRGBrow_SSE2,  YCbCr21toXRGBrow_SSE2,  GraytoXRGBrow_SSE2  },
+    { 4, YCbCr11toBGRXrow_SSE2,  YCbCr21toBGRXrow_SSE2,  GraytoBGRXrow_SSE2  },
+    { 4, YCbCr11toRGBArow_SSE2,  YCbCr21toRGBArow_SSE2,  GraytoRGBArow_SSE2  },
+    { 3, YCbCr11toRGB24row_SSE2, YCbCr21toRGB24row_SSE2, GraytoRGB24row_SSE2 },
+    { 3, YCbCr11toBGR24row_SSE2, YCbCr21toBGR24row_SSE2, GraytoBGR24row_SSE2 }
+};
+uint8_t                 Yrow[ROW_PIXELS], Cbrow[ROW_PIXELS], Crrow[ROW_PIXELS];
+uint8_t                 expected[ROW_PIXELS * 4 + ROW_GUARD];
+uint8_t                 actual[ROW_PIXELS * 4 + ROW_GUARD];
+uint16_t                n, i, r;
+uint8_t                 f, layout;
+int                     ok = 1;
+
+
+    printf("\nColour conversion rows, SSE2 against C, 1 to %u pixels:\n", ROW_PIXELS);
+
+    if( !__builtin_cpu_supports("sse2") )
+    {
+        printf("  no SSE2, skipped\n");
+        return 1;
+    }
+
+    for( f = 0; f < sizeof(C) / sizeof(C[0]); f++ )
+    {
+        for( layout = 0; layout < 3; layout++ )
+        {
+            for( n = 1; n <= ROW_PIXELS && ok; n++ )
+            {
+                for( r = 0; r < ROW_REPEATS && ok; r++ )
+                {
+                 // The chroma of 2x1 rows is only (n + 1) / 2 samples wide, the rest is never read
+                    for( i = 0; i < ROW_PIXELS; i++ )
+                    {
+                        Yrow[i]  = (uint8_t)random32();
+                        Cbrow[i] = (uint8_t)random32();
+                        Crrow[i] = (uint8_t)random32();
+                    }
+
+                    memset(expected, 0xA5, sizeof(expected));
+                    memset(actual,   0xA5, sizeof(actual));
+
+                    convertTestRow(&C[f],    layout, expected, Yrow, Cbrow, Crrow, n);
+                    convertTestRow(&SSE2[f], layout, actual,   Yrow, Cbrow, Crrow, n);
+
+                    if( memcmp(expected, actual, (size_t)n * C[f].size + ROW_GUARD) )
+                    {
+                        printf("  %s %s row of %u pixels differs from the C routine\n", formatNames[f], layoutNames[layout], n);
+                        ok = 0;
+                    }
+
+                    for( i = (uint16_t)(n * C[f].size); i < n * C[f].size + ROW_GUARD && ok; i++ )
+                    {
+                        if( expected[i] != 0xA5 )
+                        {
+                            printf("  %s %s row of %u pixels writes past its end\n", formatNames[f], layoutNames[layout], n);
+                            ok = 0;
+                        }
+                    }
+                }
+            }
+
+            printf("  %-5s %-4s: %s\n", formatNames[f], layoutNames[layout], ok ? "ok" : "failed");
+        }
+    }
+
+    return ok;
+}
+
+#else
+
+static int testRows(void)
+{
+    printf("\nColour conversion rows: no SIMD kernels in this build, skipped\n");
+    return 1;
+}
+
+#endif
+
+
+int main(void)
+{
+int     failed = 0;
+
+
+    failed += !testIDCT();
+    failed += !testAccuracy();
+    failed += !testRows();
+
+    printf("\n%s\n", failed ? "FAILED" : "All tests passed");
+    return failed ? 1 : 0;
+}